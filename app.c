@@ -6,7 +6,9 @@
 #include <netdb.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include "app.h"
 #include "config.h"
@@ -15,9 +17,26 @@
 #include "event.h"
 #include "packet.h"
 #include "device.h"
+#include "loop.h"
+#include "pool.h"
+#include "tick.h"
 
 #define APP_LISTEN_PORT     "socks_port"
 #define APP_DEFAULT_PORT    "34567"
+#define APP_DEVICE          "socks_device"
+#define APP_DEFAULT_DEVICE  "AM"
+
+#define APP_CONFIG_HIGH             "socks_backlog_high"
+#define APP_DEFAULT_HIGH            32768
+#define APP_CONFIG_LOW              "socks_backlog_low"
+#define APP_DEFAULT_LOW             8192
+#define APP_CONFIG_DEVICE_HIGH      "device_backlog_high"
+#define APP_DEFAULT_DEVICE_HIGH     262144
+#define APP_CONFIG_DEVICE_LOW       "device_backlog_low"
+#define APP_DEFAULT_DEVICE_LOW      65536
+
+// ms, a paused client looks at the backlog again
+#define APP_BACKLOG_CHECK   50
 
 #define APP_ERROR(s) log_error("APP", (s))
 #define APP_WARN(s)  log_warn ("APP", (s))
@@ -44,6 +63,10 @@
 #define REP_CMD_NOT_SUPPORTED   0x07
 #define REP_ADDR_NOT_SUPPORTED  0x08
 
+// length on the wire, the structs below have padding at the end
+#define SOCKS_REQ_LENGTH        10
+#define SOCKS_RES_LENGTH        10
+
 typedef struct method_request_s method_req_t;
 struct method_request_s {
         char ver;
@@ -82,25 +105,72 @@ struct socks_response_s {
 #define APP_HEADER_TYPE_CONNECT 0x02U
 #define APP_HEADER_TYPE_CLOSE   0x03U
 
+// sent by the side connected to the real server
+#define APP_HEADER_FLAG_REPLY   0x01U
+
+// the header is pushed in front of the payload before sending,
+// and pulled when received, payload always starts at pdu.
 #define APP_HEADER_LENGTH       (sizeof(app_hdr_t))
-#define APP_DATA_POINT(pkg)     ((pkg)->pdu + APP_HEADER_LENGTH)
-#define APP_HEADER_POINT(pkg)   ((pkg)->pdu)
+#define APP_DATA_POINT(pkg)     ((pkg)->pdu)
+#define APP_HEADER_POINT(pkg)   ((app_hdr_t*) ((pkg)->pdu - APP_HEADER_LENGTH))
 
 typedef struct app_hdr_s app_hdr_t;
 struct app_hdr_s {
-        uint8_t type;
+        uint8_t  type;
+        uint8_t  flag;
+        uint16_t cid;           // network byte order
 };
 
+/*
+ * a connection id is chosen by the side the real client connect to,
+ * the low bits tell the loop owning the client, so the answers from
+ * the other host go to the right loop at once.
+ */
+#define APP_CID_LOOP_BITS       5
+#define APP_CID_LOOP_MASK       ((1U << APP_CID_LOOP_BITS) - 1)
+#define APP_CID(slot, loop)     (((slot) << APP_CID_LOOP_BITS) | (loop))
+#define APP_CID_LOOP(cid)       ((cid) & APP_CID_LOOP_MASK)
+#define APP_CID_SLOT(cid)       ((cid) >> APP_CID_LOOP_BITS)
+
+// clients in one loop, and connection ids of the other host
+#define APP_MAX_CLIENTS         (1U << (16 - APP_CID_LOOP_BITS))
+#define APP_MAX_PEERS           (1U << 16)
+
+// a read fills a chain of segments, each of them fits with its
+// headers in a frame of the size the device sends when it is read.
+// the device copies the end of a segment only when its frame size
+// shrank since.
+#define APP_READ_SEGMENTS       8
+#define APP_WRITE_SEGMENTS      16
+
+// the smallest window of a connection
+#define APP_WINDOW_MIN(dev)     (2U * (unsigned int) app_segment_length(dev))
+
+// the flow of the connection for the scheduler and the backlog
+#define APP_FLOW(app)           ((uint32_t) ((app)->role == APP_ROLE_SERVER ? \
+                                 APP_HEADER_FLAG_REPLY : 0) << 16 | (app)->cid)
+
+
 static int create_and_bind(const char *port);
 static int app_input(event_t *ev);
 static int app_output(event_t *ev);
 static int app_connect(int fd);
 static int client_input(app_t *app);
 static int client_output(packet_t *pkg);
-static int app_check_write_queue();
-static app_t *app_find_by_fd(int fd);
+static int app_set_nonblock(int fd);
+static int app_segment_length(device_t *dev);
 static int app_close(app_t *app);
 static int app_output_finish(packet_t *pkg);
+static int app_route(packet_t *pkg);
+static int app_device_send(app_t *app, packet_t *pkg, uint8_t type);
+static unsigned int app_watermark(char *key, unsigned int def);
+static int app_congested(app_t *app, int len);
+static int app_drained(app_t *app);
+static int app_pause(app_t *app);
+static int app_resume(tick_t *tc);
+static int app_slot_get(app_t *app);
+static void app_slot_put(app_t *app);
+static app_t *app_find_by_cid(uint16_t cid, int reply);
 static int new_client_cli(packet_t *pkg);
 static int new_client_ser(packet_t *pkg);
 static int connect_client_cli(packet_t *pkg);
@@ -108,22 +178,30 @@ static int connect_client_ser(packet_t *pkg);
 static int trans_data(packet_t *pkg);
 static int close_client(packet_t *pkg);
 
-static queue_t *app_list;
-static queue_t *write_list;
-static app_ctl_t app_ctl;
-static app_t *client;
+// every loop has its own listen socket and its own clients
+static __thread queue_t  *app_list;
+static __thread app_ctl_t app_ctl;
+
+// clients of this loop by slot of cid, the free slots on a stack
+static __thread app_t   **clients;
+static __thread uint16_t *free_slots;
+static __thread int       free_top;
+
+// connections to real servers, by cid of the other host
+static __thread app_t   **peers;
 
 /*
  * The Application Module initialize function.
- * first, create two queue for clients and packet cache,
+ * first, create the client queue and the connection id tables,
  * then, create a socket and listen a port that clients will connect,
  * last, add an event to the event queue, waiting clients connect
  * or client transfer data.
+ * with worker loops, every worker calls it on its own thread.
  */
 int app_init()
 {
         char *port;
-        int   fd;
+        int   fd, i;
         event_t *ev;
 
         // create the application queue
@@ -134,13 +212,21 @@ int app_init()
 
         queue_init(app_list);
 
-        // create the write packet cache queue
-        if (!queue_create(write_list)) {
-                APP_ERROR("Can not create write cache queue.");
+        // create the connection id tables
+        clients    = (app_t**) calloc(APP_MAX_CLIENTS, sizeof(app_t*));
+        free_slots = (uint16_t*) malloc(APP_MAX_CLIENTS * sizeof(uint16_t));
+        peers      = (app_t**) calloc(APP_MAX_PEERS, sizeof(app_t*));
+        if (!clients || !free_slots || !peers) {
+                APP_ERROR("Can not alloc memory for connection id tables.");
                 return -1;
         }
 
-        queue_init(write_list);
+        // slot 0 first
+        for (i = 0; i < APP_MAX_CLIENTS; i++)
+        {
+                free_slots[i] = APP_MAX_CLIENTS - 1 - i;
+        }
+        free_top = APP_MAX_CLIENTS;
 
         // find app listen port
         port = config_find(APP_LISTEN_PORT);
@@ -150,8 +236,26 @@ int app_init()
                 app_ctl.port = APP_DEFAULT_PORT;
         }
 
+        // the device to the other host, a modem or a bond of them
+        app_ctl.dev = config_find(APP_DEVICE);
+        if (!app_ctl.dev || strlen(app_ctl.dev) != 2) {
+                app_ctl.dev = APP_DEFAULT_DEVICE;
+        }
+
+        app_ctl.high     = app_watermark(APP_CONFIG_HIGH, APP_DEFAULT_HIGH);
+        app_ctl.low      = app_watermark(APP_CONFIG_LOW, APP_DEFAULT_LOW);
+        app_ctl.dev_high = app_watermark(APP_CONFIG_DEVICE_HIGH, APP_DEFAULT_DEVICE_HIGH);
+        app_ctl.dev_low  = app_watermark(APP_CONFIG_DEVICE_LOW, APP_DEFAULT_DEVICE_LOW);
+
+        if (app_ctl.low > app_ctl.high) {
+                app_ctl.low = app_ctl.high;
+        }
+        if (app_ctl.dev_low > app_ctl.dev_high) {
+                app_ctl.dev_low = app_ctl.dev_high;
+        }
+
         // create and bind the socket
-        d = create_and_bind(app_ctl.port);
+        fd = create_and_bind(app_ctl.port);
         if (fd == -1) {
                 return -1;
         }
@@ -163,7 +267,7 @@ int app_init()
                 return -1;
         }
 
-        logf_info("APP", "Open socket with port %s successed.", port);
+        logf_info("APP", "Open socket with port %s successed.", app_ctl.port);
 
         // add event for clients connect
         if (!event_create(ev)) {
@@ -174,11 +278,16 @@ int app_init()
         ev->fd     = fd;
         ev->input  = app_input;
         ev->output = app_output;
+        ev->data   = NULL;
         ev->flag   = 0;
 
         set_event_active(ev);
         set_event_read(ev);
-        event_add(ev);
+
+        if (event_add(ev) == -1) {
+                event_free(ev);
+                return -1;
+        }
 
         APP_INFO("Initialize the APP MODULE successed.");
 
@@ -191,23 +300,41 @@ int app_init()
 int app_exit()
 {
         app_t    *app;
-        queue_t  *q;
+        queue_t  *q, *n;
         packet_t *pkg;
 
-        // free clients
-        for (q = app_list->next; q != app_list; q = q->next)
+        if (!app_list) {
+                return 0;
+        }
+
+        // free clients and their packets
+        for (q = app_list->next; q != app_list; q = n)
         {
+                n   = q->next;
                 app = queue_data(q, app_t, queue);
+
+                while (!queue_empty(&app->write_list))
+                {
+                        pkg = queue_data(queue_first(&app->write_list), packet_t, queue);
+                        queue_delete(&pkg->queue);
+                        packet_put(pkg);
+                }
+
+                if (app->timer) {
+                        tick_delete(app->timer);
+                        tick_free(app->timer);
+                }
+
                 close(app->fd);
-                free(app);
+                pool_free(POOL_APP, app);
         }
 
-        // free packets
-        for (q = write_list->next; q != write_list; q = q->next)
-        {
-                pkg = queue_data(q, packet_t, queue);
-                free(pkg);
-        }
+        free(app_list);
+        free(clients);
+        free(free_slots);
+        free(peers);
+
+        app_list = NULL;
 
         return 0;
 }
@@ -239,9 +366,18 @@ static int create_and_bind(const char *port)
                 }
 
                 // set option to reuse port quickly
-                opt = SO_REUSEADDR;
+                opt = 1;
                 setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
+                // every worker listens the same port,
+                // the kernel shares the clients between them
+                if (loop_workers() > 0 &&
+                    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+                        APP_ERROR(strerror(errno));
+                        close(fd);
+                        continue;
+                }
+
                 if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
                         break;
                 }
@@ -251,13 +387,13 @@ static int create_and_bind(const char *port)
                 close(fd);
         }
 
+        freeaddrinfo(res);
+
         if (p == NULL) {
                 APP_ERROR("Could not bind");
                 return -1;
         }
 
-        freeaddrinfo(res);
-
         return fd;
 }
 
@@ -275,19 +411,15 @@ static int app_input(event_t *ev)
         }
 
         // data transfer between clients
-        app_t *app = app_find_by_fd(ev->fd);
-        if (!app) {
-                return -1;
-        }
+        app_t *app = (app_t*) ev->data;
 
         return app->input(app);
 }
 
 /*
  * when a file descriptor can write, the Event Module will call this function back.
- * we could find the client by fd first, and then get the packet which is send
- * to this client from the write packet cache queue, and call function client_output
- * to send it.
+ * the client owns this event, send the first packet in its write queue
+ * by calling function client_output.
  */
 static int app_output(event_t *ev)
 {
@@ -297,36 +429,33 @@ static int app_output(event_t *ev)
         }
 
         packet_t *pkg;
-        queue_t  *q;
 
-        // find client
-        app_t *app = app_find_by_fd(ev->fd);
-        if (!app) {
-                return -1;
-        }
+        // the client owns this event
+        app_t *app = (app_t*) ev->data;
 
-        // find the first packet send to client
-        for (q = write_list->next; q != write_list; q = q->next)
-        {
-                pkg = queue_data(q, packet_t, queue);
-                if (pkg->app == app) {
-                        app->output(pkg);
-                        break;
-                }
+        if (!queue_empty(&app->write_list)) {
+                pkg = queue_data(queue_first(&app->write_list), packet_t, queue);
+                return app->output(pkg);
         }
 
-        app_check_write_queue();
+        // nothing to send, stop waiting for write event
+        unset_event_write(ev);
 
         return 0;
 }
 
 /*
- * check if there are any packet in the write packet cache queue,
- * if any, make the Event Module wait for their write event.
+ * client sockets never block the event loop, read and write
+ * just return EAGAIN when they can not go on.
  */
-static int app_check_write_queue()
+static int app_set_nonblock(int fd)
 {
-        return 0;
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags == -1) {
+                return -1;
+        }
+
+        return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 /*
@@ -339,7 +468,7 @@ static int app_connect(int fd)
         socklen_t addr_len;
 
         // alloc memory for client
-        app_t *app = (app_t*) malloc(sizeof(app_t));
+        app_t *app = (app_t*) pool_alloc(POOL_APP);
         if (!app) {
                 APP_ERROR("Can not alloc memory for an client.");
                 return -1;
@@ -351,8 +480,12 @@ static int app_connect(int fd)
         app->fd  = accept(fd, (struct sockaddr*)&client_addr, &addr_len);
 
         if (app->fd == -1) {
+                pool_free(POOL_APP, app);
+                // another worker took it
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return 0;
+                }
                 APP_ERROR(strerror(errno));
-                free(app);
                 return -1;
         }
 
@@ -360,16 +493,26 @@ static int app_connect(int fd)
         app->in_addr = client_addr.sin_addr.s_addr;
         app->in_port = client_addr.sin_port;
         app->state   = s_close;
+        app->role    = APP_ROLE_CLIENT;
         app->input   = client_input;
         app->output  = client_output;
 
+        // give it a connection id
+        if (app_slot_get(app) == -1) {
+                close(app->fd);
+                pool_free(POOL_APP, app);
+                return -1;
+        }
+
         // add it to client queue
         if (app_add(app) == -1) {
-                free(app);
+                app_slot_put(app);
+                close(app->fd);
+                pool_free(POOL_APP, app);
                 return -1;
         }
 
-        APP_INFO("Connect an application.");
+        logf_info("APP", "Connect an application with connection id %u.", app->cid);
 
         return 0;
 }
@@ -387,11 +530,21 @@ int app_add(app_t *app)
                 return -1;
         }
 
+        if (app_set_nonblock(app->fd) == -1) {
+                APP_ERROR(strerror(errno));
+                return -1;
+        }
+
+        queue_init(&app->write_list);
+        app->timer  = NULL;
+        app->window = app_ctl.low;
+
         // add to client queue
         queue_insert(app_list, &app->queue);
 
         if (!event_create(ev)) {
                 APP_ERROR("Can not alloc memory for a event.");
+                queue_delete(&app->queue);
                 return -1;
         }
 
@@ -399,183 +552,356 @@ int app_add(app_t *app)
         ev->fd     = app->fd;
         ev->input  = app_input;
         ev->output = app_output;
+        ev->data   = app;
         ev->flag   = 0;
 
-        // we always accept input
+        // we always accept input, client_input and client_output
+        // go on until EAGAIN, so edge-triggered is fine. they read
+        // and write through the event module, io_uring does it.
         set_event_active(ev);
         set_event_read(ev);
+        set_event_edge(ev);
+        set_event_io(ev);
 
         if (event_add(ev) == -1) {
+                queue_delete(&app->queue);
+                event_free(ev);
                 return -1;
         }
 
+        app->ev = ev;
+
         APP_DEBUG("Successed to add an application.");
 
         return 0;
 }
 
-#define TOTAL_HEADER_LENGTH 0
-#define APP_MAX_LENGTH  1024
+/*
+ * take a free slot of this loop, the connection id tells
+ * the other host which loop and which client it belongs to.
+ */
+static int app_slot_get(app_t *app)
+{
+        uint16_t slot;
+
+        if (!free_top) {
+                APP_ERROR("Too many clients in this loop.");
+                return -1;
+        }
+
+        slot = free_slots[--free_top];
+
+        clients[slot] = app;
+        app->cid      = APP_CID(slot, loop_current()->id);
+
+        return 0;
+}
+
+static void app_slot_put(app_t *app)
+{
+        uint16_t slot = APP_CID_SLOT(app->cid);
+
+        if (clients[slot] == app) {
+                clients[slot] = NULL;
+                free_slots[free_top++] = slot;
+        }
+}
 
 /*
- * if a client can read, we alloc a packet, then read and store
- * data in it.
+ * a reply goes to a client of this loop, other frames go to
+ * a connection to a real server.
+ */
+static app_t *app_find_by_cid(uint16_t cid, int reply)
+{
+        app_t *app;
+
+        if (reply) {
+                app = clients[APP_CID_SLOT(cid)];
+                if (app && app->cid == cid) {
+                        return app;
+                }
+                return NULL;
+        }
+
+        return peers[cid];
+}
+
+/*
+ * if a client can read, we alloc a chain of packets, then read and
+ * store data in it with one readv.
  * accoding to state of client, do differently.
+ * a full read may leave more data in the socket, return EVENT_AGAIN
+ * to be called again.
  */
 static int client_input(app_t *app)
 {
-        ssize_t nread;
-
-        // alloc packet
-        packet_t *pkg = (packet_t*) malloc(sizeof(packet_t));
+        struct iovec iov[APP_READ_SEGMENTS];
+        packet_t    *seg, *last;
+        ssize_t      nread, left;
+        int          more, rv, n, len;
+
+        // alloc packets, the data is read after the head room,
+        // the headers are pushed in front of it later.
+        // the pool is empty, no edge comes for the data left in the
+        // socket, so the timer of a paused client tries again
+        packet_t *pkg = packet_alloc_chain(APP_READ_SEGMENTS);
         if (!pkg) {
-                return -1;
+                return app_pause(app);
         }
 
-        // because of the size limit of device, just read a fix
-        // number of data.
-        char *pdu = (char*) malloc(APP_MAX_LENGTH);
-        if (!pdu) {
-                free(pkg);
-                return -1;
+        // fill the packet
+        pkg->app  = app;
+        pkg->down = 1;
+
+        len = app_segment_length(device_find_by_name(app_ctl.dev));
+
+        for (n = 0, seg = pkg; seg; seg = seg->next, n++)
+        {
+                iov[n].iov_base = APP_DATA_POINT(seg);
+                iov[n].iov_len  = len;
         }
 
-        // fill the packet
-        // TODO
-        pkg->pdu     = pdu + TOTAL_HEADER_LENGTH;
-        pkg->buf     = pdu;
-        pkg->tot_len = APP_MAX_LENGTH;
-        pkg->app     = app;
-        pkg->up      = 0;
-        pkg->down    = 1;
+        // the request is read alone, data sent right behind it stays
+        // in the socket until the other host answers
+        if (app->state == s_wait_request) {
+                iov[0].iov_len = SOCKS_REQ_LENGTH;
+                n = 1;
+        }
 
-        nread = read(app->fd, APP_DATA_POINT(pkg), APP_MAX_LENGTH);
+        nread = event_read(app->ev, iov, n);
 
         if (nread == -1) {      // error
+                packet_put(pkg);
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return 0;
+                }
                 APP_ERROR(strerror(errno));
-                free(pdu);
-                free(pkg);
-                return -1;
+                return app_close(app);
         } else if (nread == 0) {// client close
-                free(pdu);
-                free(pkg);
+                packet_put(pkg);
                 return app_close(app);
-        } else {                // read data
-                pkg->len = nread + APP_HEADER_LENGTH;
         }
 
+        more = (nread == (ssize_t) n * len);
+
+        // fill the segments in order, put the empty ones
+        left = nread;
+        for (seg = pkg, last = pkg; seg && left > 0; seg = seg->next)
+        {
+                seg->len = left < len ? left : len;
+                left    -= seg->len;
+                last     = seg;
+        }
+        packet_trim_chain(last);
+
         switch (app->state)
         {
                 // init state
                 case s_close:
                 {
-                        return new_client_cli(pkg);
+                        packet_trim_chain(pkg);
+                        rv = new_client_cli(pkg);
+                        break;
                 }
 
                 // wait for request
                 case s_wait_request:
                 {
-                        return connect_client_cli(pkg);
+                        packet_trim_chain(pkg);
+                        rv = connect_client_cli(pkg);
+                        break;
                 }
 
                 // data transfer
                 case s_connected:
                 {
-                        app_hdr_t *app_hdr = (app_hdr_t*) (pkg->pdu - sizeof(app_hdr_t));
-
-                        device_t *dev = device_find_by_name("AM");
-                        if (!dev) {
-                                return -1;
+                        rv = app_device_send(app, pkg, APP_HEADER_TYPE_DATA);
+                        if (rv != -1 && app_congested(app, nread) && app_pause(app) == 0) {
+                                more = 0;
                         }
+                        break;
+                }
 
-                        app_hdr->type = APP_HEADER_TYPE_DATA;
-
-                        pkg->dev  = dev;
+                // the other host closed, nothing goes to it any more
+                case s_closing:
+                {
+                        packet_put(pkg);
+                        rv = 0;
+                        break;
+                }
 
-                        return device_send(pkg);
+                // reading is off until the other host answers
+                default:
+                {
+                        APP_ERROR("Read a client waiting for the other host.");
+                        packet_put(pkg);
+                        return app_close(app);
                 }
+        }
 
-                default: return -1;
+        if (rv == -1) {
+                return -1;
         }
+
+        return more ? EVENT_AGAIN : rv;
 }
 
+/*
+ * write the segments of the chain with writev, as much as the socket
+ * accepts. the written bytes are dropped from the front of the
+ * segments, if the socket is full, keep the rest of the packet in
+ * the write queue and wait for the next write event.
+ */
 static int client_output(packet_t *pkg)
 {
-        ssize_t nwrite, tot_write = 0;
-        ssize_t nleft = pkg->len;
+        struct iovec iov[APP_WRITE_SEGMENTS];
+        packet_t    *seg;
+        ssize_t      nwrite;
+        int          n;
 
-        while (nleft > 0)
+        for (;;)
         {
-                nwrite = write(pkg->app->fd, pkg->pdu + tot_write, nleft);
+                for (n = 0, seg = pkg; seg && n < APP_WRITE_SEGMENTS; seg = seg->next)
+                {
+                        if (seg->len > 0) {
+                                iov[n].iov_base = seg->pdu;
+                                iov[n].iov_len  = seg->len;
+                                n++;
+                        }
+                }
+
+                if (n == 0) {
+                        break;
+                }
+
+                nwrite = event_write(pkg->app->ev, iov, n);
                 if (nwrite == -1) {
                         if (errno == EINTR) {
                                 continue;
+                        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                return 0;
                         } else {
                                 APP_ERROR(strerror(errno));
-                                return -1;
+                                return app_close(pkg->app);
                         }
                 } else if (nwrite == 0) {
                         return app_close(pkg->app);
-                } else {
-                        nleft     -= nwrite;
-                        tot_write += nwrite;
                 }
-        }
 
-        if (nleft == 0) {
-                app_output_finish(pkg);
+                for (seg = pkg; seg && nwrite > 0; seg = seg->next)
+                {
+                        n = seg->len < nwrite ? seg->len : nwrite;
+                        seg->pdu += n;
+                        seg->len -= n;
+                        nwrite   -= n;
+                }
         }
 
-        return tot_write;
+        return app_output_finish(pkg);
 }
 
 /*
  * after sending data to client,
- * delete packet from cache queue,
- * and make the Event Module not wait for client's write event.
+ * delete packet from write queue,
+ * and make the Event Module not wait for client's write event
+ * if there is nothing more to send.
  */
 static int app_output_finish(packet_t *pkg)
 {
         event_t *ev;
+        app_t   *app = pkg->app;
+
+        // delete packet
+        queue_delete(&pkg->queue);
+        packet_put(pkg);
+
+        // check if any other packets need to send
+        if (!queue_empty(&app->write_list)) {
+                return EVENT_AGAIN;
+        }
+
+        // the other side closed, all its data is sent now
+        if (app->state == s_closing) {
+                return app_close(app);
+        }
 
         // not wait for client's write event
-        ev = event_find_by_fd(pkg->app->fd);
+        ev = app->ev;
         if (!ev) {
                 return -1;
         }
         unset_event_write(ev);
 
-        // delete packet
-        queue_delete(&pkg->queue);
-        free(pkg);
-
-        // check if any other packets need to send
-        app_check_write_queue();
-
         return 0;
 }
 
 /*
  * send data to application layer, use by other module,
  * of course, this layer can also use it.
+ * the packet is handled by the loop owning its connection,
+ * if that is not us, post it there.
+ */
+int app_send(packet_t *pkg)
+{
+        app_hdr_t *app_hdr;
+        loop_t    *loop;
+        uint16_t   cid;
+
+        if (pkg->len < (int) APP_HEADER_LENGTH) {
+                APP_WARN("Drop a packet without application header.");
+                packet_put(pkg);
+                return -1;
+        }
+
+        app_hdr = (app_hdr_t*) pkg->pdu;
+        cid     = ntohs(app_hdr->cid);
+
+        // answers go back to the loop of the client,
+        // requests go to the loop chosen by connection id
+        if (app_hdr->flag & APP_HEADER_FLAG_REPLY) {
+                loop = loop_get(APP_CID_LOOP(cid));
+        } else {
+                loop = loop_pick(cid);
+        }
+
+        if (!loop) {
+                logf_warn("APP", "Drop a packet of unknown connection id %u.", cid);
+                packet_put(pkg);
+                return -1;
+        }
+
+        if (loop != loop_current()) {
+                return loop_post(loop, pkg);
+        }
+
+        return app_route(pkg);
+}
+
+/*
  * there is a type field in application layer header,
  * different value means different method.
  * transfer data method is the way send data to client,
  * others will not reach client.
  */
-int app_send(packet_t *pkg)
+static int app_route(packet_t *pkg)
 {
-        app_hdr_t *app_hdr = (app_hdr_t*) pkg->pdu;
+        app_hdr_t *app_hdr = (app_hdr_t*) packet_pull(pkg, APP_HEADER_LENGTH);
+        int        reply   = app_hdr->flag & APP_HEADER_FLAG_REPLY;
+
+        // a client from other host call us to
+        // connect the real remote server
+        if (app_hdr->type == APP_HEADER_TYPE_NEW && !reply) {
+                return new_client_ser(pkg);
+        }
+
+        pkg->app = app_find_by_cid(ntohs(app_hdr->cid), reply);
+        if (!pkg->app) {
+                packet_put(pkg);
+                return 0;
+        }
 
         switch (app_hdr->type)
         {
-                // a client from other host call us to
-                // connect the real remote server
-                case APP_HEADER_TYPE_NEW:
-                {
-                        return new_client_ser(pkg);
-                }
-
                 // we asked other host to connect the real remote
                 // server, it answer the result to us now
                 case APP_HEADER_TYPE_CONNECT:
@@ -595,33 +921,175 @@ int app_send(packet_t *pkg)
                         return trans_data(pkg);
                 }
 
-                default: return -1;
+                default:
+                {
+                        packet_put(pkg);
+                        return -1;
+                }
         }
 }
 
 /*
- * accoding to the mapping between client port and tcp port,
- * just like NAT, we find the correct client, and tell the
- * Event Module wait for its write evnet, then call back
- * function client_output to send data.
+ * send a frame of the connection to the other host, the packet
+ * leaves this loop, so it does not point to the client any more.
  */
-static int trans_data(packet_t *pkg)
+static int app_device_send(app_t *app, packet_t *pkg, uint8_t type)
 {
+        app_hdr_t *app_hdr = (app_hdr_t*) packet_push(pkg, APP_HEADER_LENGTH);
+
+        if (!app_hdr) {
+                packet_put(pkg);
+                return -1;
+        }
+
+        app_hdr->type = type;
+        app_hdr->flag = app->role == APP_ROLE_SERVER ? APP_HEADER_FLAG_REPLY : 0;
+        app_hdr->cid  = htons(app->cid);
+
         // TODO
-        // no tcp protocol now, change this part in the future.
-        queue_t *q;
-        app_t   *app;
-        event_t *ev;
-                app = client;
-                pkg->app  = app;
-                pkg->pdu += sizeof(app_hdr_t);
-                pkg->len -= sizeof(app_hdr_t);
-                queue_insert_tail(write_list, &pkg->queue);
-                ev = event_find_by_fd(app->fd);
-                if (!ev) {
+        // we don't have protocol now, so need to find device by ourself,
+        // don't need in the future.
+        pkg->dev = device_find_by_name(app_ctl.dev);
+        pkg->app = NULL;
+
+        // both sides number their own clients, the flag tells them apart
+        pkg->flow   = APP_FLOW(app);
+        pkg->urgent = type != APP_HEADER_TYPE_DATA;
+        if (!pkg->dev) {
+                packet_put(pkg);
+                return -1;
+        }
+
+        return device_send(pkg);
+}
+
+/*
+ * the data of a segment, so the segment with the app and fragment
+ * headers fits in a frame of the device. a bond already took the
+ * bond header off its frame size.
+ */
+static int app_segment_length(device_t *dev)
+{
+        int len = packet_mtu();
+
+        if (dev && (int) device_tx_size(dev) < len) {
+                len = device_tx_size(dev);
+        }
+
+        return len - (int) APP_HEADER_LENGTH - (int) DEVICE_FRAG_HEADER_LENGTH;
+}
+
+static unsigned int app_watermark(char *key, unsigned int def)
+{
+        char *c = config_find(key);
+        int   n = c ? atoi(c) : def;
+
+        return n > 0 ? (unsigned int) n : def;
+}
+
+/*
+ * after len bytes sent, the backlog of the connection is above its
+ * window, or the backlog of the device above the high watermark.
+ * the window halves when the scheduler marked a packet of the
+ * connection, and grows by a segment a window otherwise, up to the
+ * high watermark.
+ */
+static int app_congested(app_t *app, int len)
+{
+        device_t *dev = device_find_by_name(app_ctl.dev);
+
+        if (!dev) {
+                return 0;
+        }
+
+        if (device_flow_marked(APP_FLOW(app))) {
+                app->window /= 2;
+                if (app->window < APP_WINDOW_MIN(dev)) {
+                        app->window = APP_WINDOW_MIN(dev);
+                }
+        } else if (app->window < app_ctl.high) {
+                app->window += (unsigned int) len * APP_WINDOW_MIN(dev) / app->window + 1;
+                if (app->window > app_ctl.high) {
+                        app->window = app_ctl.high;
+                }
+        }
+
+        return device_flow_backlog(APP_FLOW(app)) > app->window ||
+               device_backlog(dev) > app_ctl.dev_high;
+}
+
+/*
+ * the backlog of the connection is below the low watermark and half
+ * its window, and the backlog of the device below its low one.
+ */
+static int app_drained(app_t *app)
+{
+        device_t    *dev = device_find_by_name(app_ctl.dev);
+        unsigned int low = app->window / 2 < app_ctl.low ? app->window / 2 : app_ctl.low;
+
+        if (!dev) {
+                return 1;
+        }
+
+        return device_flow_backlog(APP_FLOW(app)) <= low &&
+               device_backlog(dev) <= app_ctl.dev_low;
+}
+
+/*
+ * stop reading the client, its data stays in the kernel and TCP
+ * slows the sender down. the timer looks again later.
+ */
+static int app_pause(app_t *app)
+{
+        if (!app->timer) {
+                if (!tick_create(app->timer)) {
+                        APP_ERROR("Can not alloc memory for a timer.");
                         return -1;
                 }
-                set_event_write(ev);
+                tick_init_timer(app->timer, app_resume, app);
+        }
+
+        unset_event_read(app->ev);
+        tick_add(app->timer, APP_BACKLOG_CHECK);
+
+        return 0;
+}
+
+static int app_resume(tick_t *tc)
+{
+        app_t *app = (app_t*) tc->data;
+
+        if (!app_drained(app)) {
+                tick_add(tc, APP_BACKLOG_CHECK);
+                return 0;
+        }
+
+        set_event_read(app->ev);
+
+        return 0;
+}
+
+/*
+ * the packet carries the connection in pkg->app, put its data in the
+ * write queue of the client, tell the Event Module wait for its write
+ * event, then call back function client_output to send data.
+ */
+static int trans_data(packet_t *pkg)
+{
+        app_t   *app = pkg->app;
+        event_t *ev  = app->ev;
+
+        if (packet_chain_len(pkg) <= 0) {
+                packet_put(pkg);
+                return 0;
+        }
+
+        queue_insert_tail(&app->write_list, &pkg->queue);
+
+        if (!ev) {
+                return -1;
+        }
+        set_event_write(ev);
 
         return 0;
 }
@@ -638,9 +1106,6 @@ static int new_client_cli(packet_t *pkg)
         method_req_t *request  = (method_req_t*) APP_DATA_POINT(pkg);
         method_res_t *response = (method_res_t*) APP_DATA_POINT(pkg);
 
-        // response application layer header
-        app_hdr_t *app_hdr = (app_hdr_t*) APP_HEADER_POINT(pkg);
-
         // valid the socks version
         if (request->ver == SOCKS_VERSION) {
                 response->method = METHOD_DEFAULT;
@@ -650,11 +1115,9 @@ static int new_client_cli(packet_t *pkg)
         }
 
         // send data back to real client
-        app_hdr->type = APP_HEADER_TYPE_DATA;
+        pkg->len  = sizeof(method_res_t);
 
-        pkg->len  = APP_HEADER_LENGTH + sizeof(method_res_t);
-
-        return app_send(pkg);
+        return trans_data(pkg);
 }
 
 /*
@@ -668,12 +1131,29 @@ static int new_client_ser(packet_t *pkg)
         socks_req_t *request  = (socks_req_t*) APP_DATA_POINT(pkg);
         socks_res_t *response = (socks_res_t*) APP_DATA_POINT(pkg);
 
-        // response application layer header
-        app_hdr_t *app_hdr = (app_hdr_t*) APP_HEADER_POINT(pkg);
+        // application layer header, pulled by app_route
+        app_hdr_t *app_hdr = APP_HEADER_POINT(pkg);
+        uint16_t   cid     = ntohs(app_hdr->cid);
+        uint8_t    type    = APP_HEADER_TYPE_CLOSE;
 
-        // set error response
-        app_hdr->type = APP_HEADER_TYPE_CLOSE;
-        response->rep = REP_GENREAL_FAILURE;
+        // answer as this connection, even if it does not exist
+        app_t  ser;
+        app_t *app = &ser;
+
+        ser.cid  = cid;
+        ser.role = APP_ROLE_SERVER;
+
+        if (pkg->len < SOCKS_REQ_LENGTH) {
+                APP_ERROR("Socks protocol format error.");
+                goto new_error;
+        }
+
+        // the other host reuses the connection id after close
+        if (peers[cid]) {
+                APP_WARN("Connection id is used, close the old connection.");
+                peers[cid]->state = s_closing;
+                app_close(peers[cid]);
+        }
 
         // connect the real remote server
         struct sockaddr_in cin;
@@ -701,10 +1181,11 @@ static int new_client_ser(packet_t *pkg)
         // connect to real client, all the data transfer betwoon real client
         // and real server will throuth this two client in stack.
         // if connect failed, skip this part.
-        app_t *app = (app_t*) malloc(sizeof(app_t));
+        app = (app_t*) pool_alloc(POOL_APP);
         if (!app) {
                 APP_ERROR(strerror(errno));
                 close(real_sock);
+                app = &ser;
                 goto new_error;
         }
 
@@ -712,24 +1193,35 @@ static int new_client_ser(packet_t *pkg)
         app->in_addr = cin.sin_addr.s_addr;
         app->in_port = cin.sin_port;
         app->fd      = real_sock;
+        app->cid     = cid;
+        app->role    = APP_ROLE_SERVER;
         app->state   = s_connected;      // connected, can use for data transfer later
         app->input   = client_input;
         app->output  = client_output;
 
         if (app_add(app) == -1) {
                 close(real_sock);
-                free(app);
-                return -1;
+                pool_free(POOL_APP, app);
+                app = &ser;
+                goto new_error;
         }
 
+        peers[cid] = app;
+
         // we set error type above, if connect and alloc successed,
         // turn it to connect type, tell other host we connected,
         // else say error to them.
-        app_hdr->type = APP_HEADER_TYPE_CONNECT;
+        type          = APP_HEADER_TYPE_CONNECT;
         response->rep = REP_SUCCEEDED;
 
+        goto new_response;
+
 new_error:
 
+        response->rep = REP_GENREAL_FAILURE;
+
+new_response:
+
         // fill the response
         response->ver  = SOCKS_VERSION;
         response->rsv  = 0x00;
@@ -737,20 +1229,9 @@ new_error:
         response->addr = 0xFFFFFFFF;
         response->port = 0xFFFF;
 
-        // TODO
-        // we don't have protocol now, so need to find device by ourself,
-        // don't need in the future.
-        device_t *dev = device_find_by_name("AM");
-        if (!dev) {
-                return -1;
-        }
-
-        pkg->dev = dev;
-        pkg->pdu = (char*) app_hdr;
-
-        client = app;
+        pkg->len = SOCKS_RES_LENGTH;
 
-        return device_send(pkg);
+        return app_device_send(app, pkg, type);
 }
 
 /*
@@ -766,12 +1247,14 @@ static int connect_client_cli(packet_t *pkg)
         socks_req_t *request  = (socks_req_t*) APP_DATA_POINT(pkg);
         socks_res_t *response = (socks_res_t*) APP_DATA_POINT(pkg);
 
-        // application layer header
-        app_hdr_t *app_hdr = (app_hdr_t*) APP_HEADER_POINT(pkg);
+        app_t *app = pkg->app;
 
         // valid request
         int error_flag = 0;
-        if (request->ver != SOCKS_VERSION) {
+        if (pkg->len < SOCKS_REQ_LENGTH) {
+                APP_ERROR("Socks protocol format error.");
+                error_flag = 1;
+        } else if (request->ver != SOCKS_VERSION) {
                 APP_ERROR("Not supported socks protocol version.");
                 error_flag = 1;
         } else if (request->cmd != CMD_CONNECT) {
@@ -780,98 +1263,118 @@ static int connect_client_cli(packet_t *pkg)
         } else if (request->rsv) {
                 APP_ERROR("Socks protocol format error.");
                 error_flag = 1;
+        } else if (request->atyp != ATYP_IPV4) {
+                APP_ERROR("Not supported socks address type.");
+                error_flag = 1;
         }
 
-        response->ver = SOCKS_VERSION;
-        response->rsv = 0x00;
         // valid request failed, send error response to real client
         if (error_flag) {
+                response->ver  = SOCKS_VERSION;
                 response->rep  = REP_GENREAL_FAILURE;
+                response->rsv  = 0x00;
                 response->atyp = ATYP_IPV4;
                 response->addr = 0xFFFFFFFF;
                 response->port = 0xFFFF;
 
-                app_hdr->type = APP_HEADER_TYPE_DATA;
-                pkg->len      = APP_HEADER_LENGTH + sizeof(socks_res_t);
+                pkg->len = SOCKS_RES_LENGTH;
 
-                pkg->app->state = s_close;
+                app->state = s_close;
 
-                return app_send(pkg);
+                return trans_data(pkg);
         // valid request successed, send to other host
         } else {
-                // TODO
-                device_t *dev = device_find_by_name("AM");
-                if (!dev) {
-                        return -1;
-                }
+                pkg->len = SOCKS_REQ_LENGTH;
 
-                app_hdr->type = APP_HEADER_TYPE_NEW;
+                // what the client sends now has nowhere to go yet,
+                // it waits in the socket
+                app->state = s_wait_connect;
+                unset_event_read(app->ev);
 
-                pkg->dev = dev;
-                pkg->len = APP_HEADER_LENGTH + sizeof(socks_res_t);
-
-                return device_send(pkg);
+                return app_device_send(app, pkg, APP_HEADER_TYPE_NEW);
         }
 }
 
 /*
- * the other side is connected, we should find the appropriate
- * client, and turn it to data transfer type.
+ * the other side is connected, turn the client to data transfer
+ * type, and give the socks response to the real client.
  */
 static int connect_client_ser(packet_t *pkg)
 {
-        app_t   *app;
-        queue_t *q;
+        app_t *app = pkg->app;
 
-        for (q = app_list->next; q != app_list; q = q->next)
-        {
-                app = queue_data(q, app_t, queue);
-                if (app->state == s_wait_request) {
-                        pkg->app   = app;
-                        app_hdr_t *app_hdr = (app_hdr_t*) pkg->pdu;
-                        app_hdr->type = APP_HEADER_TYPE_DATA;
-                        app->state = s_connected;
-                        return app_send(pkg);
-                }
+        if (app->state != s_wait_connect) {
+                packet_put(pkg);
+                return 0;
         }
 
-        return 0;
+        app->state = s_connected;
+        set_event_read(app->ev);
+
+        return trans_data(pkg);
 }
 
+/*
+ * the other side closed the connection, send what it carries,
+ * then close when the write queue is empty.
+ */
 static int close_client(packet_t *pkg)
 {
+        app_t *app = pkg->app;
+
+        app->state = s_closing;
+
+        if (trans_data(pkg) == -1) {
+                return -1;
+        }
+
+        if (queue_empty(&app->write_list)) {
+                return app_close(app);
+        }
+
         return 0;
 }
 
-static app_t *app_find_by_fd(int fd)
+/*
+ * the event registry knows the owner of every fd,
+ * the listen socket has no owner.
+ */
+app_t *app_find_by_fd(int fd)
 {
-        app_t   *app;
-        queue_t *q;
-
-        for (q = app_list->next; q != app_list; q = q->next)
-        {
-                app = queue_data(q, app_t, queue);
-                if (app->fd == fd) {
-                        return app;
-                }
+        event_t *ev = event_find_by_fd(fd);
+        if (!ev || ev->input != app_input) {
+                return NULL;
         }
 
-        return NULL;
+        return (app_t*) ev->data;
 }
 
 /*
- * three step, find and delete appropriate event first,
- * then delete and free client, ask the other side delete
- * the client last.
+ * three step, ask the other side delete the client first,
+ * then find and delete appropriate event, delete and free
+ * client last.
  */
 static int app_close(app_t *app)
 {
+        packet_t *pkg;
+
         if (!app) {
                 return -1;
         }
 
+        // tell the other host, unless it closed first
+        if (app->state == s_wait_connect || app->state == s_connected) {
+                pkg = packet_alloc();
+                if (pkg) {
+                        pkg->down = 1;
+                        app_device_send(app, pkg, APP_HEADER_TYPE_CLOSE);
+                } else {
+                        APP_ERROR("Can not alloc memory for the close packet.");
+                }
+        }
+
         // delete event
-        event_t *ev = event_find_by_fd(app->fd);
+        event_t *ev = app->ev;
         if (!ev) {
                 return -1;
         }
@@ -880,13 +1383,32 @@ static int app_close(app_t *app)
                 return -1;
         }
 
-        // delete client
-        queue_delete(&app->queue);
+        if (app->timer) {
+                tick_delete(app->timer);
+                tick_free(app->timer);
+                app->timer = NULL;
+        }
+
+        // drop what is not sent
+        while (!queue_empty(&app->write_list))
+        {
+                pkg = queue_data(queue_first(&app->write_list), packet_t, queue);
+                queue_delete(&pkg->queue);
+                packet_put(pkg);
+        }
 
-        free(app);
+        // free the connection id
+        if (app->role == APP_ROLE_CLIENT) {
+                app_slot_put(app);
+        } else if (peers[app->cid] == app) {
+                peers[app->cid] = NULL;
+        }
 
-        // TODO
-        // no tcp protocol now, change this part in the future.
+        // delete client, the fd number may be used again now
+        queue_delete(&app->queue);
+
+        close(app->fd);
+        pool_free(POOL_APP, app);
 
         return 0;
 }
@@ -8,6 +8,8 @@
 
 typedef struct app_s app_t;
 typedef struct packet_s packet_t;
+typedef struct event_s event_t;
+typedef struct tick_s tick_t;
 
 typedef int (*app_input_fn)(app_t *app);
 typedef int (*app_output_fn)(packet_t *pkg);
@@ -15,7 +17,15 @@ typedef int (*app_output_fn)(packet_t *pkg);
 enum app_state {
         s_close,
         s_wait_request,
+        s_wait_connect,
         s_connected,
+        s_closing,
+};
+
+// the real client connects to us, or we connect to the real server
+enum app_role {
+        APP_ROLE_CLIENT,
+        APP_ROLE_SERVER,
 };
 
 struct app_s {
@@ -26,10 +36,27 @@ struct app_s {
         uint16_t in_port;
 
         enum app_state state;
+        enum app_role  role;
+
+        // connection id shared with the other host
+        uint16_t cid;
 
         app_input_fn  input;
         app_output_fn output;
 
+        // event of the fd
+        event_t *ev;
+
+        // packets waiting to be written to the fd
+        queue_t write_list;
+
+        // reading is paused until the device catches up, the timer
+        // looks at the backlog again
+        tick_t *timer;
+
+        // bytes it may have waiting for the device
+        unsigned int window;
+
         queue_t queue;
 };
 
@@ -37,6 +64,14 @@ typedef struct app_ctl_s app_ctl_t;
 struct app_ctl_s {
         int   fd;
         char *port;
+        char *dev;      // name of the device to the other host
+
+        // backlog watermarks in bytes, of a connection and of the
+        // device, reading stops above high and goes on below low
+        unsigned int high;
+        unsigned int low;
+        unsigned int dev_high;
+        unsigned int dev_low;
 };
 
 // for core
@@ -49,5 +84,6 @@ int app_receive(packet_t *pkg);
 
 // for client 
 int app_add(app_t *app);
+app_t *app_find_by_fd(int fd);
 
 #endif // _APPLICATION_H_
@@ -1,15 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fcntl.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include "config.h"
 #include "device.h"
+#include "event.h"
+#include "hex.h"
 #include "log.h"
 #include "packet.h"
+#include "tick.h"
 
 #define AQUASENT_BUFFER_SIZE(mtu) ((mtu) * 2 + 300)
 
@@ -30,76 +34,91 @@
 #define AQUASENT_DEFAULT_GATEWAY  0
 #define AQUASENT_CONFIG_MAC_ADDR  "aquasent_mac_addr"
 #define AQUASENT_DEFAULT_MAC_ADDR 0
+#define AQUASENT_CONFIG_WINDOW    "aquasent_window"
+#define AQUASENT_DEFAULT_WINDOW   2
+#define AQUASENT_CONFIG_OKAY      "aquasent_okay_timeout"
+#define AQUASENT_DEFAULT_OKAY     2000          // ms
+#define AQUASENT_CONFIG_DONE      "aquasent_done_timeout"
+#define AQUASENT_DEFAULT_DONE     30000         // ms
 
 #define AQUASENT_ERROR(s) log_error("AQUA", (s))
 #define AQUASENT_WARN(s)  log_warn ("AQUA", (s))
 #define AQUASENT_INFO(s)  log_info ("AQUA", (s))
 #define AQUASENT_DEBUG(s) log_debug("AQUA", (s))
 
+#define AQUASENT_CONFIG_DEVICES   "aquasent_devices"
+#define AQUASENT_CONFIG_SIM       "aquasent_sim"
+#define AQUASENT_NAME_LENGTH      2
+
+// transmissions the modem may hold at once, at most
+#define AQUASENT_MAX_WINDOW       16
+
+// fields of a sentence after its name, at most
+#define AQUASENT_MAX_FIELDS       8
+
 #define dbuf_space(b)           ((b)->buf + (b)->len)
 #define dbuf_space_len(b)       ((b)->tot_len - (b)->len)
 
+typedef struct device_aquasent_s device_aquasent_t;
+
 int aquasent_init();
-int aquasent_exit();
-int handle_mmoky();
-int handle_mmtdn();
-int handle_mmrxd();
-int aquasent_open(char *port, char *baud);
+int aquasent_create(char *name);
+int aquasent_exit(device_t *d);
+int aquasent_report(device_t *d);
+extern int sim_open(char *name);
+int handle_mmoky(device_aquasent_t *a, device_t *d);
+int handle_mmtdn(device_aquasent_t *a, device_t *d);
+int handle_mmrxd(device_aquasent_t *a, device_t *d);
+int handle_mmerr(device_aquasent_t *a, device_t *d);
 int aquasent_flush(int fd, int flag);
 int aquasent_input(device_t *d);
+static int aquasent_sentence(device_aquasent_t *a, device_t *d);
+static void aquasent_rx_start(device_aquasent_t *a, device_t *d);
+static int aquasent_rx_decode(device_aquasent_t *a, const char *hex, int size);
+static void aquasent_rx_drop(device_aquasent_t *a);
 int aquasent_output(packet_t *pkg);
-int byte_to_hex(char *hex, const unsigned char *src, size_t size);
-int hex_to_byte(char *dst, const char *hex, size_t size);
-
+static int aquasent_write(device_t *d);
+static void aquasent_write_fail(device_aquasent_t *a);
+static int aquasent_timeout(tick_t *tc);
+static void aquasent_watch(device_aquasent_t *a);
+static void aquasent_deadline(device_aquasent_t *a, device_t *d);
+
+/*
+ * the parser reads sentences $name,field,...,field CR LF, a character
+ * of any other kind drops the sentence and it looks for the next $.
+ */
 enum aquasent_read_state {
-        s_init,
-        s_start,
-        s_dollar,
-        s_m,
-        s_mm,
-
-        s_mme,
-        s_mmer,
-        s_mmerr,
-        s_comma_after_mmerr,
-        s_mmerr_cmd,
-        s_comma_after_mmerr_cmd,
-        s_mmerr_code,
-        s_cr_after_mmerr,
-
-        s_mmt,
-        s_mmtd,
-        s_mmtdn,
-        s_comma_after_mmtdn,
-        s_mmtdn_result,
-        s_comma_after_mmtdn_result,
-        s_mmtdn_pn,
-        s_cr_after_mmtdn,
-
-        s_mmo,
-        s_mmok,
-        s_mmoky,
-        s_comma_after_mmoky,
-        s_mmoky_cmd,
-        s_comma_after_mmoky_cmd,
-        s_cr_after_mmoky,
-
-        s_mmr,
-        s_mmrx,
-        s_mmrxd,
-        s_comma_after_mmrxd,
-        s_mmrxd_src,
-        s_comma_after_mmrxd_src,
-        s_mmrxd_dst,
-        s_comma_after_mmrxd_dst,
-        s_mmrxd_data,
-        s_cr_after_mmrxd,
+        s_hunt,                 // garbage until $
+        s_body,                 // the name and the fields
+        s_cr,                   // CR read, LF is next
+        s_read_states,
+};
+
+// c_text is 0, so a run of text ors to 0
+enum aquasent_char_class {
+        c_text,
+        c_bad,
+        c_dollar,
+        c_comma,
+        c_cr,
+        c_lf,
+        c_classes,
+};
+
+enum aquasent_read_action {
+        a_skip,                 // garbage
+        a_text,                 // in a field
+        a_start,                // a sentence starts, maybe dropping one
+        a_comma,                // a field ends
+        a_cr,                   // the last field ends
+        a_end,                  // the sentence is whole
+        a_drop,                 // the sentence is damaged
 };
 
 enum aquasent_write_state {
         s_ready,
+        s_writing,              // the port took part of the $HHTXD
         s_wait_mmoky,
-        s_wait_mmtdn,
 };
 
 typedef struct dbuf_s dbuf_t;
@@ -107,73 +126,164 @@ struct dbuf_s {
         char *buf;
         int   len;
         int   tot_len;
+        int   pos;              // written out so far, wbuf only
 };
 
-typedef struct device_aquasent_s device_aquasent_t;
+/*
+ * a modem, every one has its own serial port, buffers and state,
+ * it is the private data of its device.
+ */
 struct device_aquasent_s {
         char *port;
         char *baud;
-};
 
-// aquasent device info
-static device_aquasent_t device_aquasent;
-// read and write buffer
-static dbuf_t rbuf;
-static dbuf_t wbuf;
-// aquasent device state
-static enum aquasent_read_state read_state;
-static enum aquasent_write_state write_state;
-// cache for write packet
-static packet_t *pkg_cache;
-
-#define hex_to_num(c) ((unsigned char)(c>='A' ? c-'A'+10 : c-'0'))
-
-static const char hex_table[] = 
-{'0', '1', '2', '3',
- '4', '5', '6', '7',
- '8', '9', 'A', 'B',
- 'C', 'D', 'E', 'F'};
+        // read and write buffer
+        dbuf_t rbuf;
+        dbuf_t wbuf;
+
+        // aquasent device state
+        enum aquasent_read_state  read_state;
+        enum aquasent_write_state write_state;
+
+        // the frame of the $HHTXD in wbuf, while it is written
+        packet_t *wpkg;
+
+        // the sentence being read is at the front of rbuf, field i
+        // starts field[i] bytes after its $ and ends a byte before
+        // field[i + 1], nfield is the last one. field 0 is the name.
+        char *sentence;
+        int   field[AQUASENT_MAX_FIELDS + 2];
+        int   nfield;
+
+        // sentences read, dropped damaged, bytes skipped looking for $
+        unsigned long rx_sentences;
+        unsigned long rx_dropped;
+        unsigned long rx_garbage;
+
+        // the frame of the $MMRXD being read, its hex is decoded into
+        // the packet as it comes and not kept in rbuf. a digit of a
+        // byte whose other digit is not read yet waits in rx_digit,
+        // -1 if none.
+        packet_t *rx_pkg;
+        int       rx_digit;
+
+        // transmissions the modem accepted and did not finish, oldest
+        // first at tx_head. each has a number of ours, tx_seq is the
+        // next one, the modem numbers them pn_base after them in
+        // $MMTDN once pn_synced.
+        struct {
+                packet_t    *pkg;
+                unsigned int seq;
+        } tx[AQUASENT_MAX_WINDOW];
+        int          tx_head;
+        int          tx_count;
+        unsigned int tx_seq;
+        unsigned int pn_base;
+        int          pn_synced;
+
+        // the watchdog, ms. the $MMOKY of the last $HHTXD is due at
+        // okay_deadline, the $MMTDN of the oldest transmission at
+        // done_deadline, 0 when nothing is waited for. while the
+        // $HHTXD is written the port must take more of it by
+        // okay_deadline.
+        tick_t  *timer;
+        int      okay_timeout;
+        int      done_timeout;
+        uint64_t okay_deadline;
+        uint64_t done_deadline;
+
+        // recoveries of the watchdog
+        unsigned long okay_lost;
+        unsigned long done_lost;
+
+        // $HHTXD the port took in parts, and gave up when it took no
+        // more in time
+        unsigned long tx_partial;
+        unsigned long tx_stalled;
+};
 
+/*
+ * open every modem in aquasent_devices, a list of names separated by
+ * commas. without the list, there is one modem named by aquasent_name.
+ */
 int aquasent_init()
+{
+        char  buf[128];
+        char *c, *name, *save;
+
+        if (hex_init() == -1) {
+                return -1;
+        }
+
+        c = config_find(AQUASENT_CONFIG_DEVICES);
+        if (!c) {
+                c = config_find(AQUASENT_CONFIG_NAME);
+        }
+        if (!c) {
+                c = AQUASENT_DEFAULT_NAME;
+        }
+
+        strncpy(buf, c, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+
+        for (name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save))
+        {
+                if (aquasent_create(name) == -1) {
+                        return -1;
+                }
+        }
+
+        AQUASENT_INFO("Initialize the AQUASENT MODULE successed.");
+
+        return 0;
+}
+
+int aquasent_create(char *name)
 {
         char *c;
-        int fd;
+        int fd, window;
         device_t *d;
+        device_aquasent_t *a;
+
+        if (strlen(name) != AQUASENT_NAME_LENGTH) {
+                logf_error("AQUA", "Aquasent name %s is not 2 characters.", name);
+                return -1;
+        }
 
         // register aquasent modem to device module
         d = (device_t*) malloc(sizeof(device_t));
         if (!d) {
                 return -1;
         }
- 
+
+        a = (device_aquasent_t*) calloc(1, sizeof(device_aquasent_t));
+        if (!a) {
+                free(d);
+                return -1;
+        }
+
         // cofnigure serail port
-        c = config_find(AQUASENT_CONFIG_PORT);
+        c = device_config(name, AQUASENT_CONFIG_PORT);
         if (c) {
-                device_aquasent.port = c;
+                a->port = c;
         } else {
-                device_aquasent.port = AQUASENT_DEFAULT_PORT;
+                a->port = AQUASENT_DEFAULT_PORT;
         }
 
         // cofnigure serial baud
-        c = config_find(AQUASENT_CONFIG_BAUD);
+        c = device_config(name, AQUASENT_CONFIG_BAUD);
         if (c) {
-                device_aquasent.baud = c;
+                a->baud = c;
         } else {
-                device_aquasent.baud = AQUASENT_DEFAULT_BAUD;
+                a->baud = AQUASENT_DEFAULT_BAUD;
         }
 
-        // cofnigure device name
-        c = config_find(AQUASENT_CONFIG_NAME);
-        if (c) {
-                d->name[0] = c[0];
-                d->name[1] = c[1];
-        } else {
-                d->name[0] = 'A';
-                d->name[1] = 'M';
-        }
+        // device name
+        d->name[0] = name[0];
+        d->name[1] = name[1];
 
         // cofnigure mac adress infomation
-        c = config_find(AQUASENT_CONFIG_MAC_ADDR);
+        c = device_config(name, AQUASENT_CONFIG_MAC_ADDR);
         if (c) {
                 d->mac_addr = atoi(c);
         } else {
@@ -181,19 +291,19 @@ int aquasent_init()
         }
 
         // cofnigure ip adress infomation
-        c = config_find(AQUASENT_CONFIG_IP_ADDR);
+        c = device_config(name, AQUASENT_CONFIG_IP_ADDR);
         if (c) {
                 d->ip_addr = atoi(c);
         } else {
                 d->ip_addr = AQUASENT_DEFAULT_IP_ADDR;
         }
-        c = config_find(AQUASENT_CONFIG_NETMASK);
+        c = device_config(name, AQUASENT_CONFIG_NETMASK);
         if (c) {
                 d->netmask = atoi(c);
         } else {
                 d->netmask = AQUASENT_DEFAULT_NETMASK;
         }
-        c = config_find(AQUASENT_CONFIG_GATEWAY);
+        c = device_config(name, AQUASENT_CONFIG_GATEWAY);
         if (c) {
                 d->gateway = atoi(c);
         } else {
@@ -201,118 +311,155 @@ int aquasent_init()
         }
 
         // cofnigure mtu
-        c = config_find(AQUASENT_CONFIG_MTU);
+        c = device_config(name, AQUASENT_CONFIG_MTU);
         if (c) {
                 d->mtu = atoi(c);
         } else {
                 d->mtu = AQUASENT_DEFAULT_MTU;
         }
 
-        // open aquasent modem
-        if ((fd = aquasent_open(device_aquasent.port, device_aquasent.baud)) == -1) {
-                return -1;
-        } else {
-                logf_info("AQUA", "Open aquasent with port %s and baud rate %s successed.",
-                        device_aquasent.port, device_aquasent.baud);
-                d->fd = fd;
+        // a frame must fit in a packet buffer
+        if (d->mtu <= 0 || d->mtu > packet_mtu()) {
+                logf_error("AQUA", "Aquasent MTU %d is larger than packet MTU %d.",
+                        d->mtu, packet_mtu());
+                goto error;
         }
 
-        // flush serial buffer
-        if (aquasent_flush(fd, 0) == -1) {
-                AQUASENT_ERROR("Can not to flush serial data.");
-                close(fd);
-                return -1;
+        // alloc read and write buffer space
+        a->rbuf.tot_len = AQUASENT_BUFFER_SIZE(d->mtu);
+        a->rbuf.len = 0;
+        a->rbuf.buf = (char*) malloc(a->rbuf.tot_len);
+
+        a->wbuf.tot_len = AQUASENT_BUFFER_SIZE(d->mtu);
+        a->wbuf.len = 0;
+        a->wbuf.buf = (char*) malloc(a->wbuf.tot_len);
+
+        if (!a->rbuf.buf || !a->wbuf.buf) {
+                AQUASENT_ERROR("Can not alloc memory for aquasent buffers.");
+                goto error;
+        }
+
+        // cofnigure transmissions in flight
+        c = device_config(name, AQUASENT_CONFIG_WINDOW);
+        window = c ? atoi(c) : AQUASENT_DEFAULT_WINDOW;
+        if (window < 1 || window > AQUASENT_MAX_WINDOW) {
+                logf_warn("AQUA", "Aquasent window %d is out of 1 to %d, use %d.",
+                        window, AQUASENT_MAX_WINDOW, AQUASENT_DEFAULT_WINDOW);
+                window = AQUASENT_DEFAULT_WINDOW;
+        }
+        d->tx_window = window;
+
+        c = device_config(name, AQUASENT_CONFIG_OKAY);
+        a->okay_timeout = c ? atoi(c) : AQUASENT_DEFAULT_OKAY;
+        if (a->okay_timeout <= 0) {
+                a->okay_timeout = AQUASENT_DEFAULT_OKAY;
+        }
+
+        c = device_config(name, AQUASENT_CONFIG_DONE);
+        a->done_timeout = c ? atoi(c) : AQUASENT_DEFAULT_DONE;
+        if (a->done_timeout <= 0) {
+                a->done_timeout = AQUASENT_DEFAULT_DONE;
+        }
+
+        if (!tick_create(a->timer)) {
+                AQUASENT_ERROR("Can not alloc memory for a timer.");
+                goto error;
+        }
+        tick_init_timer(a->timer, aquasent_timeout, d);
+
+        a->read_state  = s_hunt;
+        a->write_state = s_ready;
+
+        // a simulated modem instead of the serial port
+        c = device_config(name, AQUASENT_CONFIG_SIM);
+        if (c && !strcmp(c, "on")) {
+                if ((fd = sim_open(name)) == -1) {
+                        goto error;
+                }
+                d->fd = fd;
+        } else {
+                // open aquasent modem
+                if ((fd = device_open_tty(a->port, a->baud)) == -1) {
+                        goto error;
+                } else {
+                        logf_info("AQUA", "Open aquasent %s with port %s and baud rate %s successed.",
+                                name, a->port, a->baud);
+                        d->fd = fd;
+                }
+
+                // flush serial buffer
+                if (aquasent_flush(fd, 0) == -1) {
+                        AQUASENT_ERROR("Can not to flush serial data.");
+                        close(fd);
+                        goto error;
+                }
         }
 
         // map device function
-        d->input  = aquasent_input;
-        d->output = aquasent_output;
-        d->exit   = aquasent_exit;
-        d->flag   = 0;
-        d->state  = 0;
+        d->input   = aquasent_input;
+        d->output  = aquasent_output;
+        d->exit    = aquasent_exit;
+        d->report  = aquasent_report;
+        d->drain   = aquasent_write;
+        d->priv    = a;
+        d->master  = NULL;
+        d->receive = NULL;
+        d->pull    = NULL;
+        d->flag    = 0;
+        d->state   = 0;
 
         set_dev_read_available(d);
         set_dev_write_available(d);
 
         if (device_add(d) == -1) {
                 close(fd);
-                return -1;
+                goto error;
         }
 
-        // alloc read buffer space
-        rbuf.tot_len = AQUASENT_BUFFER_SIZE(d->mtu);
-        rbuf.len = 0;
-        rbuf.buf = (char*) malloc(rbuf.tot_len);
-        if (!rbuf.buf) {
-                close(fd);
-                return -1;
-        }
+        return 0;
 
-        // alloc write buffer space
-        wbuf.tot_len = AQUASENT_BUFFER_SIZE(d->mtu);
-        wbuf.len = 0;
-        wbuf.buf = (char*) malloc(wbuf.tot_len);
-        if (!wbuf.buf) {
-                close(fd);
-                return -1;
+error:
+        if (a->timer) {
+                tick_free(a->timer);
         }
-
-        AQUASENT_INFO("Initialize the AQUASENT MODULE successed.");
-
-        return 0;
+        free(a->rbuf.buf);
+        free(a->wbuf.buf);
+        free(a);
+        free(d);
+        return -1;
 }
 
-int aquasent_exit()
+int aquasent_exit(device_t *d)
 {
+        device_aquasent_t *a = (device_aquasent_t*) d->priv;
+
+        close(d->fd);
+
+        tick_delete(a->timer);
+        tick_free(a->timer);
+
+        aquasent_rx_drop(a);
+        free(a->rbuf.buf);
+        free(a->wbuf.buf);
+        free(a);
+
         return 0;
 }
 
-int aquasent_open(char *port, char *baud)
+int aquasent_report(device_t *d)
 {
-        struct termios tio;     
-        int bd, fd, rv;
+        device_aquasent_t *a = (device_aquasent_t*) d->priv;
 
-        if ((fd = open(port, O_RDWR)) == -1) {
-                AQUASENT_ERROR("Can not to open aquasent.");
-                return -1;
-        }
+        logf_info("AQUA", "%.2s %d transmissions in flight, %lu $MMOKY and %lu $MMTDN timed out.",
+                d->name, a->tx_count, a->okay_lost, a->done_lost);
 
-        switch(atoi(baud))
-        {
-                case 9600:
-                        bd = B9600;
-                        break;
-                case 19200:
-                        bd = B19200;
-                        break;
-                case 38400:
-                        bd = B38400;
-                        break;
-                case 115200:
-                        bd = B115200;
-                        break;
-                default:
-                        close(fd);
-                        return -1;
-        }
+        logf_info("AQUA", "%.2s read %lu sentences, dropped %lu damaged, skipped %lu bytes of garbage.",
+                d->name, a->rx_sentences, a->rx_dropped, a->rx_garbage);
 
-        memset(&tio,0,sizeof(tio));
-        tio.c_iflag     = 0;
-        tio.c_oflag     = 0;
-        tio.c_cflag     = CS8|CREAD|CLOCAL;
-        tio.c_lflag     = 0;
-        tio.c_cc[VMIN]  = 1;
-        tio.c_cc[VTIME] = 5;
-        rv  = cfsetospeed(&tio, bd);
-        rv |= cfsetispeed(&tio, bd);
-        rv |= tcsetattr(fd, TCSANOW, &tio);
-        if(rv) {
-                AQUASENT_ERROR("Can not set parameter to aquasent.");
-                close(fd);
-                return -1;
-        }
-        
-        return fd;
+        logf_info("AQUA", "%.2s wrote %lu $HHTXD in parts, gave up %lu the port did not take.",
+                d->name, a->tx_partial, a->tx_stalled);
+
+        return 0;
 }
 
 int aquasent_flush(int fd, int flag)
@@ -320,548 +467,649 @@ int aquasent_flush(int fd, int flag)
         return tcflush(fd, flag);
 }
 
-#define IS_DOLLAR(c)    ((c) == '$')
-#define IS_COMMA(c)     ((c) == ',')
-#define IS_NUMBER(c)    ((c) <= '9' && (c) >= '0')
-#define IS_ALPHABET(c)  (((c) <= 'Z' && (c) >= 'A') || ((c) <= 'z' && (c) >= 'a'))
-#define IS_CR(c)        ((c) == '\r')
-#define IS_LF(c)        ((c) == '\n')
-#define IS_CMD_CHAR(c)  ((c) == 'H' || (c) == 'T' || (c) == 'X' || (c) == 'D' ||        \
-                         (c) == 'A' || (c) == 'C' || (c) == 'W' || (c) == 'R')
-#define IS_VCHAR(c)     (IS_NUMBER(c) || IS_ALPHABET(c) || IS_COMMA(c))
-#define IS_HEX(c)       (IS_NUMBER(c) || (c) == 'A' || (c) == 'B' || (c) == 'C' ||      \
-                         (c) == 'D' || (c) == 'E' || (c) == 'F')
+#define aquasent_field(a, i)      ((a)->sentence + (a)->field[i])
+#define aquasent_field_len(a, i)  ((a)->field[(i) + 1] - (a)->field[i] - 1)
+
+// the characters of a field, printable but $ and the comma
+static const uint8_t aquasent_class[256] = {
+        [0 ... 255]   = c_bad,
+        [' ' ... '~'] = c_text,
+        ['$']         = c_dollar,
+        [',']         = c_comma,
+        ['\r']        = c_cr,
+        ['\n']        = c_lf,
+};
+
+typedef struct aquasent_trans_s aquasent_trans_t;
+struct aquasent_trans_s {
+        uint8_t next;
+        uint8_t action;
+};
+
+static const aquasent_trans_t aquasent_dfa[s_read_states][c_classes] = {
+        [s_hunt] = {
+                [c_bad]    = { s_hunt, a_skip  },
+                [c_text]   = { s_hunt, a_skip  },
+                [c_dollar] = { s_body, a_start },
+                [c_comma]  = { s_hunt, a_skip  },
+                [c_cr]     = { s_hunt, a_skip  },
+                [c_lf]     = { s_hunt, a_skip  },
+        },
+        [s_body] = {
+                [c_bad]    = { s_hunt, a_drop  },
+                [c_text]   = { s_body, a_text  },
+                [c_dollar] = { s_body, a_start },
+                [c_comma]  = { s_body, a_comma },
+                [c_cr]     = { s_cr,   a_cr    },
+                [c_lf]     = { s_hunt, a_drop  },
+        },
+        [s_cr] = {
+                [c_bad]    = { s_hunt, a_drop  },
+                [c_text]   = { s_hunt, a_drop  },
+                [c_dollar] = { s_body, a_start },
+                [c_comma]  = { s_hunt, a_drop  },
+                [c_cr]     = { s_hunt, a_drop  },
+                [c_lf]     = { s_hunt, a_end   },
+        },
+};
 
+typedef struct aquasent_sentence_s aquasent_sentence_t;
+struct aquasent_sentence_s {
+        const char *name;
+        int         fields;     // after the name, at least
+        int       (*handle)(device_aquasent_t *a, device_t *d);
+};
+
+static const aquasent_sentence_t aquasent_sentences[] = {
+        { "MMRXD", 3, handle_mmrxd },
+        { "MMOKY", 1, handle_mmoky },
+        { "MMTDN", 1, handle_mmtdn },
+        { "MMERR", 1, handle_mmerr },
+};
+
+#define AQUASENT_SENTENCES      (sizeof(aquasent_sentences) / sizeof(aquasent_sentences[0]))
+
+/*
+ * read what the modem sent, and handle the whole sentences in it.
+ * the bytes go through the dfa once, the offsets of the fields are
+ * kept as they are found. a sentence not whole yet is moved to the
+ * front of the buffer, the next read goes on after it, but for the
+ * hex of a $MMRXD, which is decoded into its packet as it is read.
+ */
 int aquasent_input(device_t *d)
 {
-        int i, p;
-        char ch;
-
-        int len = read(d->fd, rbuf.buf + rbuf.len, rbuf.tot_len - rbuf.len);
-        if (len == -1) {
+        device_aquasent_t      *a   = (device_aquasent_t*) d->priv;
+        char                   *buf = a->rbuf.buf;
+        const aquasent_trans_t *t;
+        enum aquasent_read_state prev;
+        struct iovec iov;
+        int start = 0, pos, run, end, n;
+
+        // the port is level-triggered, its end or an error would be
+        // reported again at once, and for ever
+        iov.iov_base = buf + a->rbuf.len;
+        iov.iov_len  = a->rbuf.tot_len - a->rbuf.len;
+
+        n = event_read(d->ev, &iov, 1);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return 0;
+        } else if (n <= 0) {
+                logf_error("AQUA", "%.2s can not read from the port: %s.",
+                        d->name, n ? strerror(errno) : "closed");
+                aquasent_rx_drop(a);
+                device_hangup(d);
                 return -1;
         }
 
-        p = rbuf.len;
-        i = 0;
-        while (i < len)
+        end = a->rbuf.len + n;
+
+        for (pos = a->rbuf.len; pos < end; pos++)
         {
-                ch = rbuf.buf[p++];
-                i++;
-        
-                switch(read_state)
+                prev = a->read_state;
+                t    = &aquasent_dfa[prev][aquasent_class[(uint8_t) buf[pos]]];
+
+                a->read_state = t->next;
+
+                switch (t->action)
                 {
-                        case s_init:
-                        if (IS_DOLLAR(ch)) {
-                                read_state = s_dollar;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                        case a_skip:
+                        a->rx_garbage++;
+                        break;
 
-                        case s_dollar:
-                        if (ch == 'M') {
-                                read_state = s_m;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
+                        // the rest of the field at once, 8 characters
+                        // a step while they are all text
+                        case a_text:
+                        run = pos;
+                        while (pos + 8 < end &&
+                               !(aquasent_class[(uint8_t) buf[pos + 1]] | aquasent_class[(uint8_t) buf[pos + 2]] |
+                                 aquasent_class[(uint8_t) buf[pos + 3]] | aquasent_class[(uint8_t) buf[pos + 4]] |
+                                 aquasent_class[(uint8_t) buf[pos + 5]] | aquasent_class[(uint8_t) buf[pos + 6]] |
+                                 aquasent_class[(uint8_t) buf[pos + 7]] | aquasent_class[(uint8_t) buf[pos + 8]]))
+                        {
+                                pos += 8;
                         }
-
-                        case s_m:
-                        if (ch == 'M') {
-                                read_state = s_mm;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
+                        while (pos + 1 < end && aquasent_class[(uint8_t) buf[pos + 1]] == c_text)
+                        {
+                                pos++;
                         }
 
-                        case s_mm:
-                        switch (ch)
-                        {
-                                case 'E':
-                                        read_state = s_mme;
-                                        break;
-                                case 'O':
-                                        read_state = s_mmo;
-                                        break;
-                                case 'R':
-                                        read_state = s_mmr;
-                                        break;
-                                case 'T':
-                                        read_state = s_mmt;
-                                        break;
-                                default:
-                                        goto error;
-                                        break;
+                        if (a->rx_pkg && aquasent_rx_decode(a, buf + run, pos + 1 - run) == -1) {
+                                aquasent_rx_drop(a);
+                                a->read_state = s_hunt;
+                                a->rx_dropped++;
                         }
-                                rbuf.len++;
                         break;
 
-                        case s_mme:
-                        if (ch == 'R') {
-                                read_state = s_mmer;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
+                        // a $ in a sentence starts the next one
+                        case a_start:
+                        if (prev != s_hunt) {
+                                a->rx_dropped++;
                         }
+                        aquasent_rx_drop(a);
+                        start       = pos;
+                        a->sentence = buf + start;
+                        a->nfield   = 0;
+                        a->field[0] = 1;
+                        break;
 
-                        case s_mmer:
-                        if (ch == 'R') {
-                                read_state = s_mmerr;
-                                rbuf.len++;
+                        // the hex of a $MMRXD is the last field
+                        case a_comma:
+                        if (a->nfield == AQUASENT_MAX_FIELDS || a->rx_pkg) {
+                                aquasent_rx_drop(a);
+                                a->read_state = s_hunt;
+                                a->rx_dropped++;
                                 break;
-                        } else {
-                                goto error;
                         }
+                        a->field[++a->nfield] = pos - start + 1;
 
-                        case s_mmerr:
-                        if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmerr;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
+                        if (a->nfield == 3 && aquasent_field_len(a, 0) == 5 &&
+                            !memcmp(aquasent_field(a, 0), "MMRXD", 5)) {
+                                aquasent_rx_start(a, d);
                         }
+                        break;
 
-                        case s_comma_after_mmerr:
-                        if (IS_CMD_CHAR(ch)) {
-                                read_state = s_mmerr_cmd;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                        case a_cr:
+                        a->field[a->nfield + 1] = pos - start + 1;
+                        break;
 
-                        case s_mmerr_cmd:
-                        if (IS_CMD_CHAR(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmerr_cmd;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                        case a_end:
+                        aquasent_sentence(a, d);
+                        break;
 
-                        case s_comma_after_mmerr_cmd:
-                        if (IS_NUMBER(ch)) {
-                                read_state = s_mmerr_code;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                        case a_drop:
+                        aquasent_rx_drop(a);
+                        a->rx_dropped++;
+                        break;
+                }
+        }
 
-                        case s_mmerr_code:
-                        if (IS_NUMBER(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_CR(ch)) {
-                                read_state = s_cr_after_mmerr;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        // keep the sentence not whole yet, unless it fills the buffer,
+        // of a $MMRXD only what is before its hex
+        if (a->read_state == s_hunt) {
+                a->rbuf.len = 0;
+        } else if (a->rx_pkg) {
+                memmove(buf, buf + start, a->field[3]);
+                a->rbuf.len = a->field[3];
+        } else if (start == 0 && end == a->rbuf.tot_len) {
+                AQUASENT_WARN("Drop a too long sentence.");
+                a->read_state = s_hunt;
+                a->rx_dropped++;
+                a->rbuf.len = 0;
+        } else {
+                memmove(buf, buf + start, end - start);
+                a->rbuf.len = end - start;
+        }
+        a->sentence = buf;
 
-                        case s_cr_after_mmerr:
-                        if (IS_LF(ch)) {
-                                read_state = s_init;
-                                rbuf.len = 0;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        return 0;
+}
 
-                        case s_mmo:
-                        if (ch == 'K') {
-                                rbuf.len++;
-                                read_state = s_mmok;
-                                break;
-                        } else {
-                                goto error;
-                        }
+/*
+ * a whole sentence, to the handler of its name.
+ */
+static int aquasent_sentence(device_aquasent_t *a, device_t *d)
+{
+        const aquasent_sentence_t *s;
+        size_t i;
 
-                        case s_mmok:
-                        if (ch == 'Y') {
-                                rbuf.len++;
-                                read_state = s_mmoky;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        a->rx_sentences++;
 
-                        case s_mmoky:
-                        if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmoky;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        for (i = 0; i < AQUASENT_SENTENCES; i++)
+        {
+                s = &aquasent_sentences[i];
 
-                        case s_comma_after_mmoky:
-                        if (IS_CMD_CHAR(ch)) {
-                                read_state = s_mmoky_cmd;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                if (aquasent_field_len(a, 0) != (int) strlen(s->name) ||
+                    memcmp(aquasent_field(a, 0), s->name, aquasent_field_len(a, 0))) {
+                        continue;
+                }
 
-                        case s_mmoky_cmd:
-                        if (IS_CMD_CHAR(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmoky_cmd;
-                                rbuf.len++;
-                                break;
-                        } else if (IS_CR(ch)) {
-                                read_state = s_cr_after_mmoky;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                if (a->nfield < s->fields) {
+                        logf_warn("AQUA", "Drop a $%s with %d fields.", s->name, a->nfield);
+                        a->rx_dropped++;
+                        return -1;
+                }
 
-                        case s_comma_after_mmoky_cmd:
-                        if (IS_VCHAR(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_CR(ch)) {
-                                read_state = s_cr_after_mmoky;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                return s->handle(a, d);
+        }
 
-                        case s_cr_after_mmoky:
-                        if (IS_LF(ch)) {
-                                read_state = s_init;
-                                rbuf.len = 0;
-                                handle_mmoky();
-                                break;
-                        } else {
-                                goto error;
-                        }
+        return 0;
+}
 
-                        case s_mmr:
-                        if (ch == 'X') {
-                                read_state = s_mmrx;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+#define CMD_HHTXD_HEADER "$HHTXD,0,0,0,"
+#define CMD_HHTXD_HEADER_LENGTH strlen(CMD_HHTXD_HEADER)
 
-                        // TODO
-                        // $MMRXA
-                        case s_mmrx:
-                        if (ch == 'D') {
-                                read_state = s_mmrxd;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+/*
+ * the port does not block, the $HHTXD goes out as fast as the port
+ * takes it while the event loop goes on, the frame is in flight once
+ * all of it is written.
+ */
+int aquasent_output(packet_t *pkg)
+{
+        device_aquasent_t *a = (device_aquasent_t*) pkg->dev->priv;
+        char              *buf = a->wbuf.buf;
 
-                        case s_mmrxd:
-                        if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmrxd;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        if (a->write_state != s_ready || a->tx_count == AQUASENT_MAX_WINDOW) {
+                return -1;
+        }
 
-                        case s_comma_after_mmrxd:
-                        if (IS_NUMBER(ch)) {
-                                read_state = s_mmrxd_src;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        memcpy(buf, CMD_HHTXD_HEADER, CMD_HHTXD_HEADER_LENGTH);
+        hex_encode(buf + CMD_HHTXD_HEADER_LENGTH, (unsigned char*) pkg->pdu, pkg->len);
+        memcpy(buf + CMD_HHTXD_HEADER_LENGTH + pkg->len * 2, "\r\n", 2);
 
-                        case s_mmrxd_src:
-                        if (IS_NUMBER(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmrxd_src;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        a->wbuf.len = CMD_HHTXD_HEADER_LENGTH + pkg->len * 2 + 2;
+        a->wbuf.pos = 0;
+        a->wpkg     = pkg;
 
-                        case s_comma_after_mmrxd_src:
-                        if (IS_NUMBER(ch)) {
-                                read_state = s_mmrxd_dst;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
- 
-                        case s_mmrxd_dst:
-                        if (IS_NUMBER(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmrxd_dst;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        a->write_state   = s_writing;
+        a->okay_deadline = tick_now() + a->okay_timeout;
+        aquasent_watch(a);
 
-                        case s_comma_after_mmrxd_dst:
-                        if (IS_HEX(ch)) {
-                                read_state = s_mmrxd_data;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        aquasent_write(pkg->dev);
 
-                        case s_mmrxd_data:
-                        if (IS_HEX(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_CR(ch)) {
-                                read_state = s_cr_after_mmrxd;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        if (a->write_state == s_writing) {
+                a->tx_partial++;
+        }
 
-                        case s_cr_after_mmrxd:
-                        if (IS_LF(ch)) {
-                                read_state = s_init;
-                                rbuf.len++;
-                                handle_mmrxd();
-                                break;
-                        } else {
-                                goto error;
-                        }
+        return 0;
+}
 
-                        case s_mmt:
-                        if (ch == 'D') {
-                                read_state = s_mmtd;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+/*
+ * write what the port takes of the $HHTXD, on every write event
+ * until it is all out.
+ */
+static int aquasent_write(device_t *d)
+{
+        device_aquasent_t *a   = (device_aquasent_t*) d->priv;
+        packet_t          *pkg = a->wpkg;
+        struct iovec       iov;
+        int                i, n, wrote = 0;
 
-                        case s_mmtd:
-                        if (ch == 'N') {
-                                read_state = s_mmtdn;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        if (a->write_state != s_writing) {
+                return 0;
+        }
 
-                        case s_mmtdn:
-                        if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmtdn;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
+        while (a->wbuf.pos < a->wbuf.len)
+        {
+                iov.iov_base = a->wbuf.buf + a->wbuf.pos;
+                iov.iov_len  = a->wbuf.len - a->wbuf.pos;
+
+                n = event_write(d->ev, &iov, 1);
+
+                if (n == -1 && errno == EINTR) {
+                        continue;
+                } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        // the port must take more before okay_timeout
+                        if (wrote) {
+                                a->okay_deadline = tick_now() + a->okay_timeout;
+                                aquasent_watch(a);
                         }
+                        return device_output_pending(pkg);
+                } else if (n <= 0) {
+                        logf_error("AQUA", "%.2s can not write to the port: %s.",
+                                d->name, n ? strerror(errno) : "closed");
+                        aquasent_write_fail(a);
+                        return device_output_ready(d);
+                }
 
-                        case s_comma_after_mmtdn:
-                        if (IS_NUMBER(ch)) {
-                                read_state = s_mmtdn_result;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+                a->wbuf.pos += n;
+                wrote       += n;
+        }
 
-                        case s_mmtdn_result:
-                        if (IS_NUMBER(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_COMMA(ch)) {
-                                read_state = s_comma_after_mmtdn_result;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        a->write_state   = s_wait_mmoky;
+        a->okay_deadline = tick_now() + a->okay_timeout;
+        a->wpkg          = NULL;
 
-                        case s_comma_after_mmtdn_result:
-                        if (IS_NUMBER(ch)) {
-                                read_state = s_mmtdn_pn;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
+        i = (a->tx_head + a->tx_count++) % AQUASENT_MAX_WINDOW;
+        a->tx[i].pkg = pkg;
+        a->tx[i].seq = a->tx_seq++;
 
-                        case s_mmtdn_pn:
-                        if (IS_NUMBER(ch)) {
-                                rbuf.len++;
-                                break;
-                        } else if (IS_CR(ch)) {
-                                read_state = s_cr_after_mmtdn;
-                                rbuf.len++;
-                                break;
-                        } else {
-                                goto error;
-                        }
- 
-                        case s_cr_after_mmtdn:
-                        if (IS_LF(ch)) {
-                                read_state = s_init;
-                                rbuf.len = 0;
-                                handle_mmtdn();
-                                break;
-                        } else {
-                                goto error;
-                        }
-                        
-                }
+        if (a->tx_count == 1) {
+                aquasent_deadline(a, d);
         }
-        return 0;
+        aquasent_watch(a);
 
-error:
-        read_state = s_init;
-        printf("error\n");
-        return -1;
+        return device_output_finish_part(pkg);
 }
 
-int byte_to_hex(char *hex, const unsigned char *src, size_t size)
+/*
+ * give up the $HHTXD being written, the modem drops the part it got
+ * when the next $ comes. no $MMOKY comes for it, its deadline goes.
+ */
+static void aquasent_write_fail(device_aquasent_t *a)
 {
-        int i;
-        for (i = 0; i < size; i++)
-        {
-                hex[i*2]   = hex_table[src[i] >> 4];
-                hex[i*2+1] = hex_table[src[i] & 0x0f];
+        packet_t *pkg = a->wpkg;
+
+        a->wpkg          = NULL;
+        a->wbuf.len      = 0;
+        a->wbuf.pos      = 0;
+        a->write_state   = s_ready;
+        a->okay_deadline = 0;
+        aquasent_watch(a);
+
+        if (pkg) {
+                device_output_fail(pkg);
+        }
+}
+
+/*
+ * the modem took the transmission into its queue, it can take the
+ * next one while this one is on the air.
+ */
+int handle_mmoky(device_aquasent_t *a, device_t *d)
+{
+        if (strncmp(aquasent_field(a, 1), "MMRXD", 5) && a->write_state == s_wait_mmoky) {
+                a->write_state   = s_ready;
+                a->okay_deadline = 0;
+                aquasent_watch(a);
+                return device_output_ready(d);
         }
 
         return 0;
 }
 
-#define CMD_HHTXD_HEADER "$HHTXD,0,0,0,"
-#define CMD_HHTXD_HEADER_LENGTH strlen(CMD_HHTXD_HEADER)
-
-int aquasent_output(packet_t *pkg)
+/*
+ * $MMTDN,result,pn, the transmission numbered pn by the modem is
+ * done. the first one tells how its numbers match ours, a number of
+ * none in flight means the modem numbers them again from the oldest
+ * one. the ones before it whose $MMTDN was lost are done as well.
+ * a result other than 0 is a transmission the modem failed, a loss
+ * on the channel for the link estimator, any other one done gets
+ * through for it.
+ */
+int handle_mmtdn(device_aquasent_t *a, device_t *d)
 {
-        if (write_state != s_ready) {
-                return -1;
+        packet_t    *pkg;
+        unsigned int pn, oldest, newest, target, seq;
+        int          result = atoi(aquasent_field(a, 1));
+
+        if (!a->tx_count) {
+                AQUASENT_WARN("A transmission is done, but none is in flight.");
+                return 0;
         }
 
-        strncpy(wbuf.buf, CMD_HHTXD_HEADER, CMD_HHTXD_HEADER_LENGTH);
-        byte_to_hex(wbuf.buf+CMD_HHTXD_HEADER_LENGTH, pkg->pdu, pkg->len);
-        strncpy(wbuf.buf+CMD_HHTXD_HEADER_LENGTH+pkg->len*2, "\r\n", 2);
+        oldest = a->tx[a->tx_head].seq;
+        newest = oldest + a->tx_count - 1;
+
+        // without a number, it is the oldest one
+        if (a->nfield < 2) {
+                target = oldest;
+        } else {
+                pn     = strtoul(aquasent_field(a, 2), NULL, 10);
+                target = pn - a->pn_base;
 
-        int nwrite = 0, len;
-        int nleft  = CMD_HHTXD_HEADER_LENGTH + pkg->len * 2 + 2;
+                if (!a->pn_synced || (int) (target - oldest) < 0 || (int) (target - newest) > 0) {
+                        if (a->pn_synced) {
+                                AQUASENT_WARN("The modem numbers its transmissions again.");
+                        }
+                        a->pn_base   = pn - oldest;
+                        a->pn_synced = 1;
+                        target       = oldest;
+                }
+        }
 
-        while (nleft > 0)
+        while (a->tx_count && (int) (target - a->tx[a->tx_head].seq) >= 0)
         {
-                len = write(pkg->dev->fd, wbuf.buf, nleft);
+                seq = a->tx[a->tx_head].seq;
+                if (seq != target) {
+                        AQUASENT_WARN("A $MMTDN is lost, the transmission is done.");
+                }
 
-                if (len == -1) {
-                        return -1;
-                } else if (len == 0) {
-                        break;
+                pkg = a->tx[a->tx_head].pkg;
+                a->tx[a->tx_head].pkg = NULL;
+                a->tx_head = (a->tx_head + 1) % AQUASENT_MAX_WINDOW;
+                a->tx_count--;
+
+                if (seq == target && result) {
+                        logf_warn("AQUA", "%.2s failed a transmission with result %d.", d->name, result);
+                        device_observe(d, pkg->len, 0);
+                        device_output_fail(pkg);
                 } else {
-                        nleft  -= len;
-                        nwrite += len;
+                        device_observe(d, pkg->len, 1);
+                        device_output_finish(pkg);
                 }
         }
 
-        write_state = s_wait_mmoky;
+        aquasent_deadline(a, d);
+        aquasent_watch(a);
 
-        pkg_cache = pkg;
+        return 0;
+}
 
-        return device_output_finish_part(pkg);
+/*
+ * the oldest transmission is on the air now, it is done after the
+ * time its bytes take at the measured rate, with done_timeout to
+ * spare.
+ */
+static void aquasent_deadline(device_aquasent_t *a, device_t *d)
+{
+        packet_t *pkg;
+
+        if (!a->tx_count) {
+                a->done_deadline = 0;
+                return;
+        }
+
+        pkg = a->tx[a->tx_head].pkg;
+
+        a->done_deadline = tick_now() + a->done_timeout;
+        if (d->tx_rate) {
+                a->done_deadline += (uint64_t) pkg->len * 1000 / d->tx_rate;
+        }
 }
 
-int handle_mmoky()
+/*
+ * arm the timer for the nearest deadline.
+ */
+static void aquasent_watch(device_aquasent_t *a)
 {
-        int i;
-        for (i = 0; rbuf.buf[i] != ','; i++)
-                ;
-        i++;
+        uint64_t next = a->okay_deadline, now;
 
-        if (strncmp(rbuf.buf + i, "MMRXD", 5)) {
-                write_state = s_wait_mmtdn;
+        if (a->done_deadline && (!next || a->done_deadline < next)) {
+                next = a->done_deadline;
         }
 
-        return 0;
+        if (!next) {
+                tick_delete(a->timer);
+                return;
+        }
+
+        now = tick_now();
+        tick_add(a->timer, next > now ? (int) (next - now) : 0);
 }
 
-int handle_mmtdn()
+/*
+ * the modem did not answer in time. without $MMOKY the command is
+ * taken as accepted, the device may send again. without $MMTDN the
+ * modem is lost, the transmissions in flight are given up, the
+ * parser and the numbers of the modem start again.
+ */
+static int aquasent_timeout(tick_t *tc)
 {
-        write_state = s_ready;
+        device_t          *d = (device_t*) tc->data;
+        device_aquasent_t *a = (device_aquasent_t*) d->priv;
+        packet_t          *pkg;
+        uint64_t           now = tick_now();
+        int                n   = a->tx_count;
+
+        if (a->done_deadline && now >= a->done_deadline) {
+                a->done_lost++;
+                logf_warn("AQUA", "%.2s got no $MMTDN in time, give up %d transmissions, %lu times.",
+                        d->name, n, a->done_lost);
+
+                while (a->tx_count)
+                {
+                        pkg = a->tx[a->tx_head].pkg;
+                        a->tx[a->tx_head].pkg = NULL;
+                        a->tx_head = (a->tx_head + 1) % AQUASENT_MAX_WINDOW;
+                        a->tx_count--;
+
+                        device_output_fail(pkg);
+                }
+                aquasent_write_fail(a);
+
+                a->done_deadline = 0;
+                a->okay_deadline = 0;
+                a->pn_synced     = 0;
+                a->read_state    = s_hunt;
+                a->rbuf.len      = 0;
+                aquasent_rx_drop(a);
+                a->write_state   = s_ready;
+        } else if (a->okay_deadline && now >= a->okay_deadline && a->write_state == s_writing) {
+                a->tx_stalled++;
+                logf_warn("AQUA", "%.2s port took %d of %d bytes of the $HHTXD and no more in time, give it up.",
+                        d->name, a->wbuf.pos, a->wbuf.len);
+
+                aquasent_flush(d->fd, TCOFLUSH);
+                aquasent_write_fail(a);
+        } else if (a->okay_deadline && now >= a->okay_deadline) {
+                a->okay_lost++;
+                logf_warn("AQUA", "%.2s got no $MMOKY in time, %lu times.",
+                        d->name, a->okay_lost);
+
+                a->okay_deadline = 0;
+                a->write_state   = s_ready;
+        } else {
+                aquasent_watch(a);
+                return 0;
+        }
 
-        set_dev_write_available(pkg_cache->dev);
+        aquasent_watch(a);
 
-        device_output_finish(pkg_cache);
+        return device_output_ready(d);
+}
 
-        pkg_cache = NULL;
+/*
+ * $MMERR,cmd,code, an error of a command of ours, or a frame the
+ * modem heard and could not decode, a loss on the channel for the
+ * link estimator, taken as a frame of the size in use.
+ */
+int handle_mmerr(device_aquasent_t *a, device_t *d)
+{
+        if (!strncmp(aquasent_field(a, 1), "HHTXD", 5)) {
+                logf_warn("AQUA", "%.2s got an error of $HHTXD.", d->name);
+                return 0;
+        }
+
+        device_observe(d, d->tx_size + DEVICE_SUB_HEADER_LENGTH, 0);
 
         return 0;
 }
 
-int handle_mmrxd()
+/*
+ * $MMRXD,src,dst,hex, a frame from the other modem, decoded into
+ * rx_pkg while it was read.
+ */
+int handle_mmrxd(device_aquasent_t *a, device_t *d)
 {
-        packet_t *pkg = (packet_t*) malloc(sizeof(packet_t));
+        packet_t *pkg = a->rx_pkg;
+
+        a->rx_pkg = NULL;
+
         if (!pkg) {
-                AQUASENT_ERROR("Can not alloc memory for the packet.");
                 return -1;
         }
 
-        char *pdu = (char*) malloc(rbuf.len / 2);
-        if (!pdu) {
+        if (a->rx_digit != -1) {
+                AQUASENT_WARN("Drop a frame with an odd number of hex digits.");
+                packet_put(pkg);
+                return -1;
+        }
+
+        return device_input_finish(pkg);
+}
+
+/*
+ * the hex of a $MMRXD comes next, into a packet from the pool with
+ * the headroom of every layer, the sentence is dropped without one.
+ */
+static void aquasent_rx_start(device_aquasent_t *a, device_t *d)
+{
+        packet_t *pkg;
+
+        pkg = packet_alloc();
+        if (!pkg) {
                 AQUASENT_ERROR("Can not alloc memory for the packet.");
+                a->read_state = s_hunt;
+                a->rx_dropped++;
+                return;
+        }
+
+        pkg->dev = d;
+        pkg->up  = 1;
+
+        a->rx_pkg   = pkg;
+        a->rx_digit = -1;
+}
+
+/*
+ * size more hex digits of the frame, read straight from rbuf into
+ * the packet. a digit left over waits for the next read.
+ */
+static int aquasent_rx_decode(device_aquasent_t *a, const char *hex, int size)
+{
+        packet_t *pkg = a->rx_pkg;
+        char      pair[2];
+        int       n;
+
+        if (pkg->len + (size + (a->rx_digit != -1)) / 2 > packet_mtu()) {
+                AQUASENT_WARN("Drop a frame too long for a packet.");
                 return -1;
         }
-        pkg->pdu  = pdu;
-        pkg->up   = 1;
-        pkg->down = 0;
 
-        int comma_num = 0;
-        int i;
-        for (i = 0; comma_num < 3; i++)
-        {
-                if (IS_COMMA(rbuf.buf[i])) {
-                        comma_num++;
+        if (a->rx_digit != -1) {
+                pair[0] = (char) a->rx_digit;
+                pair[1] = *hex++;
+                size--;
+
+                if (hex_decode((unsigned char*) packet_tail(pkg), pair, 2) == -1) {
+                        goto bad;
                 }
+                pkg->len++;
+                a->rx_digit = -1;
         }
 
-        hex_to_byte(pdu, rbuf.buf + i, rbuf.len - i - 2);
-        pkg->len = (rbuf.len - i - 2) / 2;
-        pkg->tot_len = pkg->len;
-        pkg->ref = 1;
+        n = size & ~1;
+        if (hex_decode((unsigned char*) packet_tail(pkg), hex, n) == -1) {
+                goto bad;
+        }
+        pkg->len += n / 2;
 
-        rbuf.len = 0;
+        if (size & 1) {
+                a->rx_digit = (uint8_t) hex[n];
+        }
 
-        return device_input_finish(pkg);
+        return 0;
+
+bad:
+        AQUASENT_WARN("Drop a frame with bad hex digits.");
+        return -1;
 }
 
-int hex_to_byte(char *dst, const char *hex, size_t size)
+static void aquasent_rx_drop(device_aquasent_t *a)
 {
-        int i = 0;
-        for (i = 0; i < size; i+=2)
-        {
-                dst[i/2] = (hex_to_num(hex[i]) << 4) + hex_to_num(hex[i+1]);
+        if (a->rx_pkg) {
+                packet_put(a->rx_pkg);
+                a->rx_pkg = NULL;
         }
-        return 0;
 }
 
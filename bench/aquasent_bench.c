@@ -0,0 +1,272 @@
+/*
+ * aquasent_bench.c
+ *
+ * The modem parser on captured traffic, bench/aquasent.cap by default,
+ * made by bench/capture.py. The capture goes into the end of a
+ * socketpair the driver reads as its port, aquasent_input() reads and
+ * parses it until the socket is empty, again and again. The time of
+ * the reads alone, into a buffer as large, is given to subtract. It
+ * runs with the scalar hex kernel and with the best one.
+ *
+ * The device module is not here, its functions the driver calls are
+ * stubs counting the frames. No transmission is in flight, so every
+ * $MMTDN is done with at once.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "bench.h"
+#include "device.h"
+#include "event.h"
+#include "hex.h"
+#include "packet.h"
+#include "pool.h"
+
+#define BENCH_CAPTURE           "bench/aquasent.cap"
+#define BENCH_BYTES             (64 << 20)
+#define BENCH_TIMINGS           5
+
+// the read buffer of the driver with aquasent_mtu by default
+#define BENCH_READ_SIZE         (1024 * 2 + 300)
+
+extern int aquasent_create(char *name);
+extern int aquasent_input(device_t *d);
+
+static char    *cap;
+static size_t   cap_len;
+static int      sentences;
+
+static int      fd[2];
+static event_t  ev;
+static device_t *dev;
+static int      frames;
+
+int sim_open(char *name)
+{
+        return fd[0];
+}
+
+char *device_config(char *name, char *key)
+{
+        return config_find(key);
+}
+
+int device_open_tty(char *port, char *baud)
+{
+        return -1;
+}
+
+int device_add(device_t *device)
+{
+        ev.fd   = device->fd;
+        ev.flag = 0;
+
+        dev      = device;
+        dev->ev  = &ev;
+
+        return 0;
+}
+
+int device_input_finish(packet_t *pkg)
+{
+        frames++;
+        packet_put(pkg);
+
+        return 0;
+}
+
+int device_hangup(device_t *d)
+{
+        return 0;
+}
+
+int device_output_finish(packet_t *pkg)
+{
+        return 0;
+}
+
+int device_output_finish_part(packet_t *pkg)
+{
+        return 0;
+}
+
+int device_output_pending(packet_t *pkg)
+{
+        return 0;
+}
+
+int device_output_ready(device_t *d)
+{
+        return 0;
+}
+
+int device_output_fail(packet_t *pkg)
+{
+        return 0;
+}
+
+void device_observe(device_t *d, int len, int ok)
+{
+}
+
+static int bench_load(const char *name)
+{
+        FILE  *f;
+        long   n;
+        size_t i;
+
+        f = fopen(name, "r");
+        if (!f) {
+                printf("can not open %s, make it with bench/capture.py.\n", name);
+                return -1;
+        }
+
+        fseek(f, 0, SEEK_END);
+        n = ftell(f);
+        fseek(f, 0, SEEK_SET);
+
+        cap = (char*) malloc(n > 0 ? n : 1);
+        if (!cap || n <= 0 || fread(cap, 1, n, f) != (size_t) n) {
+                printf("can not read %s.\n", name);
+                fclose(f);
+                return -1;
+        }
+        fclose(f);
+
+        cap_len = n;
+        for (i = 0; i < cap_len; i++)
+        {
+                sentences += cap[i] == '$';
+        }
+
+        return 0;
+}
+
+/*
+ * all the capture in the socket, with the reads of it parsing or
+ * not, the ns they took.
+ */
+static uint64_t bench_pass(int parse)
+{
+        static char buf[BENCH_READ_SIZE];
+        struct iovec iov;
+        size_t   sent = 0;
+        uint64_t ns   = 0, t;
+        ssize_t  n;
+        int      left;
+
+        iov.iov_base = buf;
+        iov.iov_len  = sizeof(buf);
+
+        while (sent < cap_len)
+        {
+                n = write(fd[1], cap + sent, cap_len - sent);
+                if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                        return 0;
+                }
+                if (n > 0) {
+                        sent += n;
+                }
+
+                t = bench_ns();
+                do {
+                        if (parse) {
+                                aquasent_input(dev);
+                        } else {
+                                readv(fd[0], &iov, 1);
+                        }
+                } while (ioctl(fd[0], FIONREAD, &left) == 0 && left > 0);
+                ns += bench_ns() - t;
+        }
+
+        return ns;
+}
+
+static uint64_t bench_time(int parse)
+{
+        uint64_t best = 0, ns;
+        size_t   bytes;
+        int      i;
+
+        for (i = 0; i < BENCH_TIMINGS; i++)
+        {
+                for (ns = 0, bytes = 0; bytes < BENCH_BYTES; bytes += cap_len)
+                {
+                        ns += bench_pass(parse);
+                }
+                if (!best || ns < best) {
+                        best = ns;
+                }
+        }
+
+        return best * cap_len / bytes;
+}
+
+int main(int argc, char *argv[])
+{
+        static const char *kernels[] = { "scalar", "auto" };
+        char     text[256];
+        uint64_t read_ns, ns;
+        size_t   i;
+        int      want;
+
+        if (bench_load(argc > 1 ? argv[1] : BENCH_CAPTURE) == -1) {
+                return 1;
+        }
+
+        if (bench_config("aquasent_sim on\nevent_backend epoll\n") == -1 ||
+            pool_init() == -1 || packet_init() == -1 || event_init() == -1 ||
+            hex_init() == -1) {
+                return 1;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == -1 ||
+            fcntl(fd[0], F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(fd[1], F_SETFL, O_NONBLOCK) == -1) {
+                return 1;
+        }
+
+        if (aquasent_create("AM") == -1) {
+                return 1;
+        }
+
+        printf("%zu bytes captured, %d sentences\n", cap_len, sentences);
+
+        read_ns = bench_time(0);
+        printf("read alone       %6.2f ms a capture, %7.1f MB/s\n",
+                read_ns / 1e6, cap_len * 1e3 / read_ns);
+
+        for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        {
+                snprintf(text, sizeof(text), "aquasent_sim on\nhex_kernel %s\n", kernels[i]);
+                if (bench_config(text) == -1 || hex_init() == -1) {
+                        return 1;
+                }
+
+                // once to count the frames, it is all of them every time
+                frames = 0;
+                bench_pass(1);
+                want   = frames;
+                if (!want) {
+                        printf("no frame parsed from the capture.\n");
+                        return 1;
+                }
+
+                ns = bench_time(1);
+                if (frames % want) {
+                        printf("%d frames parsed, not a multiple of %d.\n", frames, want);
+                        return 1;
+                }
+
+                printf("hex %-6s       %6.2f ms a capture, %7.1f MB/s, %5.0f ns a sentence, "
+                        "%d frames, %5.1f MB/s without the reads\n",
+                        kernels[i], ns / 1e6, cap_len * 1e3 / ns,
+                        (double) ns / sentences, want,
+                        ns > read_ns ? cap_len * 1e3 / (ns - read_ns) : 0.0);
+        }
+
+        return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*
+ * bench.h
+ *
+ * Helpers shared by the benchmarks, each one is a program linking the
+ * modules it measures. They run from the top of the tree, make bench.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "config.h"
+
+static inline uint64_t bench_ns()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift, the same numbers every run
+static inline uint32_t bench_rand()
+{
+        static uint32_t x = 2463534242U;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        return x;
+}
+
+/*
+ * the modules read their keys from the config, the benchmarks give
+ * them text in the format of uns.conf instead of the file. it may be
+ * called again to change the keys, the old ones are gone then.
+ */
+static inline int bench_config(const char *text)
+{
+        static char name[] = "/tmp/uns-bench-XXXXXX";
+        static int  loaded;
+        FILE *f;
+        int   fd;
+
+        if (loaded) {
+                config_exit();
+                loaded = 0;
+        }
+
+        strcpy(name, "/tmp/uns-bench-XXXXXX");
+        fd = mkstemp(name);
+        if (fd == -1) {
+                return -1;
+        }
+
+        f = fdopen(fd, "w");
+        if (!f) {
+                close(fd);
+                unlink(name);
+                return -1;
+        }
+
+        fputs(text, f);
+        fclose(f);
+
+        loaded = config_init(name) != NULL;
+        unlink(name);
+
+        return loaded ? 0 : -1;
+}
+
+#endif // _BENCH_H_
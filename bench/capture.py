@@ -0,0 +1,45 @@
+#!/bin/env python3
+#-*- coding: utf-8 -*-
+
+#
+# capture.py
+#
+# Records what the simulated modem of stack A sends to its driver into
+# bench/aquasent.cap, the traffic aquasent_bench replays. A client
+# connects, echoes small messages one at a time, then a few bulk
+# transfers, so it has the $MMOKY and $MMTDN of every frame A sends and
+# the $MMRXD of every frame it gets. With sim_seed and no losses the
+# sentences are the same every run, the data in them is not.
+#
+
+import os
+import shutil
+
+from stack import Stacks, echo
+
+PINGS = 20
+PING  = 16
+BULK  = 16 * 1024
+BULKS = 4
+
+CAP = os.path.join(os.path.dirname(os.path.abspath(__file__)), "aquasent.cap")
+
+CONF = {
+    "sim_rate":       1000000,
+    "sim_delay":      0,
+    "sim_seed":       1,
+    "sim_capture_AM": "aquasent.cap",
+}
+
+
+if __name__ == "__main__":
+    with Stacks(CONF) as s:
+        c = s.connect(30)
+        good = all(echo(c, os.urandom(PING)) for i in range(PINGS))
+        good = all(echo(c, os.urandom(BULK)) for i in range(BULKS)) and good
+        c.close()
+        # A and B both capture, the file of B is the same traffic
+        shutil.copy(os.path.join(s.dir, "A", "aquasent.cap"), CAP)
+
+    print("%d bytes captured in %s" % (os.path.getsize(CAP), CAP))
+    exit(0 if good else 1)
@@ -0,0 +1,335 @@
+/*
+ * event_bench.c
+ *
+ * The cost of dispatching one ready connection with more and more
+ * idle ones. Every connection is a socketpair with a read event on
+ * one end, a round writes a byte to the other end of one of them and
+ * runs event_wait() until its callback read it. The event is found by
+ * its fd and its owner is in it, so a round should cost the same with
+ * 16 connections and with 4096, for the backends that do not scan the
+ * fds either, select does.
+ *
+ * Then the bytes a second one io event moves through event_read and
+ * event_write, in segments of 1 KB like a client. The io_uring
+ * backend copies them out of its provided buffers and into its
+ * staging buffer, the time memcpy takes for the same bytes is shown
+ * next to it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "bench.h"
+#include "event.h"
+#include "pool.h"
+
+#define BENCH_ROUNDS            20000
+#define BENCH_MAX_CONNECTIONS   4096
+
+// a stream of 64 MB, read and written 8 segments of 1 KB a call
+#define BENCH_STREAM_BYTES      (64 << 20)
+#define BENCH_STREAM_CHUNK      65536
+#define BENCH_SEGMENTS          8
+#define BENCH_SEGMENT_SIZE      1024
+
+extern event_backend_t select_backend;
+extern event_backend_t epoll_backend;
+extern event_backend_t uring_backend;
+
+static event_backend_t *backends[] = {
+        &select_backend,
+        &epoll_backend,
+        &uring_backend,
+};
+
+typedef struct bench_conn_s bench_conn_t;
+struct bench_conn_s {
+        int fd[2];
+};
+
+static bench_conn_t conns[BENCH_MAX_CONNECTIONS];
+static int count;
+static int got;
+
+static struct iovec segs[BENCH_SEGMENTS];
+static char   seg_mem[BENCH_SEGMENTS * BENCH_SEGMENT_SIZE];
+static char   chunk[BENCH_STREAM_CHUNK];
+static size_t moved;
+
+static int bench_input(event_t *ev)
+{
+        char buf[64];
+
+        if (read(ev->fd, buf, sizeof(buf)) > 0) {
+                got++;
+        }
+
+        return 0;
+}
+
+static int bench_add(bench_conn_t *c)
+{
+        event_t *ev;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, c->fd) == -1) {
+                return -1;
+        }
+
+        if (!event_create(ev)) {
+                close(c->fd[0]);
+                close(c->fd[1]);
+                return -1;
+        }
+
+        ev->fd     = c->fd[0];
+        ev->input  = bench_input;
+        ev->output = NULL;
+        ev->data   = c;
+        ev->flag   = 0;
+
+        set_event_active(ev);
+        set_event_read(ev);
+
+        if (event_add(ev) == -1) {
+                event_free(ev);
+                close(c->fd[0]);
+                close(c->fd[1]);
+                return -1;
+        }
+
+        return 0;
+}
+
+static void bench_run(event_backend_t *b)
+{
+        bench_conn_t *c;
+        uint64_t t;
+        int i, n;
+
+        if (event_init() == -1) {
+                printf("%-8s can not start.\n", b->name);
+                return;
+        }
+
+        for (n = 0; n < count; n++)
+        {
+                if (bench_add(&conns[n]) == -1) {
+                        break;
+                }
+        }
+
+        if (n < count) {
+                printf("%-8s %4d connections, can not watch more than %d.\n",
+                        b->name, count, n);
+                goto out;
+        }
+
+        got = 0;
+
+        t = bench_ns();
+        for (i = 0; i < BENCH_ROUNDS; i++)
+        {
+                c = &conns[bench_rand() % count];
+
+                while (write(c->fd[1], "x", 1) == -1 && errno == EINTR)
+                        ;
+
+                while (got == i)
+                {
+                        event_wait();
+                }
+        }
+        t = bench_ns() - t;
+
+        printf("%-8s %4d connections, %5.0f ns a round\n",
+                b->name, count, (double) t / BENCH_ROUNDS);
+
+out:
+        event_exit();
+
+        for (i = 0; i < n; i++)
+        {
+                close(conns[i].fd[0]);
+                close(conns[i].fd[1]);
+        }
+}
+
+static int bench_stream_input(event_t *ev)
+{
+        ssize_t n = event_read(ev, segs, BENCH_SEGMENTS);
+
+        if (n > 0) {
+                moved += n;
+        }
+
+        return 0;
+}
+
+static int bench_stream_output(event_t *ev)
+{
+        ssize_t n = event_write(ev, segs, BENCH_SEGMENTS);
+
+        if (n > 0) {
+                moved += n;
+        }
+
+        if (moved >= BENCH_STREAM_BYTES) {
+                unset_event_write(ev);
+        }
+
+        return 0;
+}
+
+/*
+ * the other end of the socketpair is written or read directly, as
+ * much as it takes between two rounds.
+ */
+static void bench_stream(event_backend_t *b, int out)
+{
+        bench_conn_t c;
+        event_t *ev;
+        uint64_t t;
+        size_t   left = BENCH_STREAM_BYTES;
+        ssize_t  n;
+
+        if (event_init() == -1) {
+                printf("%-8s can not start.\n", b->name);
+                return;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, c.fd) == -1 ||
+            fcntl(c.fd[1], F_SETFL, O_NONBLOCK) == -1 || !event_create(ev)) {
+                printf("%-8s can not make a stream.\n", b->name);
+                goto out;
+        }
+
+        ev->fd     = c.fd[0];
+        ev->input  = bench_stream_input;
+        ev->output = bench_stream_output;
+        ev->data   = &c;
+        ev->flag   = 0;
+
+        set_event_active(ev);
+        set_event_io(ev);
+        if (out) {
+                set_event_write(ev);
+        } else {
+                set_event_read(ev);
+        }
+
+        if (event_add(ev) == -1) {
+                event_free(ev);
+                printf("%-8s can not watch a stream.\n", b->name);
+                goto out;
+        }
+
+        moved = 0;
+
+        t = bench_ns();
+        while (left > 0)
+        {
+                if (out) {
+                        n = read(c.fd[1], chunk, sizeof(chunk));
+                } else {
+                        n = write(c.fd[1], chunk, left < sizeof(chunk) ? left : sizeof(chunk));
+                }
+                if (n > 0) {
+                        left -= n;
+                }
+
+                // the last bytes written may still be staged
+                if (!out || moved < BENCH_STREAM_BYTES || n <= 0) {
+                        event_wait();
+                }
+        }
+
+        // the reads of the last bytes
+        while (!out && moved < BENCH_STREAM_BYTES)
+        {
+                event_wait();
+        }
+        t = bench_ns() - t;
+
+        printf("%-8s %-5s %6.0f MB/s\n", b->name, out ? "write" : "read",
+                (double) BENCH_STREAM_BYTES / t * 1000);
+
+out:
+        event_exit();
+
+        close(c.fd[0]);
+        close(c.fd[1]);
+}
+
+/*
+ * what the io_uring backend adds to a stream, one memcpy of every
+ * byte, from a buffer of its own into the segments.
+ */
+static void bench_copy()
+{
+        static char from[4096];
+        uint64_t t;
+        size_t   done;
+        int      i;
+
+        t = bench_ns();
+        for (done = 0; done < BENCH_STREAM_BYTES; )
+        {
+                for (i = 0; i < BENCH_SEGMENTS; i++)
+                {
+                        memcpy(segs[i].iov_base, from + done % 4096 / 1024 * 1024,
+                               BENCH_SEGMENT_SIZE);
+                        done += BENCH_SEGMENT_SIZE;
+                }
+                __asm__ __volatile__("" : : "r" (seg_mem) : "memory");
+        }
+        t = bench_ns() - t;
+
+        printf("memcpy   alone %6.0f MB/s\n", (double) BENCH_STREAM_BYTES / t * 1000);
+}
+
+int main(int argc, char *argv[])
+{
+        char   text[128];
+        size_t i;
+
+        if (bench_config("max_connections 4096\n") == -1 || pool_init() == -1) {
+                return 1;
+        }
+
+        for (i = 0; i < BENCH_SEGMENTS; i++)
+        {
+                segs[i].iov_base = seg_mem + i * BENCH_SEGMENT_SIZE;
+                segs[i].iov_len  = BENCH_SEGMENT_SIZE;
+        }
+
+        for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+        {
+                // the kernel may not have it
+                if (backends[i]->init() == -1) {
+                        printf("%-8s not supported here.\n", backends[i]->name);
+                        continue;
+                }
+                backends[i]->exit();
+
+                snprintf(text, sizeof(text), "max_connections 4096\n"
+                        "event_backend %s\nevent_edge_trigger off\n",
+                        backends[i]->name);
+
+                if (bench_config(text) == -1) {
+                        return 1;
+                }
+
+                for (count = 16; count <= BENCH_MAX_CONNECTIONS; count *= 4)
+                {
+                        bench_run(backends[i]);
+                }
+
+                bench_stream(backends[i], 0);
+                bench_stream(backends[i], 1);
+        }
+
+        bench_copy();
+
+        return 0;
+}
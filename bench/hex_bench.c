@@ -0,0 +1,243 @@
+/*
+ * hex_bench.c
+ *
+ * The hex kernels against each other. hex_bench check runs every
+ * kernel the CPU has against the scalar one, on random lengths up to
+ * twice the modem MTU at random alignments, valid digits of both cases
+ * and a bad one somewhere. hex_bench times them on frames up to the
+ * MTU, in bytes of frame a cycle.
+ *
+ * The kernels are static in hex.c, it is built in here.
+ */
+
+#include "bench.h"
+#include "hex.c"
+
+// aquasent_mtu by default
+#define BENCH_MTU               1024
+#define BENCH_ROUNDS            20000
+#define BENCH_ALIGN             64
+#define BENCH_GUARD             0x5a
+
+// bytes of frame a timing, the best of some timings counts
+#define BENCH_BYTES             (1 << 22)
+#define BENCH_TIMINGS           5
+
+static unsigned char src[BENCH_MTU * 2 + BENCH_ALIGN];
+static unsigned char dst[BENCH_MTU * 2 + BENCH_ALIGN];
+static unsigned char ref[BENCH_MTU * 2 + BENCH_ALIGN];
+static char          hex[BENCH_MTU * 4 + BENCH_ALIGN * 2];
+static char          want[BENCH_MTU * 4 + BENCH_ALIGN * 2];
+
+// what a digit is not, around the ranges of the digits
+static const char not_hex[] = "/:@G`g \r\n$,*\x7f\x80\xb0\xc6\xff";
+
+static uint64_t bench_cycles()
+{
+#ifdef HEX_X86
+        return __rdtsc();
+#else
+        return bench_ns();
+#endif
+}
+
+static int check_encode(const hex_kernel_t *k, size_t len, size_t a, size_t b)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++)
+        {
+                src[a + i] = bench_rand();
+        }
+
+        hex_encode_scalar(want, src + a, len);
+
+        memset(hex, BENCH_GUARD, sizeof(hex));
+        k->encode(hex + b, src + a, len);
+
+        if (memcmp(hex + b, want, len * 2)) {
+                printf("%s encode of %zu bytes at %zu differs.\n", k->name, len, a);
+                return -1;
+        }
+
+        if ((b && hex[b - 1] != BENCH_GUARD) || hex[b + len * 2] != BENCH_GUARD) {
+                printf("%s encode of %zu bytes at %zu writes out of its digits.\n",
+                        k->name, len, a);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int check_decode(const hex_kernel_t *k, size_t len, size_t a, size_t b)
+{
+        size_t i;
+        int    r;
+
+        // digits of both cases
+        for (i = 0; i < len * 2; i++)
+        {
+                hex[a + i] = hex_digits[bench_rand() & 0x0f];
+                if (hex[a + i] > '9' && bench_rand() & 1) {
+                        hex[a + i] += 'a' - 'A';
+                }
+        }
+
+        r = hex_decode_scalar(ref, hex + a, len * 2);
+
+        memset(dst, BENCH_GUARD, sizeof(dst));
+        if (k->decode(dst + b, hex + a, len * 2) != r || r == -1) {
+                printf("%s decode of %zu digits at %zu fails.\n", k->name, len * 2, a);
+                return -1;
+        }
+
+        if (memcmp(dst + b, ref, len)) {
+                printf("%s decode of %zu digits at %zu differs.\n", k->name, len * 2, a);
+                return -1;
+        }
+
+        if ((b && dst[b - 1] != BENCH_GUARD) || dst[b + len] != BENCH_GUARD) {
+                printf("%s decode of %zu digits at %zu writes out of its bytes.\n",
+                        k->name, len * 2, a);
+                return -1;
+        }
+
+        if (!len) {
+                return 0;
+        }
+
+        // one bad digit anywhere must fail it
+        i = bench_rand() % (len * 2);
+        hex[a + i] = not_hex[bench_rand() % (sizeof(not_hex) - 1)];
+
+        if (k->decode(dst + b, hex + a, len * 2) != -1) {
+                printf("%s decode takes 0x%02x at %zu of %zu digits.\n",
+                        k->name, (unsigned char) hex[a + i], i, len * 2);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int check()
+{
+        const hex_kernel_t *k;
+        size_t len, a, b;
+        int    i;
+
+        for (k = hex_kernels; k->encode != hex_encode_scalar; k++)
+        {
+                if (!k->supported()) {
+                        printf("%-6s not supported here.\n", k->name);
+                        continue;
+                }
+
+                for (i = 0; i < BENCH_ROUNDS; i++)
+                {
+                        len = bench_rand() % (BENCH_MTU * 2 + 1);
+                        a   = bench_rand() % BENCH_ALIGN;
+                        b   = bench_rand() % BENCH_ALIGN;
+
+                        if (check_encode(k, len, a, b) == -1 ||
+                            check_decode(k, len, a, b) == -1) {
+                                return -1;
+                        }
+                }
+
+                printf("%-6s agrees with scalar on %d encodes and decodes.\n",
+                        k->name, BENCH_ROUNDS);
+        }
+
+        return 0;
+}
+
+static uint64_t bench_encode(const hex_kernel_t *k, size_t len)
+{
+        uint64_t t, best = UINT64_MAX;
+        int      i, j;
+
+        for (j = 0; j < BENCH_TIMINGS; j++)
+        {
+                t = bench_cycles();
+                for (i = 0; i < (int) (BENCH_BYTES / len); i++)
+                {
+                        k->encode(hex, src, len);
+                        __asm__ volatile ("" : : "r" (hex) : "memory");
+                }
+                t = bench_cycles() - t;
+
+                if (t < best) {
+                        best = t;
+                }
+        }
+
+        return best;
+}
+
+static uint64_t bench_decode(const hex_kernel_t *k, size_t len)
+{
+        uint64_t t, best = UINT64_MAX;
+        int      i, j;
+
+        hex_encode_scalar(hex, src, len);
+
+        for (j = 0; j < BENCH_TIMINGS; j++)
+        {
+                t = bench_cycles();
+                for (i = 0; i < (int) (BENCH_BYTES / len); i++)
+                {
+                        k->decode(dst, hex, len * 2);
+                        __asm__ volatile ("" : : "r" (dst) : "memory");
+                }
+                t = bench_cycles() - t;
+
+                if (t < best) {
+                        best = t;
+                }
+        }
+
+        return best;
+}
+
+static void bench()
+{
+        const hex_kernel_t *k;
+        size_t len;
+        int    i;
+
+        for (i = 0; i < (int) sizeof(src); i++)
+        {
+                src[i] = bench_rand();
+        }
+
+        for (k = hex_kernels; k < hex_kernels + HEX_KERNELS; k++)
+        {
+                if (!k->supported()) {
+                        continue;
+                }
+
+                for (len = 16; len <= BENCH_MTU; len *= 4)
+                {
+                        printf("%-6s %4zu bytes, encode %5.2f, decode %5.2f bytes a %s\n",
+                                k->name, len,
+                                (double) BENCH_BYTES / bench_encode(k, len),
+                                (double) BENCH_BYTES / bench_decode(k, len),
+#ifdef HEX_X86
+                                "cycle");
+#else
+                                "ns");
+#endif
+                }
+        }
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc > 1 && !strcmp(argv[1], "check")) {
+                return check() == -1;
+        }
+
+        bench();
+
+        return 0;
+}
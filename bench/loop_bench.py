@@ -0,0 +1,60 @@
+#!/bin/env python3
+#-*- coding: utf-8 -*-
+
+#
+# loop_bench.py
+#
+# Aggregate client throughput of stack A with 1 to 16 loops for the
+# client connections, worker_threads 0 to 16. 64 clients echo 128 KB
+# each at once, through simulated modems fast enough that the clients
+# and the loops are what is measured. The modems are on the main loop
+# of each stack whatever the workers, it stays one core.
+#
+
+import os
+import threading
+import time
+
+from stack import Stacks, echo
+
+CLIENTS = 64
+BYTES   = 128 * 1024
+
+CONF = {
+    "sim_rate":  100000000,
+    "sim_delay": 0,
+}
+
+
+def run(workers):
+    conf = dict(CONF, worker_threads=workers)
+    ok   = []
+
+    with Stacks(conf) as s:
+        conns = [s.connect() for i in range(CLIENTS)]
+        data  = [os.urandom(BYTES) for i in range(CLIENTS)]
+
+        def client(i):
+            if echo(conns[i], data[i]):
+                ok.append(i)
+            conns[i].close()
+
+        ths = [threading.Thread(target=client, args=(i,)) for i in range(CLIENTS)]
+        t = time.time()
+        for th in ths:
+            th.start()
+        for th in ths:
+            th.join()
+        t = time.time() - t
+
+    print("%2d loops, %d/%d clients whole, %7.0f KB/s each way" %
+          (max(workers, 1), len(ok), CLIENTS, len(ok) * BYTES / t / 1024))
+    return len(ok) == CLIENTS
+
+
+if __name__ == "__main__":
+    print("%d cores here" % os.cpu_count())
+    good = True
+    for workers in (0, 2, 4, 8, 16):
+        good = run(workers) and good
+    exit(0 if good else 1)
@@ -0,0 +1,154 @@
+/*
+ * pool_bench.c
+ *
+ * The cost of an alloc and a free from a pool with more and more
+ * threads using it at once. Every thread takes a burst of objects
+ * and gives them back, like a loop reading a client into a packet
+ * chain. Then one thread allocs and another frees, like a loop
+ * handing packets to the device thread.
+ */
+
+#include <pthread.h>
+#include "bench.h"
+#include "pool.h"
+
+// sched.h of the tree hides the one of the system
+int sched_yield(void);
+
+#define BENCH_OBJECTS           8192
+#define BENCH_OBJECT_SIZE       256
+#define BENCH_BURST             16
+#define BENCH_ROUNDS            200000
+#define BENCH_MAX_THREADS       8
+
+// the handoff ring, one producer and one consumer
+#define BENCH_RING              1024
+#define BENCH_HANDOFF           2000000
+
+static void *ring[BENCH_RING];
+static unsigned int ring_head;
+static unsigned int ring_tail;
+
+static void *bench_burst(void *arg)
+{
+        void *obj[BENCH_BURST];
+        int   i, j, n;
+
+        for (i = 0; i < BENCH_ROUNDS; i++)
+        {
+                for (n = 0; n < BENCH_BURST; n++)
+                {
+                        obj[n] = pool_alloc(POOL_PACKET);
+                        if (!obj[n]) {
+                                break;
+                        }
+                }
+
+                for (j = 0; j < n; j++)
+                {
+                        pool_free(POOL_PACKET, obj[j]);
+                }
+        }
+
+        pool_thread_exit();
+
+        return NULL;
+}
+
+static void *bench_produce(void *arg)
+{
+        unsigned int tail;
+        void *obj;
+        int   i;
+
+        for (i = 0; i < BENCH_HANDOFF; i++)
+        {
+                while (!(obj = pool_alloc(POOL_PACKET)))
+                        ;
+
+                tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+                while (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == BENCH_RING)
+                {
+                        sched_yield();
+                }
+
+                ring[tail % BENCH_RING] = obj;
+                __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        pool_thread_exit();
+
+        return NULL;
+}
+
+static void *bench_consume(void *arg)
+{
+        unsigned int head;
+        int i;
+
+        for (i = 0; i < BENCH_HANDOFF; i++)
+        {
+                head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+                while (head == __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE))
+                {
+                        sched_yield();
+                }
+
+                pool_free(POOL_PACKET, ring[head % BENCH_RING]);
+                __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        pool_thread_exit();
+
+        return NULL;
+}
+
+static void bench_report(char *name, int threads, uint64_t t, uint64_t ops)
+{
+        pool_stat_t st;
+
+        pool_stat(POOL_PACKET, &st);
+
+        printf("%-8s %d threads, %5.1f ns an alloc and free, %u used after, %lu failed\n",
+                name, threads, (double) t / ops, st.used, st.fail);
+}
+
+int main(int argc, char *argv[])
+{
+        pthread_t tid[BENCH_MAX_THREADS];
+        uint64_t  t;
+        int       n, i;
+
+        if (pool_create(POOL_PACKET, "packet", BENCH_OBJECT_SIZE, BENCH_OBJECTS) == -1) {
+                return 1;
+        }
+
+        printf("%ld cores here\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+        for (n = 1; n <= BENCH_MAX_THREADS; n *= 2)
+        {
+                t = bench_ns();
+                for (i = 0; i < n; i++)
+                {
+                        pthread_create(&tid[i], NULL, bench_burst, NULL);
+                }
+                for (i = 0; i < n; i++)
+                {
+                        pthread_join(tid[i], NULL);
+                }
+                t = bench_ns() - t;
+
+                bench_report("burst", n, t, (uint64_t) n * BENCH_ROUNDS * BENCH_BURST);
+        }
+
+        t = bench_ns();
+        pthread_create(&tid[0], NULL, bench_produce, NULL);
+        pthread_create(&tid[1], NULL, bench_consume, NULL);
+        pthread_join(tid[0], NULL);
+        pthread_join(tid[1], NULL);
+        t = bench_ns() - t;
+
+        bench_report("handoff", 2, t, BENCH_HANDOFF);
+
+        return 0;
+}
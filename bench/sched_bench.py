@@ -0,0 +1,105 @@
+#!/bin/env python3
+#-*- coding: utf-8 -*-
+
+#
+# sched_bench.py
+#
+# Interactive latency while a bulk transfer saturates the link. One
+# client keeps the link full both ways, another echoes 16 bytes every
+# 200 ms, like keystrokes over ssh. It runs on an idle link first,
+# then with one round of the scheduler as large as the backlog, close
+# to the single queue there was, then with deficit round-robin, then
+# with the small packets going first too.
+#
+
+import os
+import threading
+import time
+
+from stack import Stacks, echo, percentile
+
+PINGS = 25
+PING  = 16
+GAP   = 0.2
+CHUNK = 4096
+
+CONF = {
+    "sim_rate":            128000,
+    "sim_delay":           50,
+    "device_backlog_high": 16384,
+    "device_backlog_low":  4096,
+}
+
+RUNS = (
+    ("idle link",    False, {}),
+    ("one queue",    True,  {"sched_quantum": 1048576, "sched_priority": "off"}),
+    ("round-robin",  True,  {"sched_quantum": 512,     "sched_priority": "off"}),
+    ("and priority", True,  {"sched_quantum": 512,     "sched_priority": "on"}),
+)
+
+
+def bulk(c, stop, moved):
+    """send until stopped, and read back what comes"""
+
+    def reader():
+        try:
+            while True:
+                d = c.recv(65536)
+                if not d:
+                    break
+                moved[0] += len(d)
+        except OSError:
+            pass
+
+    r = threading.Thread(target=reader, daemon=True)
+    r.start()
+    data = os.urandom(CHUNK)
+    try:
+        while not stop.is_set():
+            c.sendall(data)
+    except OSError:
+        pass
+
+
+def run(name, loaded, conf):
+    rtt   = []
+    moved = [0]
+    stop  = threading.Event()
+
+    with Stacks(dict(CONF, **conf)) as s:
+        c = s.connect(30)
+
+        if loaded:
+            b = s.connect(5)
+            b.settimeout(1)
+            threading.Thread(target=bulk, args=(b, stop, moved), daemon=True).start()
+            # the backlog fills first
+            time.sleep(3)
+
+        t0 = time.time()
+        moved[0] = 0
+        for i in range(PINGS):
+            t = time.time()
+            if not echo(c, os.urandom(PING)):
+                break
+            rtt.append(time.time() - t)
+            time.sleep(GAP)
+        t0 = time.time() - t0
+
+        stop.set()
+        c.close()
+
+    print("%-12s %2d/%d echoes, p50 %5.0f ms, p95 %5.0f ms, max %5.0f ms, "
+          "bulk %5.0f B/s" %
+          (name, len(rtt), PINGS, percentile(rtt, 0.5) * 1000,
+           percentile(rtt, 0.95) * 1000, max(rtt or [0]) * 1000, moved[0] / t0))
+    return len(rtt) == PINGS
+
+
+if __name__ == "__main__":
+    print("%d bit/s, %d ms delay, %d bytes of device backlog" %
+          (CONF["sim_rate"], CONF["sim_delay"], CONF["device_backlog_high"]))
+    good = True
+    for name, loaded, conf in RUNS:
+        good = run(name, loaded, conf) and good
+    exit(0 if good else 1)
@@ -0,0 +1,88 @@
+#!/bin/env python3
+#-*- coding: utf-8 -*-
+
+#
+# sim_bench.py
+#
+# SOCKS latency and throughput over simulated modems, the same every
+# run for sim_seed. On a clean channel a client connects, echoes small
+# messages one at a time, then one bulk transfer. On a lossy channel
+# every small echo takes a connection of its own, a lost frame is not
+# sent again and breaks its connection, the others go on.
+#
+
+import os
+import time
+
+from stack import Stacks, echo, percentile
+
+PINGS = 20
+PING  = 16
+BULK  = 32 * 1024
+
+CONF = {
+    "sim_rate":     19200,
+    "sim_delay":    100,
+    "sim_preamble": 50,
+    "sim_seed":     1,
+}
+
+LOSSY = {
+    "sim_loss": 0.02,
+    "sim_ber":  0.00001,
+}
+
+
+def clean():
+    with Stacks(CONF) as s:
+        t = time.time()
+        c = s.connect(60)
+        connect = time.time() - t
+
+        rtt = []
+        for i in range(PINGS):
+            t = time.time()
+            if not echo(c, os.urandom(PING)):
+                break
+            rtt.append(time.time() - t)
+
+        data = os.urandom(BULK)
+        t = time.time()
+        whole = echo(c, data)
+        t = time.time() - t
+        c.close()
+
+    print("clean: connect %4.0f ms, %2d/%d echoes of %d bytes, p50 %4.0f ms, "
+          "p95 %4.0f ms, %d KB %s in %4.1f s, %4.0f B/s each way" %
+          (connect * 1000, len(rtt), PINGS, PING,
+           percentile(rtt, 0.5) * 1000, percentile(rtt, 0.95) * 1000,
+           BULK // 1024, "whole" if whole else "broken", t, BULK / t))
+    return whole and len(rtt) == PINGS
+
+
+def lossy():
+    rtt = []
+    with Stacks(dict(CONF, **LOSSY)) as s:
+        for i in range(PINGS):
+            t = time.time()
+            try:
+                c = s.connect(5)
+            except OSError:
+                continue
+            if echo(c, os.urandom(PING)):
+                rtt.append(time.time() - t)
+            c.close()
+
+    print("lossy: loss %g, ber %g, %2d/%d connect and echo whole, p50 %4.0f ms, "
+          "p95 %4.0f ms" %
+          (LOSSY["sim_loss"], LOSSY["sim_ber"], len(rtt), PINGS,
+           percentile(rtt, 0.5) * 1000, percentile(rtt, 0.95) * 1000))
+    return True
+
+
+if __name__ == "__main__":
+    print("%d bit/s, %d ms delay, %d ms preamble" %
+          (CONF["sim_rate"], CONF["sim_delay"], CONF["sim_preamble"]))
+    good = clean()
+    good = lossy() and good
+    exit(0 if good else 1)
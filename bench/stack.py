@@ -0,0 +1,172 @@
+#!/bin/env python3
+#-*- coding: utf-8 -*-
+
+#
+# stack.py
+#
+# Two stacks talking over simulated modems on this host, for the
+# benchmarks of the whole path. Stack A takes SOCKS clients, stack B
+# connects to an echo server, so what a client sends comes back to
+# it over the link twice.
+#
+
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+
+TEST = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "test")
+
+# every run takes new ports, a stack still closing keeps its own
+_port = 40000 + os.getpid() % 1000 * 20
+
+
+def _ports(n):
+    global _port
+    _port += n
+    return range(_port - n, _port)
+
+
+class Echo(object):
+    """a server sending back all it reads, on a thread per client"""
+
+    def __init__(self):
+        self.sock = socket.socket()
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.listen(256)
+        self.port = self.sock.getsockname()[1]
+        threading.Thread(target=self._accept, daemon=True).start()
+
+    def _accept(self):
+        while True:
+            try:
+                c, _ = self.sock.accept()
+            except OSError:
+                return
+            c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self._echo, args=(c,), daemon=True).start()
+
+    def _echo(self, c):
+        try:
+            while True:
+                d = c.recv(65536)
+                if not d:
+                    break
+                c.sendall(d)
+        except OSError:
+            pass
+        c.close()
+
+    def close(self):
+        self.sock.close()
+
+
+class Stacks(object):
+    """stack A and B, conf is the keys of uns.conf both of them get"""
+
+    def __init__(self, conf):
+        socks, a, b = _ports(3)
+        self.port  = socks
+        self.dir   = tempfile.mkdtemp(prefix="uns-bench-")
+        self.procs = []
+        self.echo  = Echo()
+
+        for name, bind, peer, port in (("A", a, b, socks), ("B", b, a, socks + 1000)):
+            d = os.path.join(self.dir, name)
+            os.makedirs(d)
+            keys = {
+                "socks_port":    port,
+                "socks_device":  "AM",
+                "aquasent_sim":  "on",
+                "sim_bind":      "127.0.0.1:%d" % bind,
+                "sim_peer":      "127.0.0.1:%d" % peer,
+            }
+            keys.update(conf)
+            with open(os.path.join(d, "uns.conf"), "w") as f:
+                for k, v in keys.items():
+                    f.write("%s %s\n" % (k, v))
+            self.procs.append(subprocess.Popen([TEST], cwd=d,
+                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+
+        # wait for A to listen
+        for i in range(50):
+            try:
+                socket.create_connection(("127.0.0.1", self.port), 0.1).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+
+    def connect(self, timeout=60):
+        """a SOCKS connection through A and B to the echo server"""
+        c = socket.create_connection(("127.0.0.1", self.port))
+        c.settimeout(timeout)
+        c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        c.sendall(b"\x05\x01\x00")
+        if _recv(c, 2) != b"\x05\x00":
+            raise IOError("SOCKS greeting refused")
+        c.sendall(b"\x05\x01\x00\x01" + socket.inet_aton("127.0.0.1") +
+                  struct.pack(">H", self.echo.port))
+        r = _recv(c, 10)
+        if r[1] != 0:
+            raise IOError("SOCKS connect failed, reply %d" % r[1])
+        return c
+
+    def log(self, name):
+        with open(os.path.join(self.dir, name, "uns.log")) as f:
+            return f.read()
+
+    def close(self):
+        for p in self.procs:
+            p.terminate()
+        for p in self.procs:
+            try:
+                p.wait(10)
+            except subprocess.TimeoutExpired:
+                p.kill()
+                p.wait()
+        self.echo.close()
+        shutil.rmtree(self.dir, ignore_errors=True)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+def _recv(c, n):
+    r = b""
+    while len(r) < n:
+        d = c.recv(n - len(r))
+        if not d:
+            raise IOError("connection closed")
+        r += d
+    return r
+
+
+def echo(c, data):
+    """send data and read it back, False if it does not come back whole
+    before the timeout of c"""
+    t = threading.Thread(target=c.sendall, args=(data,), daemon=True)
+    t.start()
+    got = bytearray()
+    try:
+        while len(got) < len(data):
+            d = c.recv(65536)
+            if not d:
+                break
+            got += d
+    except OSError:
+        pass
+    t.join()
+    return bytes(got) == data
+
+
+def percentile(v, p):
+    v = sorted(v)
+    return v[min(len(v) - 1, int(len(v) * p))] if v else 0
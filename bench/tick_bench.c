@@ -0,0 +1,98 @@
+/*
+ * tick_bench.c
+ *
+ * The cost of the timing wheel per tick with more and more timers
+ * armed. The timers are spread over count / 10 ms and armed again
+ * that long by their callback, so 10 of them fire every ms whatever
+ * the count. A tick, one tick_process() every ms, should cost the
+ * same for 1k timers and for 100k, and adding or deleting one as well.
+ */
+
+#include "bench.h"
+#include "tick.h"
+
+#define BENCH_FIRE_PER_MS       10
+#define BENCH_RUN_MS            2000
+
+static int spread;
+static int fired;
+
+static int bench_timeout(tick_t *tc)
+{
+        fired++;
+
+        return tick_add(tc, spread);
+}
+
+static int bench_run(int count)
+{
+        struct timespec ms = { 0, 1000000 };
+        tick_t  *tc;
+        uint64_t t, c, cost = 0, worst = 0, add, del;
+        int i, ticks = 0;
+
+        tc = (tick_t*) calloc(count, sizeof(tick_t));
+        if (!tc) {
+                return -1;
+        }
+
+        tick_init();
+
+        spread = count / BENCH_FIRE_PER_MS;
+        fired  = 0;
+
+        t = bench_ns();
+        for (i = 0; i < count; i++)
+        {
+                tick_init_timer(&tc[i], bench_timeout, NULL);
+                tick_add(&tc[i], 1 + bench_rand() % spread);
+        }
+        add = bench_ns() - t;
+
+        for (t = tick_now() + BENCH_RUN_MS; tick_now() < t; ticks++)
+        {
+                nanosleep(&ms, NULL);
+
+                c = bench_ns();
+                tick_process();
+                c = bench_ns() - c;
+
+                cost += c;
+                if (c > worst) {
+                        worst = c;
+                }
+        }
+
+        t = bench_ns();
+        for (i = 0; i < count; i++)
+        {
+                tick_delete(&tc[i]);
+        }
+        del = bench_ns() - t;
+
+        printf("%6d timers, %4d ticks, %4.1f fired a tick, %5.0f ns a tick, "
+               "%3.0f ns a timer fired, at most %6.0f ns, add %3.0f ns, "
+               "delete %3.0f ns\n",
+               count, ticks, (double) fired / ticks, (double) cost / ticks,
+               fired ? (double) cost / fired : 0.0, (double) worst,
+               (double) add / count, (double) del / count);
+
+        tick_exit();
+        free(tc);
+
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        int count;
+
+        for (count = 1000; count <= 100000; count *= 10)
+        {
+                if (bench_run(count) == -1) {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
@@ -0,0 +1,483 @@
+/*
+ * bond.c
+ *
+ * A virtual device made of several modems. Packets sent to it wait in
+ * its scheduler, a member with room takes the next frame, and if several
+ * have room, the one expected to finish it first by its queued bytes
+ * and measured throughput. The members carry traffic in proportion to
+ * their speed, and never hold more than a few frames each, so a slow
+ * one does not fall far behind the others.
+ *
+ * A frame gets a sequence number in front, the frames of all the
+ * members are put back in order before going up as frames of the
+ * bond. A missing frame is waited for until the reorder timeout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "config.h"
+#include "device.h"
+#include "log.h"
+#include "packet.h"
+#include "tick.h"
+
+#define BOND_CONFIG_DEVICES     "bond_devices"
+#define BOND_CONFIG_NAME        "bond_name"
+#define BOND_DEFAULT_NAME       "BD"
+#define BOND_CONFIG_TIMEOUT     "bond_reorder_timeout"
+#define BOND_DEFAULT_TIMEOUT    1000
+
+#define BOND_MAX_MEMBERS        8
+
+// frames waiting for a missing one, a power of 2
+#define BOND_WINDOW             64
+#define BOND_WINDOW_MASK        (BOND_WINDOW - 1)
+
+// a member not measured yet, bytes per second
+#define BOND_DEFAULT_RATE       100
+
+#define BOND_HEADER_LENGTH      (sizeof(bond_hdr_t))
+
+#define BOND_ERROR(s) log_error("BOND", (s))
+#define BOND_WARN(s)  log_warn ("BOND", (s))
+#define BOND_INFO(s)  log_info ("BOND", (s))
+#define BOND_DEBUG(s) log_debug("BOND", (s))
+
+typedef struct bond_hdr_s bond_hdr_t;
+struct bond_hdr_s {
+        uint16_t seq;           // network byte order
+};
+
+typedef struct device_bond_s device_bond_t;
+struct device_bond_s {
+        device_t *dev;
+
+        device_t *members[BOND_MAX_MEMBERS];
+        int       nmembers;
+
+        // sequence of the next frame sent
+        uint16_t tx_seq;
+
+        // sequence of the next frame going up, and the frames
+        // received after it. both sides start from 0.
+        uint16_t  rx_next;
+        int       rx_count;
+        packet_t *rx_window[BOND_WINDOW];
+
+        // waiting for a missing frame
+        tick_t *timer;
+        int     timeout;
+};
+
+int bond_init();
+int bond_exit(device_t *d);
+static int bond_output(packet_t *pkg);
+static int bond_pull(device_t *d);
+static int bond_receive(packet_t *pkg);
+static int bond_timeout(tick_t *tc);
+static device_t *bond_pick(device_bond_t *b, int len);
+static void bond_size(device_bond_t *b);
+static packet_t *bond_number(device_bond_t *b, packet_t *pkg);
+static void bond_release(device_bond_t *b);
+static void bond_skip(device_bond_t *b);
+
+/*
+ * make the bond of the devices in bond_devices, a list of names
+ * separated by commas. nothing to do without it.
+ */
+int bond_init()
+{
+        char  buf[128];
+        char *c, *name, *save;
+        unsigned int mtu = 0;
+        int i;
+
+        device_t      *d, *m;
+        device_bond_t *b;
+
+        c = config_find(BOND_CONFIG_DEVICES);
+        if (!c) {
+                return 0;
+        }
+
+        d = (device_t*) calloc(1, sizeof(device_t));
+        b = (device_bond_t*) calloc(1, sizeof(device_bond_t));
+        if (!d || !b) {
+                BOND_ERROR("Can not alloc memory for the bond.");
+                goto error;
+        }
+
+        strncpy(buf, c, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+
+        for (name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save))
+        {
+                m = device_find_by_name(name);
+                if (!m || m->master || (m->flag & DEVICE_FLAG_VIRTUAL)) {
+                        logf_error("BOND", "Can not bond the device %s.", name);
+                        goto error;
+                }
+
+                if (b->nmembers == BOND_MAX_MEMBERS) {
+                        BOND_ERROR("Too many devices to bond.");
+                        goto error;
+                }
+
+                b->members[b->nmembers++] = m;
+
+                if (!mtu || m->mtu < mtu) {
+                        mtu = m->mtu;
+                }
+        }
+
+        if (!b->nmembers || mtu <= BOND_HEADER_LENGTH) {
+                BOND_ERROR("No device to bond.");
+                goto error;
+        }
+
+        c = config_find(BOND_CONFIG_TIMEOUT);
+        b->timeout = c ? atoi(c) : BOND_DEFAULT_TIMEOUT;
+        if (b->timeout <= 0) {
+                b->timeout = BOND_DEFAULT_TIMEOUT;
+        }
+
+        if (!tick_create(b->timer)) {
+                BOND_ERROR("Can not alloc memory for a timer.");
+                goto error;
+        }
+        tick_init_timer(b->timer, bond_timeout, b);
+
+        c = config_find(BOND_CONFIG_NAME);
+        if (!c || strlen(c) != 2) {
+                c = BOND_DEFAULT_NAME;
+        }
+
+        d->name[0] = c[0];
+        d->name[1] = c[1];
+        d->fd      = -1;
+        d->mtu     = mtu - BOND_HEADER_LENGTH;
+        d->output  = bond_output;
+        d->pull    = bond_pull;
+        d->receive = bond_receive;
+        d->exit    = bond_exit;
+        d->priv    = b;
+        d->flag    = DEVICE_FLAG_VIRTUAL;
+        b->dev     = d;
+
+        if (device_add(d) == -1) {
+                tick_free(b->timer);
+                goto error;
+        }
+
+        // from now on, what the members receive goes to the bond
+        for (i = 0; i < b->nmembers; i++)
+        {
+                b->members[i]->master = d;
+        }
+
+        logf_info("BOND", "Bond %d devices as %.2s with MTU %u.", b->nmembers, d->name, d->mtu);
+
+        return 0;
+
+error:
+        free(b);
+        free(d);
+        return -1;
+}
+
+int bond_exit(device_t *d)
+{
+        device_bond_t *b = (device_bond_t*) d->priv;
+        packet_t      *pkg;
+        int i;
+
+        while (!queue_empty(&d->tx_queue))
+        {
+                pkg = queue_data(queue_first(&d->tx_queue), packet_t, queue);
+                queue_delete(&pkg->queue);
+                packet_put(pkg);
+        }
+
+        for (i = 0; i < BOND_WINDOW; i++)
+        {
+                packet_put(b->rx_window[i]);
+        }
+
+        tick_delete(b->timer);
+        tick_free(b->timer);
+        free(b);
+
+        return 0;
+}
+
+/*
+ * the member with room expected to finish the frame first, counting
+ * what is queued on it already.
+ */
+static device_t *bond_pick(device_bond_t *b, int len)
+{
+        device_t *m, *best = NULL;
+        uint64_t  cost, best_cost = 0;
+        int       i;
+
+        for (i = 0; i < b->nmembers; i++)
+        {
+                m = b->members[i];
+                // the frames it may have in flight and the next
+                if (m->tx_packets > m->tx_window) {
+                        continue;
+                }
+
+                cost = (uint64_t) (m->tx_bytes + len) * 1000 /
+                       (m->tx_rate ? m->tx_rate : BOND_DEFAULT_RATE);
+
+                if (!best || cost < best_cost) {
+                        best      = m;
+                        best_cost = cost;
+                }
+        }
+
+        return best;
+}
+
+/*
+ * the frames of the bond fit in the frames of every member, with
+ * the bond header.
+ */
+static void bond_size(device_bond_t *b)
+{
+        unsigned int size = b->dev->mtu + BOND_HEADER_LENGTH;
+        int i;
+
+        for (i = 0; i < b->nmembers; i++)
+        {
+                if (b->members[i]->tx_size < size) {
+                        size = b->members[i]->tx_size;
+                }
+        }
+
+        __atomic_store_n(&b->dev->tx_size, size - BOND_HEADER_LENGTH, __ATOMIC_RELAXED);
+}
+
+/*
+ * a frame sent to all the devices, queue it until a member takes it.
+ */
+static int bond_output(packet_t *pkg)
+{
+        device_t *d = pkg->dev;
+
+        queue_insert_tail(&d->tx_queue, &pkg->queue);
+
+        d->tx_bytes += pkg->len;
+        if (++d->tx_packets > d->tx_high) {
+                d->tx_high = d->tx_packets;
+        }
+
+        return bond_pull(d);
+}
+
+/*
+ * give the queued frames to the members with room, the scheduler
+ * gives more when they are taken.
+ */
+static int bond_pull(device_t *d)
+{
+        device_bond_t *b = (device_bond_t*) d->priv;
+        device_t      *m;
+        packet_t      *pkg;
+
+        bond_size(b);
+
+        for (;;)
+        {
+                device_schedule(d);
+
+                if (queue_empty(&d->tx_queue)) {
+                        break;
+                }
+
+                pkg = queue_data(queue_first(&d->tx_queue), packet_t, queue);
+
+                m = bond_pick(b, pkg->len + BOND_HEADER_LENGTH);
+                if (!m) {
+                        break;
+                }
+
+                queue_delete(&pkg->queue);
+                d->tx_bytes -= pkg->len;
+                d->tx_packets--;
+
+                pkg = bond_number(b, pkg);
+                if (!pkg) {
+                        continue;
+                }
+
+                pkg->dev = m;
+                device_enqueue(m, pkg);
+        }
+
+        return 0;
+}
+
+/*
+ * the frames are numbered in the order the members take them. a
+ * clone shares its buffer, the header is written in a copy of it.
+ */
+static packet_t *bond_number(device_bond_t *b, packet_t *pkg)
+{
+        bond_hdr_t *hdr;
+        packet_t   *c;
+
+        if (packet_shared(pkg)) {
+                c = packet_alloc();
+                if (!c) {
+                        packet_put(pkg);
+                        return NULL;
+                }
+
+                memcpy(c->pdu, pkg->pdu, pkg->len);
+                c->len = pkg->len;
+                packet_put(pkg);
+                pkg = c;
+        }
+
+        hdr = (bond_hdr_t*) packet_push(pkg, BOND_HEADER_LENGTH);
+        if (!hdr) {
+                packet_put(pkg);
+                return NULL;
+        }
+
+        hdr->seq = htons(b->tx_seq++);
+
+        return pkg;
+}
+
+/*
+ * a frame from a member, keep it in the window until the frames
+ * before it are in.
+ */
+static int bond_receive(packet_t *pkg)
+{
+        device_bond_t *b = (device_bond_t*) pkg->dev->master->priv;
+        bond_hdr_t    *hdr;
+        uint16_t       seq;
+        int16_t        diff;
+
+        hdr = (bond_hdr_t*) packet_pull(pkg, BOND_HEADER_LENGTH);
+        if (!hdr) {
+                BOND_WARN("Drop a frame without bond header.");
+                packet_put(pkg);
+                return -1;
+        }
+
+        seq      = ntohs(hdr->seq);
+        pkg->dev = b->dev;
+
+        diff = (int16_t) (seq - b->rx_next);
+
+        // far behind, the other side started again
+        if (diff < -BOND_WINDOW) {
+                BOND_INFO("The sequence of the other side starts again.");
+                while (b->rx_count > 0)
+                {
+                        bond_skip(b);
+                }
+                b->rx_next = seq;
+                diff       = 0;
+        }
+
+        // late
+        if (diff < 0) {
+                packet_put(pkg);
+                return 0;
+        }
+
+        // no room, give up the frames missing at the front
+        while (diff >= BOND_WINDOW)
+        {
+                if (!b->rx_count) {
+                        b->rx_next = seq - BOND_WINDOW + 1;
+                        break;
+                }
+                bond_skip(b);
+                diff = (int16_t) (seq - b->rx_next);
+        }
+
+        // twice, only now the slot is this frame's and not the one
+        // a window before it
+        if (b->rx_window[seq & BOND_WINDOW_MASK]) {
+                packet_put(pkg);
+                return 0;
+        }
+
+        b->rx_window[seq & BOND_WINDOW_MASK] = pkg;
+        b->rx_count++;
+
+        bond_release(b);
+
+        return 0;
+}
+
+/*
+ * send up the frames in order from the front of the window, wait
+ * for a missing one until the timer expires, the time starts again
+ * when a frame went up.
+ */
+static void bond_release(device_bond_t *b)
+{
+        packet_t *pkg;
+        int       moved = 0;
+
+        while ((pkg = b->rx_window[b->rx_next & BOND_WINDOW_MASK]))
+        {
+                b->rx_window[b->rx_next & BOND_WINDOW_MASK] = NULL;
+                b->rx_next++;
+                b->rx_count--;
+                moved = 1;
+
+                device_input_finish(pkg);
+        }
+
+        if (!b->rx_count) {
+                tick_delete(b->timer);
+        } else if (moved || !is_tick_armed(b->timer)) {
+                tick_add(b->timer, b->timeout);
+        }
+}
+
+/*
+ * the front of the window is given up, send it up if it is in.
+ */
+static void bond_skip(device_bond_t *b)
+{
+        packet_t *pkg = b->rx_window[b->rx_next & BOND_WINDOW_MASK];
+
+        b->rx_window[b->rx_next & BOND_WINDOW_MASK] = NULL;
+        b->rx_next++;
+
+        if (pkg) {
+                b->rx_count--;
+                device_input_finish(pkg);
+        }
+}
+
+/*
+ * the missing frame is lost, go on with the next one received.
+ */
+static int bond_timeout(tick_t *tc)
+{
+        device_bond_t *b = (device_bond_t*) tc->data;
+
+        BOND_WARN("A frame is lost, skip it.");
+
+        while (b->rx_count > 0 && !b->rx_window[b->rx_next & BOND_WINDOW_MASK])
+        {
+                b->rx_next++;
+        }
+
+        bond_release(b);
+
+        return 0;
+}
@@ -5,6 +5,9 @@
 #include "event.h"
 #include "device.h"
 #include "app.h"
+#include "loop.h"
+#include "pool.h"
+#include "packet.h"
 
 #define BUFFER_SIZE 1024
 
@@ -22,6 +25,8 @@ void sighandler(int sig)
         device_exit();
         event_exit();
         app_exit();
+        loop_exit();
+        pool_exit();
         log_exit();
 
         exit(0);
@@ -43,6 +48,16 @@ int main(int argc, int argv)
         // set log
         log_init(NULL, 0);
 
+        // init pools, before anything alloc from them
+        if (pool_init() == -1) {
+                return -1;
+        }
+
+        // init packet buffers
+        if (packet_init() == -1) {
+                return -1;
+        }
+
         // init event module
         if (event_init() == -1) {
                 return -1;
@@ -53,14 +68,19 @@ int main(int argc, int argv)
                 return -1;
         }
 
-        // init app module
-        if (app_init() == -1) {
+        // init loop module, the main loop is this thread
+        if (loop_init() == -1) {
+                return -1;
+        }
+
+        // init app module, in the main loop or the workers
+        if (loop_start() == -1) {
                 return -1;
         }
 
         for (;;)
         {
-                wait_select();
+                event_wait();
         }
 
         return 0;
@@ -7,11 +7,24 @@
  * 4. Send the frame to upper layer.
  * 5. Send packet to the device.
  * 6. Get input data from device
+ *
+ * With device_thread on, the devices and their drivers run on their
+ * own thread, so a busy stack never delays reading the modem. Packets
+ * cross between the stack and that thread through two rings.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
 #include "device.h"
 #include "config.h"
 #include "log.h"
@@ -19,86 +32,959 @@
 #include "event.h"
 #include "app.h"
 #include "packet.h"
+#include "loop.h"
+#include "tick.h"
+#include "link.h"
+#include "sched.h"
+#include "pool.h"
+
+#define DEVICE_ERROR(s) log_error("DEVICE", (s))
+#define DEVICE_WARN(s)  log_warn ("DEVICE", (s))
+#define DEVICE_INFO(s)  log_info ("DEVICE", (s))
+#define DEVICE_DEBUG(s) log_debug("DEVICE", (s))
+
+#define DEVICE_CONFIG_THREAD    "device_thread"
+#define DEVICE_DEFAULT_THREAD   "on"
+#define DEVICE_CONFIG_RING      "device_ring_size"
+#define DEVICE_DEFAULT_RING     1024
+
+#define is_dev_read_available(dev)      ((dev)->state & DEVICE_STATE_READ_AVAILABLE)
+#define is_dev_write_available(dev)     ((dev)->state & DEVICE_STATE_WRITE_AVAILABLE)
+
+// the device is in the ready set
+#define DEVICE_STATE_READY              0x04U
+#define is_dev_ready(dev)               ((dev)->state & DEVICE_STATE_READY)
+
+// the driver has a frame partly written, it drains on write events
+#define DEVICE_STATE_DRAIN              0x08U
+#define is_dev_draining(dev)            ((dev)->state & DEVICE_STATE_DRAIN)
+
+// weight of a new sample in the measured throughput, 1/8
+#define DEVICE_RATE_SHIFT               3
+
+// backlog of the flows, connections sharing a slot add up
+#define DEVICE_FLOW_BITS                12
+#define device_flow_slot(flow)          (((uint32_t) (flow) * 2654435761U) >> (32 - DEVICE_FLOW_BITS))
+
+/*
+ * packets to or from the device thread, one thread
+ * produces and one consumes, an eventfd rings the consumer.
+ */
+typedef struct device_ring_s device_ring_t;
+struct device_ring_s {
+        spsc_t ring;
+
+        int efd;
+        int notified;
+        event_t *ev;
+
+        int (*handler)(packet_t *pkg);
+};
+
+static int device_input(event_t *ev);
+static int device_output(event_t *ev);
+static int device_check_write(device_t *dev);
+static void device_tx_enqueue(device_t *dev, packet_t *pkg);
+static void device_tx_dequeue(device_t *dev, packet_t *pkg);
+static int device_frame_size(device_t *dev, packet_t *pkg);
+static queue_t *device_tx_next(device_t *dev);
+static void device_rate(device_t *dev, int len);
+static int device_output_done(packet_t *pkg);
+static void device_drain_done(device_t *dev);
+static int device_post(packet_t *pkg);
+static void device_charge(device_t *dev, uint32_t flow, int len);
+static int device_queue(packet_t *pkg);
+static int device_fragment(packet_t *pkg, int mtu, queue_t *frames);
+static packet_t *device_aggregate(device_t *dev);
+static int device_split(packet_t *pkg);
+static int device_receive(packet_t *pkg);
+static uint16_t device_checksum(const char *data, int len);
+static packet_t *device_reassemble(device_t *dev, packet_t *pkg);
+static int device_ring_init(device_ring_t *r, int size, int (*handler)(packet_t *pkg));
+static int device_ring_input(event_t *ev);
+static int device_ring_post(device_ring_t *r, packet_t *pkg);
+static int device_thread_start();
+static int device_thread_stop();
+static void *device_thread(void *arg);
+static int device_teardown();
+
+static queue_t *dev_list;
+
+// devices able to send and with frames queued, their write
+// events are on
+static queue_t *ready_list;
+
+// the device thread, and the rings to and from it
+static int       dev_thread;
+static pthread_t dev_tid;
+static sem_t     dev_started;
+static int       dev_start_error;
+static int       dev_stopping;
+
+static device_ring_t tx_ring;
+static device_ring_t rx_ring;
+
+static unsigned int flow_backlog[1U << DEVICE_FLOW_BITS];
+
+// a packet of the flow was marked by the scheduler of its device
+static uint8_t flow_marked[1U << DEVICE_FLOW_BITS];
+
+extern int aquasent_init();
+extern int serial_init();
+extern int bond_init();
+
+/* 
+ * Initialize the device module.
+ * without device thread the drivers run on the caller's loop.
+ */
+int device_init()
+{
+        char *c;
+
+        c = config_find(DEVICE_CONFIG_THREAD);
+        if (!c) {
+                c = DEVICE_DEFAULT_THREAD;
+        }
+        dev_thread = !strcmp(c, "on");
+
+        if (!queue_create(dev_list)) {
+                DEVICE_ERROR("Can not create device queue.");
+                return -1;
+        }
+
+        queue_init(dev_list);
+
+        if (!queue_create(ready_list)) {
+                DEVICE_ERROR("Can not create device queue.");
+                return -1;
+        }
+
+        queue_init(ready_list);
+
+        if (sched_init() == -1 || link_init() == -1) {
+                return -1;
+        }
+
+        DEVICE_INFO("Initialize the DEVICE MODULE successed.");
+
+        if (dev_thread) {
+                return device_thread_start();
+        }
+
+        if (aquasent_init() == -1 || serial_init() == -1 || bond_init() == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * the stack loop is the caller, it takes the received packets
+ * from rx ring. the device thread takes packets to send from
+ * tx ring, and opens the devices in its own event module.
+ */
+static int device_thread_start()
+{
+        sigset_t set, old;
+        char *c;
+        int size;
+
+        c = config_find(DEVICE_CONFIG_RING);
+        size = c ? atoi(c) : DEVICE_DEFAULT_RING;
+        if (size <= 0) {
+                DEVICE_ERROR("Device ring size must be positive.");
+                return -1;
+        }
+
+        if (device_ring_init(&tx_ring, size, device_queue) == -1 ||
+            device_ring_init(&rx_ring, size, app_send) == -1) {
+                return -1;
+        }
+
+        if (event_add(rx_ring.ev) == -1) {
+                return -1;
+        }
+
+        if (sem_init(&dev_started, 0, 0) == -1) {
+                DEVICE_ERROR(strerror(errno));
+                return -1;
+        }
+
+        // signals always go to the main loop
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+
+        if (pthread_create(&dev_tid, NULL, device_thread, NULL) != 0) {
+                DEVICE_ERROR("Can not create device thread.");
+                pthread_sigmask(SIG_SETMASK, &old, NULL);
+                return -1;
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        sem_wait(&dev_started);
+
+        if (dev_start_error) {
+                return -1;
+        }
+
+        logf_info("DEVICE", "Start device thread with ring size %u.", tx_ring.ring.size);
+
+        return 0;
+}
+
+static void *device_thread(void *arg)
+{
+        if (event_init() == -1 || event_add(tx_ring.ev) == -1 ||
+            aquasent_init() == -1 || serial_init() == -1 || bond_init() == -1) {
+                DEVICE_ERROR("Can not start device thread.");
+                dev_start_error = 1;
+                sem_post(&dev_started);
+                return NULL;
+        }
+
+        sem_post(&dev_started);
+
+        while (!__atomic_load_n(&dev_stopping, __ATOMIC_ACQUIRE))
+        {
+                event_wait();
+        }
+
+        // the devices belong to this thread's event module, close
+        // them here before the module goes
+        device_teardown();
+        event_exit();
+        pool_thread_exit();
+
+        return NULL;
+}
+
+/*
+ * ask the device thread to leave its loop, ring it in case it
+ * sleeps, and wait until it closed the devices.
+ */
+static int device_thread_stop()
+{
+        uint64_t one = 1;
+
+        __atomic_store_n(&dev_stopping, 1, __ATOMIC_RELEASE);
+
+        if (write(tx_ring.efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                DEVICE_ERROR(strerror(errno));
+                return -1;
+        }
+
+        if (pthread_join(dev_tid, NULL) != 0) {
+                DEVICE_ERROR("Can not join device thread.");
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * a ring has one producer and one consumer, the consumer's
+ * event module watches the eventfd. the event is added by
+ * the consumer thread.
+ */
+static int device_ring_init(device_ring_t *r, int size, int (*handler)(packet_t *pkg))
+{
+        event_t *ev;
+
+        if (spsc_init(&r->ring, size) == -1) {
+                DEVICE_ERROR("Can not alloc memory for a device ring.");
+                return -1;
+        }
+
+        r->notified = 0;
+        r->handler  = handler;
+
+        r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (r->efd == -1) {
+                DEVICE_ERROR(strerror(errno));
+                return -1;
+        }
+
+        if (!event_create(ev)) {
+                DEVICE_ERROR("Can not alloc memory for a event.");
+                return -1;
+        }
+
+        ev->fd     = r->efd;
+        ev->input  = device_ring_input;
+        ev->output = NULL;
+        ev->data   = r;
+        ev->flag   = 0;
+
+        set_event_active(ev);
+        set_event_read(ev);
+
+        r->ev = ev;
+
+        return 0;
+}
+
+/*
+ * the producer rang, take all the packets in the ring.
+ */
+static int device_ring_input(event_t *ev)
+{
+        device_ring_t *r = (device_ring_t*) ev->data;
+        packet_t *pkg;
+        uint64_t count;
+
+        if (read(r->efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                DEVICE_ERROR(strerror(errno));
+        }
+
+        // from now on a new packet rings again
+        __atomic_store_n(&r->notified, 0, __ATOMIC_SEQ_CST);
+
+        while ((pkg = (packet_t*) spsc_pop(&r->ring)))
+        {
+                r->handler(pkg);
+        }
+
+        return 0;
+}
+
+/*
+ * a full ring drops the packet, the other side is too slow.
+ */
+static int device_ring_post(device_ring_t *r, packet_t *pkg)
+{
+        uint64_t one = 1;
+
+        if (spsc_push(&r->ring, pkg) == -1) {
+                DEVICE_WARN("Device ring is full, drop a packet.");
+                packet_put(pkg);
+                return -1;
+        }
+
+        // ring once until the consumer takes the packets
+        if (!__atomic_exchange_n(&r->notified, 1, __ATOMIC_SEQ_CST)) {
+                if (write(r->efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                        DEVICE_ERROR(strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Close the file descriptor and free all the device before exit.
+ * with device thread the thread does it, the devices are its own.
+ */
+int device_exit()
+{
+        if (dev_thread) {
+                return device_thread_stop();
+        }
+
+        return device_teardown();
+}
+
+static int device_teardown()
+{
+        device_t *dev;
+        queue_t  *q, *next;
+
+        device_report();
+
+        for (q = dev_list->next; q != dev_list; q = next)
+        {
+                next = q->next;
+                dev  = queue_data(q, device_t, queue);
+                sched_purge(&dev->sched);
+                dev->exit(dev);
+                free(dev);
+        }
+
+        return 0;
+}
+
+/*
+ * log the transmit queue of every device.
+ */
+int device_report()
+{
+        device_t *dev;
+        queue_t  *q;
+        int       ready = 0;
+
+        for (q = dev_list->next; q != dev_list; q = q->next)
+        {
+                dev = queue_data(q, device_t, queue);
+
+                logf_info("DEVICE", "%.2s scheduled %u packets, %u bytes, queued %u frames, %u bytes, %u in flight, %lu failed, high-water %u, %u bytes/s.",
+                        dev->name, dev->sched.packets, dev->sched.bytes,
+                        dev->tx_packets, dev->tx_bytes, dev->tx_inflight, dev->tx_failed,
+                        dev->tx_high, dev->tx_rate);
+
+                logf_info("DEVICE", "%.2s packets waited %lu ms on average, at most %u ms, %lu marked.",
+                        dev->name,
+                        dev->sched.delay_count ? (unsigned long) (dev->sched.delay_sum / dev->sched.delay_count) : 0,
+                        dev->sched.delay_max, dev->sched.marks);
+
+                logf_info("DEVICE", "%.2s frame size %u of %u, %lu of %lu frames failed, %.2e errors per byte.",
+                        dev->name, dev->tx_size, dev->mtu, dev->link.errors, dev->link.seen,
+                        dev->link.hazard);
+
+                if (dev->report) {
+                        dev->report(dev);
+                }
+        }
+
+        for (q = ready_list->next; q != ready_list; q = q->next)
+        {
+                ready++;
+        }
+
+        logf_info("DEVICE", "%d devices ready to send.", ready);
+
+        return 0;
+}
+
+/* 
+ * the protocol module use this function to call the device send 
+ * their packet.
+ */
+int device_send(packet_t *pkg)
+{
+        if (!pkg->dev) {
+                return -1;
+        }
+
+        return device_post(pkg);
+}
+
+/*
+ * send the packet out of every device, each device queues a clone
+ * sharing the same buffer.
+ */
+int device_broadcast(packet_t *pkg)
+{
+        pkg->dev = NULL;
+
+        return device_post(pkg);
+}
+
+/*
+ * hand the packet to the thread of the devices. a packet for a
+ * device counts in its backlog until the scheduler gives it out.
+ */
+static int device_post(packet_t *pkg)
+{
+        device_t *dev = pkg->dev;
+        uint32_t  flow = pkg->flow;
+        int       len = 0;
+
+        // the main loop is the only producer of tx ring
+        if (loop_current() != loop_main()) {
+                return loop_post(loop_main(), pkg);
+        }
+
+        if (dev) {
+                len = packet_chain_len(pkg);
+                device_charge(dev, flow, len);
+                pkg->stamp = tick_now();
+        }
+
+        if (!dev_thread) {
+                return device_queue(pkg);
+        }
+
+        if (device_ring_post(&tx_ring, pkg) == -1) {
+                if (dev) {
+                        device_charge(dev, flow, -len);
+                }
+                return -1;
+        }
+
+        return 0;
+}
+
+static void device_charge(device_t *dev, uint32_t flow, int len)
+{
+        __atomic_add_fetch(&dev->backlog, len, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&flow_backlog[device_flow_slot(flow)], len, __ATOMIC_RELAXED);
+}
+
+/*
+ * bytes sent to the device and not given out by its scheduler yet,
+ * any thread may ask.
+ */
+unsigned int device_backlog(device_t *dev)
+{
+        return __atomic_load_n(&dev->backlog, __ATOMIC_RELAXED);
+}
+
+/*
+ * the frame size the device sends now, any thread may ask.
+ */
+unsigned int device_tx_size(device_t *dev)
+{
+        return __atomic_load_n(&dev->tx_size, __ATOMIC_RELAXED);
+}
+
+unsigned int device_flow_backlog(uint32_t flow)
+{
+        return __atomic_load_n(&flow_backlog[device_flow_slot(flow)], __ATOMIC_RELAXED);
+}
+
+/*
+ * a packet of the flow waited too long since the last time asked,
+ * the sender should slow down.
+ */
+int device_flow_marked(uint32_t flow)
+{
+        return __atomic_exchange_n(&flow_marked[device_flow_slot(flow)], 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * on the thread of the devices, a packet for a device waits in its
+ * scheduler. a packet without device goes to all of them at once,
+ * each device queues clones of the same frames.
+ */
+static int device_queue(packet_t *pkg)
+{
+        device_t *dev, *to = pkg->dev;
+        packet_t *frame, *c;
+        queue_t   frames, *q, *f;
+        int       mtu = 0;
+
+        if (to) {
+                sched_enqueue(&to->sched, pkg);
+
+                if (to->flag & DEVICE_FLAG_VIRTUAL) {
+                        return to->pull(to);
+                }
+
+                return device_check_write(to);
+        }
+
+        // the smallest MTU, the members of a virtual device get
+        // frames from it only
+        for (q = dev_list->next; q != dev_list; q = q->next)
+        {
+                dev = queue_data(q, device_t, queue);
+                if (dev->master) {
+                        continue;
+                }
+                if (!mtu || (int) dev->mtu < mtu) {
+                        mtu = dev->mtu;
+                }
+        }
+
+        if (!mtu) {
+                DEVICE_WARN("No device to send the packet.");
+                packet_put(pkg);
+                return -1;
+        }
+
+        // what can not be cut is dropped, the frames made still go
+        queue_init(&frames);
+        device_fragment(pkg, mtu, &frames);
+
+        while (!queue_empty(&frames))
+        {
+                f     = queue_first(&frames);
+                frame = queue_data(f, packet_t, queue);
+                queue_delete(f);
+
+                for (q = dev_list->next; q != dev_list; q = q->next)
+                {
+                        dev = queue_data(q, device_t, queue);
+                        if (dev->master) {
+                                continue;
+                        }
+
+                        c = packet_clone(frame);
+                        if (!c) {
+                                break;
+                        }
+
+                        c->dev = dev;
+                        device_enqueue(dev, c);
+                }
+
+                packet_put(frame);
+        }
+
+        return 0;
+}
+
+/*
+ * add a frame to the transmit queue of the device, a virtual
+ * device passes it to one of its members at once.
+ */
+int device_enqueue(device_t *dev, packet_t *pkg)
+{
+        if (dev->flag & DEVICE_FLAG_VIRTUAL) {
+                return dev->output(pkg);
+        }
+
+        device_tx_enqueue(dev, pkg);
+
+        return device_check_write(dev);
+}
+
+/*
+ * queue the frames of the packets the scheduler gives next, until
+ * they fill a transmission after the ones in flight. the frames of a packet stay together,
+ * the other side puts them together again in order.
+ */
+int device_schedule(device_t *dev)
+{
+        packet_t *pkg;
+        queue_t   frames, *f;
+
+        while (dev->tx_bytes - dev->tx_inflight_bytes < dev->tx_size &&
+               (pkg = sched_dequeue(&dev->sched)))
+        {
+                device_charge(dev, pkg->flow, -packet_chain_len(pkg));
+
+                if (pkg->marked) {
+                        __atomic_store_n(&flow_marked[device_flow_slot(pkg->flow)], 1, __ATOMIC_RELAXED);
+                }
+
+                queue_init(&frames);
+                device_fragment(pkg, device_frame_size(dev, pkg), &frames);
+
+                while (!queue_empty(&frames))
+                {
+                        f = queue_first(&frames);
+                        queue_delete(f);
+                        device_tx_enqueue(dev, queue_data(f, packet_t, queue));
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * the frame size for a chain, the one of the device, but large
+ * enough for the frames of the chain to fit in the frame index.
+ */
+static int device_frame_size(device_t *dev, packet_t *pkg)
+{
+        packet_t *seg;
+        int       n = 0, len = 0, need;
+
+        for (seg = pkg; seg; seg = seg->next)
+        {
+                len += seg->len;
+                n++;
+        }
+
+        if (n > DEVICE_FRAG_INDEX_MASK) {
+                return dev->tx_size;
+        }
+
+        // every segment may leave a short frame behind
+        need = len / (DEVICE_FRAG_INDEX_MASK + 1 - n) + 1 + DEVICE_FRAG_HEADER_LENGTH;
+
+        return (int) dev->tx_size > need ? (int) dev->tx_size : need;
+}
+
+static void device_tx_enqueue(device_t *dev, packet_t *pkg)
+{
+        queue_insert_tail(&dev->tx_queue, &pkg->queue);
+
+        dev->tx_bytes += pkg->len;
+        if (++dev->tx_packets > dev->tx_high) {
+                dev->tx_high = dev->tx_packets;
+        }
+}
+
+static void device_tx_dequeue(device_t *dev, packet_t *pkg)
+{
+        queue_delete(&pkg->queue);
+
+        dev->tx_bytes -= pkg->len;
+        dev->tx_packets--;
+}
+
+/*
+ * the first frame of the queue not in flight, the sentinel if all
+ * of them are.
+ */
+static queue_t *device_tx_next(device_t *dev)
+{
+        queue_t     *q = queue_first(&dev->tx_queue);
+        unsigned int i;
+
+        for (i = 0; i < dev->tx_inflight && q != &dev->tx_queue; i++)
+        {
+                q = q->next;
+        }
+
+        return q;
+}
+
+/*
+ * cut a chain into frames of at most mtu bytes, each with a fragment
+ * header pushed in its head room. a segment is a frame, only a
+ * segment too long for the device is split, by copying its end to a
+ * new segment. the frames are added to the frames queue, the packet
+ * is given up.
+ */
+static int device_fragment(packet_t *pkg, int mtu, queue_t *frames)
+{
+        static uint8_t id;
+
+        device_frag_t *frag;
+        device_t      *dev  = pkg->dev;
+        packet_t      *seg, *next, *rest;
+        int            room = mtu - DEVICE_FRAG_HEADER_LENGTH;
+        int            idx  = 0;
+
+        id++;
+
+        for (seg = pkg; seg; seg = next)
+        {
+                if (seg->len > room) {
+                        rest = packet_alloc();
+                        if (!rest) {
+                                goto error;
+                        }
+
+                        memcpy(rest->pdu, seg->pdu + room, seg->len - room);
+                        rest->len  = seg->len - room;
+                        rest->next = seg->next;
+                        seg->next  = rest;
+                        seg->len   = room;
+                }
+
+                if (idx > DEVICE_FRAG_INDEX_MASK) {
+                        DEVICE_ERROR("Too many frames for a packet.");
+                        goto error;
+                }
+
+                frag = (device_frag_t*) packet_push(seg, DEVICE_FRAG_HEADER_LENGTH);
+                if (!frag) {
+                        goto error;
+                }
+
+                // the segment leaves the chain as a frame of its own
+                next      = seg->next;
+                seg->next = NULL;
+                seg->dev  = dev;
+
+                frag->id  = id;
+                frag->idx = idx++ | (next ? DEVICE_FRAG_MORE : 0);
+
+                queue_insert_tail(frames, &seg->queue);
+        }
+
+        return 0;
+
+error:
+        packet_put(seg);
+        return -1;
+}
+
+/*
+ * a frame from the device, pull its fragment header and add it to
+ * the chain being received. a frame out of order drops the chain.
+ * return the whole chain after its last frame, or NULL.
+ */
+static packet_t *device_reassemble(device_t *dev, packet_t *pkg)
+{
+        device_frag_t *frag;
+        int            idx;
+
+        frag = (device_frag_t*) packet_pull(pkg, DEVICE_FRAG_HEADER_LENGTH);
+        if (!frag) {
+                DEVICE_WARN("Drop a frame without fragment header.");
+                packet_put(pkg);
+                return NULL;
+        }
+
+        idx = frag->idx & DEVICE_FRAG_INDEX_MASK;
+
+        if (idx == 0) {
+                if (dev->rx_head) {
+                        DEVICE_WARN("Drop a packet missing its last frames.");
+                        packet_put(dev->rx_head);
+                }
+                dev->rx_head = pkg;
+                dev->rx_id   = frag->id;
+        } else if (dev->rx_head && frag->id == dev->rx_id && idx == dev->rx_idx) {
+                dev->rx_tail->next = pkg;
+        } else {
+                DEVICE_WARN("Drop a packet missing its frames.");
+                packet_put(dev->rx_head);
+                packet_put(pkg);
+                dev->rx_head = NULL;
+                return NULL;
+        }
 
-#define DEVICE_ERROR(s) log_error("DEVICE", (s))
-#define DEVICE_WARN(s)  log_warn ("DEVICE", (s))
-#define DEVICE_INFO(s)  log_info ("DEVICE", (s))
-#define DEVICE_DEBUG(s) log_debug("DEVICE", (s))
+        dev->rx_tail = pkg;
+        dev->rx_idx  = idx + 1;
 
-#define is_dev_read_available(dev)      ((dev)->state & DEVICE_STATE_READ_AVAILABLE)
-#define is_dev_write_available(dev)     ((dev)->state & DEVICE_STATE_WRITE_AVAILABLE)
+        if (frag->idx & DEVICE_FRAG_MORE) {
+                return NULL;
+        }
 
-static int device_input(event_t *ev);
-static int device_output(event_t *ev);
-static int device_check_write();
-static device_t *device_find_by_fd(int fd);
+        pkg = dev->rx_head;
 
-static queue_t *dev_list;
-static queue_t *write_list;
+        dev->rx_head = NULL;
+        dev->rx_tail = NULL;
 
-extern int aquasent_init();
+        return pkg;
+}
 
-/* 
- * Initialize the device module.
+/*
+ * the first frame of the queue not in flight ready for the wire.
+ * alone, it gets its subframe header in its head room. with the
+ * frames after it that fit in the same transmission, or shared with
+ * other devices, they are copied into a new frame, which takes their
+ * place behind the frames in flight.
  */
-int device_init()
+static packet_t *device_aggregate(device_t *dev)
 {
-        if (!queue_create(dev_list)) {
-                DEVICE_ERROR("Can not create device queue.");
-                return -1;
+        device_sub_t *sub;
+        packet_t     *pkg, *f, *agg;
+        queue_t      *q, *first, *prev;
+        int           room = dev->tx_size + DEVICE_SUB_HEADER_LENGTH;
+        int           len  = 0, n = 0;
+
+        first = device_tx_next(dev);
+        prev  = first->prev;
+
+        pkg = queue_data(first, packet_t, queue);
+        if (pkg == dev->tx_frame) {
+                return pkg;
         }
 
-        queue_init(dev_list);
+        for (q = first; q != &dev->tx_queue; q = q->next)
+        {
+                f = queue_data(q, packet_t, queue);
+                if (n && len + (int) DEVICE_SUB_HEADER_LENGTH + f->len > room) {
+                        break;
+                }
+                len += DEVICE_SUB_HEADER_LENGTH + f->len;
+                n++;
+        }
 
-        if (!queue_create(write_list)) {
-                DEVICE_ERROR("Can not create device queue.");
-                return -1;
+        if (n == 1 && !packet_shared(pkg)) {
+                len = pkg->len;
+                sub = (device_sub_t*) packet_push(pkg, DEVICE_SUB_HEADER_LENGTH);
+                if (!sub) {
+                        return NULL;
+                }
+
+                sub->len = htons(len);
+                sub->sum = htons(device_checksum(pkg->pdu + DEVICE_SUB_HEADER_LENGTH, len));
+
+                dev->tx_bytes += DEVICE_SUB_HEADER_LENGTH;
+                dev->tx_frame  = pkg;
+
+                return pkg;
         }
 
-        queue_init(write_list);
+        agg = packet_alloc();
+        if (!agg) {
+                return NULL;
+        }
 
-        DEVICE_INFO("Initialize the DEVICE MODULE successed.");
+        while (n-- > 0)
+        {
+                f   = queue_data(prev->next, packet_t, queue);
+                sub = (device_sub_t*) packet_append(agg, DEVICE_SUB_HEADER_LENGTH + f->len);
 
-        if (aquasent_init() == -1) {
-                return -1;
+                sub->len = htons(f->len);
+                sub->sum = htons(device_checksum(f->pdu, f->len));
+                memcpy(sub + 1, f->pdu, f->len);
+
+                device_tx_dequeue(dev, f);
+                packet_put(f);
         }
 
-        return 0;
+        agg->dev = dev;
+
+        queue_insert_after(prev, &agg->queue);
+        dev->tx_bytes += agg->len;
+        dev->tx_packets++;
+
+        dev->tx_frame = agg;
+
+        return agg;
 }
 
 /*
- * Close the file descriptor and free all the device before exit.
+ * cut a transmission into its subframes, each goes on as a frame of
+ * its own. the last one keeps the buffer, the others are copied, the
+ * upper layers write in the buffers they get. a subframe failing its
+ * checksum drops the rest, its length can not be trusted.
  */
-int device_exit()
+static int device_split(packet_t *pkg)
 {
-        device_t *dev;
-        queue_t  *q;
+        device_sub_t *sub;
+        packet_t     *f;
+        int           len;
 
-        for(q = dev_list->next; q != dev_list; q = q->next)
+        while ((sub = (device_sub_t*) packet_pull(pkg, DEVICE_SUB_HEADER_LENGTH)))
         {
-                dev = queue_data(q, device_t, queue);
-                dev->exit();
-                free(dev);
+                len = ntohs(sub->len);
+                if (len > pkg->len || ntohs(sub->sum) != device_checksum(pkg->pdu, len)) {
+                        DEVICE_WARN("Drop a damaged subframe.");
+                        device_observe(pkg->dev, DEVICE_SUB_HEADER_LENGTH + pkg->len, 0);
+                        break;
+                }
+
+                device_observe(pkg->dev, DEVICE_SUB_HEADER_LENGTH + len, 1);
+
+                if (len == pkg->len) {
+                        return device_receive(pkg);
+                }
+
+                f = packet_alloc();
+                if (!f) {
+                        break;
+                }
+
+                memcpy(f->pdu, packet_pull(pkg, len), len);
+                f->len = len;
+                f->dev = pkg->dev;
+                f->up  = pkg->up;
+
+                device_receive(f);
         }
 
-        return 0;
+        packet_put(pkg);
+
+        return -1;
 }
 
-/* 
- * the protocol module use this function to call the device send 
- * their packet.
+/*
+ * fletcher-16, the sums are reduced every 5802 bytes, before they can
+ * overflow.
  */
-int device_send(packet_t *pkg)
+static uint16_t device_checksum(const char *data, int len)
 {
-        if (!pkg->dev) {
-                return -1;
-        }
+        const uint8_t *p = (const uint8_t*) data;
+        uint32_t a = 0, b = 0;
+        int n;
 
-        queue_insert_tail(write_list, &pkg->queue);
+        while (len > 0)
+        {
+                n    = len < 5802 ? len : 5802;
+                len -= n;
 
-        device_check_write();
+                while (n-- > 0)
+                {
+                        a += *p++;
+                        b += a;
+                }
 
-        return 0;
+                a %= 255;
+                b %= 255;
+        }
+
+        return (uint16_t) (b << 8 | a);
 }
 
 int device_add(device_t *dev)
@@ -110,8 +996,49 @@ int device_add(device_t *dev)
                 return -1;
         }
 
+        dev->rx_head = NULL;
+        dev->rx_tail = NULL;
+        dev->rx_idx  = 0;
+
+        queue_init(&dev->tx_queue);
+        dev->tx_packets = 0;
+        dev->tx_bytes   = 0;
+        dev->tx_high    = 0;
+        dev->tx_start   = 0;
+        dev->tx_rate    = 0;
+        dev->tx_frame   = NULL;
+        dev->tx_failed  = 0;
+
+        dev->tx_inflight       = 0;
+        dev->tx_inflight_bytes = 0;
+        if (!dev->tx_window) {
+                dev->tx_window = 1;
+        }
+
+        sched_create(&dev->sched);
+        dev->backlog = 0;
+
+        dev->ev = NULL;
+
+        if (!(dev->flag & DEVICE_FLAG_VIRTUAL)) {
+                if (dev->mtu <= DEVICE_SUB_HEADER_LENGTH + DEVICE_FRAG_HEADER_LENGTH) {
+                        DEVICE_ERROR("The MTU of the device is too small.");
+                        return -1;
+                }
+                dev->mtu -= DEVICE_SUB_HEADER_LENGTH;
+        }
+
+        link_create(&dev->link, dev->mtu);
+        dev->tx_size = dev->mtu;
+
         queue_insert(dev_list, &dev->queue);
 
+        // nothing to watch
+        if (dev->flag & DEVICE_FLAG_VIRTUAL) {
+                DEVICE_DEBUG("Successed to add a virtual device.");
+                return 0;
+        }
+
         if (!event_create(ev)) {
                 DEVICE_ERROR("Can not alloc memory for a event.");
                 return -1;
@@ -120,11 +1047,21 @@ int device_add(device_t *dev)
         ev->fd     = dev->fd;
         ev->input  = device_input;
         ev->output = device_output;
+        ev->data   = dev;
         ev->flag   = 0;
 
+        // the drivers read and write through the event module
         set_event_active(ev);
         set_event_read(ev);
-        event_add(ev);
+        set_event_io(ev);
+
+        if (event_add(ev) == -1) {
+                queue_delete(&dev->queue);
+                event_free(ev);
+                return -1;
+        }
+
+        dev->ev = ev;
 
         DEVICE_DEBUG("Successed to add an device.");
 
@@ -136,11 +1073,7 @@ int device_add(device_t *dev)
  */
 static int device_input(event_t *ev)
 {
-        device_t *dev = device_find_by_fd(ev->fd);
-        if (!dev) {
-                DEVICE_ERROR("Can not find the device matched.");
-                return -1;
-        }
+        device_t *dev = (device_t*) ev->data;
 
         return dev->input(dev);
 }
@@ -151,6 +1084,39 @@ static int device_input(event_t *ev)
  */
 int device_input_finish(packet_t *pkg)
 {
+        if (!pkg->dev) {
+                packet_put(pkg);
+                return -1;
+        }
+
+        // a virtual device gives its frames one by one
+        if (pkg->dev->flag & DEVICE_FLAG_VIRTUAL) {
+                return device_receive(pkg);
+        }
+
+        return device_split(pkg);
+}
+
+/*
+ * a frame of the device, to its master or to the upper layer.
+ */
+static int device_receive(packet_t *pkg)
+{
+        // the master puts the frames of its members in order, then
+        // they come back here as its own
+        if (pkg->dev->master) {
+                return pkg->dev->master->receive(pkg);
+        }
+
+        pkg = device_reassemble(pkg->dev, pkg);
+        if (!pkg) {
+                return 0;
+        }
+
+        if (dev_thread) {
+                return device_ring_post(&rx_ring, pkg);
+        }
+
         return app_send(pkg);
         // int i;
         // for (i = 0; i < pkg->len; i++) {
@@ -165,106 +1131,274 @@ int device_input_finish(packet_t *pkg)
  */
 static int device_output(event_t *ev)
 {
-        device_t *dev = device_find_by_fd(ev->fd);
-        if (!dev) {
-                DEVICE_ERROR("Can not find the device matched.");
-                return -1;
+        device_t *dev = (device_t*) ev->data;
+        packet_t *pkg;
+
+        // the rest of the frame the fd could not take at once
+        if (is_dev_draining(dev)) {
+                return dev->drain(dev);
         }
 
-        packet_t *pkg;
-        queue_t  *q;
+        device_schedule(dev);
 
-        for (q = write_list->next; q != write_list; q = q->next)
-        {
-                pkg = queue_data(q, packet_t, queue);
-                if (pkg->dev == dev) {
-                        dev->output(pkg);
-                        break;
-                }
+        if (dev->tx_packets == dev->tx_inflight || dev->tx_inflight >= dev->tx_window) {
+                return device_check_write(dev);
+        }
+
+        pkg = device_aggregate(dev);
+        if (!pkg) {
+                DEVICE_WARN("Can not frame a packet for the device, drop it.");
+                pkg = queue_data(device_tx_next(dev), packet_t, queue);
+                device_tx_dequeue(dev, pkg);
+                packet_put(pkg);
+                return device_check_write(dev);
+        }
+
+        if (!dev->tx_inflight) {
+                dev->tx_start = tick_now();
         }
+        dev->output(pkg);
 
         return 0;
 }
 
+/*
+ * the driver sent the oldest frame in flight, or the frame it was
+ * given if it sends them one by one without device_output_finish_part.
+ */
 int device_output_finish(packet_t *pkg)
 {
-        event_t *ev;
+        device_t *dev = pkg->dev;
 
-        if (!pkg->dev) {
+        if (!dev) {
                 return -1;
         }
 
-        queue_delete(&pkg->queue);
-        free(pkg);
+        device_rate(dev, pkg->len);
+
+        return device_output_done(pkg);
+}
+
+/*
+ * the driver gave up the oldest frame in flight, it is lost like a
+ * frame lost on the medium. the next one starts now.
+ */
+int device_output_fail(packet_t *pkg)
+{
+        device_t *dev = pkg->dev;
+
+        if (!dev) {
+                return -1;
+        }
+
+        dev->tx_failed++;
+        dev->tx_start = tick_now();
+
+        return device_output_done(pkg);
+}
+
+/*
+ * take the frame off the queue, and ask for the next.
+ */
+static int device_output_done(packet_t *pkg)
+{
+        device_t *dev = pkg->dev;
+
+        if (pkg == dev->tx_frame) {
+                dev->tx_frame = NULL;
+                device_drain_done(dev);
+        } else if (dev->tx_inflight) {
+                dev->tx_inflight--;
+                dev->tx_inflight_bytes -= pkg->len;
+        }
 
-        device_check_write();
+        device_tx_dequeue(dev, pkg);
+        packet_put(pkg);
+
+        device_check_write(dev);
+
+        if (dev->master) {
+                return dev->master->pull(dev->master);
+        }
 
         return 0;
 }
 
+/*
+ * the throughput of the device, a moving average of the rates
+ * the frames were sent at. a frame behind another in flight starts
+ * when the one before it is done.
+ */
+static void device_rate(device_t *dev, int len)
+{
+        uint64_t     now     = tick_now();
+        uint64_t     elapsed = now - dev->tx_start;
+        unsigned int rate;
+
+        dev->tx_start = now;
+
+        if (!elapsed) {
+                elapsed = 1;
+        }
+
+        rate = (unsigned int) ((uint64_t) len * 1000 / elapsed);
+
+        if (!dev->tx_rate) {
+                dev->tx_rate = rate;
+        } else {
+                dev->tx_rate += ((int) rate - (int) dev->tx_rate) >> DEVICE_RATE_SHIFT;
+        }
+}
+
+/*
+ * the frame is in flight, the device can not take another one
+ * until the driver is ready again, by device_output_ready, and has
+ * less than tx_window frames in flight.
+ */
 int device_output_finish_part(packet_t *pkg)
 {
-        event_t *ev;
+        device_t *dev = pkg->dev;
 
-        if (!pkg->dev) {
+        if (!dev) {
                 return -1;
         }
 
-        unset_dev_write_available(pkg->dev);
+        if (pkg == dev->tx_frame) {
+                dev->tx_frame = NULL;
+                device_drain_done(dev);
+        }
+
+        dev->tx_inflight++;
+        dev->tx_inflight_bytes += pkg->len;
 
-        ev = event_find_by_fd(pkg->dev->fd);
-        if (!ev) {
+        unset_dev_write_available(dev);
+
+        return device_check_write(dev);
+}
+
+/*
+ * the fd took only part of the frame, the device waits for room on
+ * it and has the driver write more by drain, until the driver takes
+ * the frame as in flight by device_output_finish_part, or gives it
+ * up by device_output_fail.
+ */
+int device_output_pending(packet_t *pkg)
+{
+        device_t *dev = pkg->dev;
+
+        if (!dev || !dev->drain || !dev->ev) {
                 return -1;
         }
 
-        unset_event_write(ev);
+        unset_dev_write_available(dev);
+        device_check_write(dev);
+
+        dev->state |= DEVICE_STATE_DRAIN;
+        set_event_write(dev->ev);
 
         return 0;
 }
 
 /*
- * check there is any device ready to send their packet.
+ * the frame being drained is all written, or given up.
  */
-static int device_check_write()
+static void device_drain_done(device_t *dev)
 {
-        packet_t *pkg;
-        event_t  *ev;
-        queue_t  *q;
+        if (is_dev_draining(dev)) {
+                dev->state &= ~DEVICE_STATE_DRAIN;
+                unset_event_write(dev->ev);
+        }
+}
 
-        for (q = write_list->next; q != write_list; q = q->next)
-        {
-                pkg = queue_data(q, packet_t, queue);
-                if (!is_dev_write_available(pkg->dev)) {
-                        continue;
-                }
+/*
+ * the fd of the device reached its end, a closed peer or a tty hung
+ * up. it is not watched any more, so it can not wake the loop again,
+ * and never joins the ready set. its frames wait until exit.
+ */
+int device_hangup(device_t *dev)
+{
+        if (!dev->ev) {
+                return 0;
+        }
 
-                ev = event_find_by_fd(pkg->dev->fd);
-                if (!ev) {
-                        return -1;
-                }
+        logf_error("DEVICE", "%.2s hung up, stop reading and writing it.", dev->name);
 
-                set_event_write(ev);
+        unset_dev_read_available(dev);
+        unset_dev_write_available(dev);
+        dev->state &= ~DEVICE_STATE_DRAIN;
+        device_check_write(dev);
 
-                return 1;
-        }
+        event_delete(dev->ev);
+        dev->ev = NULL;
 
         return 0;
 }
 
-static device_t *device_find_by_fd(int fd)
+/*
+ * the driver can take the next frame while the ones before it are
+ * still in flight.
+ */
+int device_output_ready(device_t *dev)
 {
-        device_t *d;
-        queue_t  *q;
+        set_dev_write_available(dev);
 
-        for (q = dev_list->next; q != dev_list; q = q->next)
-        {
-                d = queue_data(q, device_t, queue);
-                if (d->fd == fd) {
-                        return d;
+        return device_check_write(dev);
+}
+
+/*
+ * a frame of len bytes went through the channel of the device, or
+ * was lost on it, the frame size follows.
+ */
+void device_observe(device_t *dev, int len, int ok)
+{
+        link_observe(&dev->link, len, ok);
+
+        __atomic_store_n(&dev->tx_size, dev->link.size, __ATOMIC_RELAXED);
+}
+
+/*
+ * a device with packets waiting and able to send joins the ready set
+ * and waits for its write event, otherwise it leaves. only this
+ * device is touched, and only when it changes.
+ */
+static int device_check_write(device_t *dev)
+{
+        event_t *ev = dev->ev;
+        int ready;
+
+        if (!ev) {
+                return -1;
+        }
+
+        ready = !is_dev_draining(dev) && is_dev_write_available(dev) && dev->tx_inflight < dev->tx_window &&
+                (dev->tx_packets > dev->tx_inflight || !sched_empty(&dev->sched));
+
+        if (ready && !is_dev_ready(dev)) {
+                queue_insert_tail(ready_list, &dev->ready);
+                dev->state |= DEVICE_STATE_READY;
+                set_event_write(ev);
+        } else if (!ready && is_dev_ready(dev)) {
+                queue_delete(&dev->ready);
+                dev->state &= ~DEVICE_STATE_READY;
+                if (!is_dev_draining(dev)) {
+                        unset_event_write(ev);
                 }
         }
 
-        return NULL;
+        return ready;
+}
+
+/*
+ * the event registry knows the owner of every fd.
+ */
+device_t *device_find_by_fd(int fd)
+{
+        event_t *ev = event_find_by_fd(fd);
+        if (!ev || ev->input != device_input) {
+                return NULL;
+        }
+
+        return (device_t*) ev->data;
 }
 
 device_t *device_find_by_ip(ip_addr_t addr)
@@ -298,3 +1432,75 @@ device_t *device_find_by_name(char *name)
 
         return NULL;
 }
+
+/*
+ * a key of one device, "aquasent_port_AN" for the device AN, or the
+ * key common to all the devices of the driver if it is not set.
+ */
+char *device_config(char *name, char *key)
+{
+        char  buf[64];
+        char *c;
+
+        snprintf(buf, sizeof(buf), "%s_%s", key, name);
+
+        c = config_find(buf);
+        if (c) {
+                return c;
+        }
+
+        return config_find(key);
+}
+
+/*
+ * open a serial port raw and not blocking, at the baud rate, for
+ * the drivers of the modems and the lines.
+ */
+int device_open_tty(char *port, char *baud)
+{
+        struct termios tio;
+        int bd, fd, rv;
+
+        if ((fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) {
+                logf_error("DEVICE", "Can not open the port %s: %s.", port, strerror(errno));
+                return -1;
+        }
+
+        switch(atoi(baud))
+        {
+                case 9600:
+                        bd = B9600;
+                        break;
+                case 19200:
+                        bd = B19200;
+                        break;
+                case 38400:
+                        bd = B38400;
+                        break;
+                case 115200:
+                        bd = B115200;
+                        break;
+                default:
+                        logf_error("DEVICE", "Baud rate %s is not supported.", baud);
+                        close(fd);
+                        return -1;
+        }
+
+        memset(&tio,0,sizeof(tio));
+        tio.c_iflag     = 0;
+        tio.c_oflag     = 0;
+        tio.c_cflag     = CS8|CREAD|CLOCAL;
+        tio.c_lflag     = 0;
+        tio.c_cc[VMIN]  = 1;
+        tio.c_cc[VTIME] = 5;
+        rv  = cfsetospeed(&tio, bd);
+        rv |= cfsetispeed(&tio, bd);
+        rv |= tcsetattr(fd, TCSANOW, &tio);
+        if(rv) {
+                logf_error("DEVICE", "Can not set the port %s.", port);
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
@@ -4,12 +4,15 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include "config.h"
+#include "link.h"
 #include "queue.h"
+#include "sched.h"
 
 #define DEVICE_FLAG_UP          0x01U
 #define DEVICE_FLAG_BROADCAST   0x02U
 #define DEVICE_FLAG_DHCP        0x04U
 #define DEVICE_FLAG_ETHARP      0x08U
+#define DEVICE_FLAG_VIRTUAL     0x10U   // no fd, frames go to other devices
 
 #define DEVICE_STATE_READ_AVAILABLE     0x01U
 #define DEVICE_STATE_WRITE_AVAILABLE    0x02U
@@ -20,14 +23,48 @@
 #define unset_dev_read_available(dev)   ((dev)->state &= ~DEVICE_STATE_READ_AVAILABLE)
 #define unset_dev_write_available(dev)  ((dev)->state &= ~DEVICE_STATE_WRITE_AVAILABLE)
 
+/*
+ * every frame on a device starts with a fragment header, a chain
+ * is cut into frames when it is sent, and put together again when
+ * received. a packet of one segment is a frame with index 0 and
+ * without the more flag.
+ */
+#define DEVICE_FRAG_HEADER_LENGTH       (sizeof(device_frag_t))
+#define DEVICE_FRAG_MORE                0x80U
+#define DEVICE_FRAG_INDEX_MASK          0x7FU
+
+typedef struct device_frag_s device_frag_t;
+struct device_frag_s {
+        uint8_t id;             // the chain
+        uint8_t idx;            // index of frame, and more flag
+};
+
+/*
+ * a transmission of a device carries one or more subframes, each a
+ * frame with its length and a fletcher-16 checksum of it in front.
+ * frames queued together go out in one transmission, up to the MTU
+ * the driver gave. the header is taken out of the device MTU.
+ */
+#define DEVICE_SUB_HEADER_LENGTH        (sizeof(device_sub_t))
+
+typedef struct device_sub_s device_sub_t;
+struct device_sub_s {
+        uint16_t len;           // network byte order
+        uint16_t sum;           // network byte order
+};
+
 typedef struct device_s device_t;
 typedef struct packet_s packet_t;
+typedef struct event_s event_t;
 
 typedef uint8_t ip_addr_t;
 typedef uint8_t mac_addr_t;
 typedef int (*input_fn)(device_t *dev);
 typedef int (*output_fn)(packet_t *pkg);
-typedef int (*dev_exit_fn)();
+typedef int (*dev_exit_fn)(device_t *dev);
+typedef int (*dev_pull_fn)(device_t *dev);
+typedef int (*dev_report_fn)(device_t *dev);
+typedef int (*dev_drain_fn)(device_t *dev);
 
 struct device_s {
         // file descriptor
@@ -49,6 +86,13 @@ struct device_s {
         // maximum transfer unit size
         unsigned int mtu;
 
+        // frames are cut and put together up to tx_size bytes, the
+        // size the link estimator chose from the quality of the
+        // channel, at most mtu. a master takes the smallest of its
+        // members.
+        link_t       link;
+        unsigned int tx_size;
+
         // device flag
         unsigned int flag;
 
@@ -62,6 +106,65 @@ struct device_s {
         // function for exit
         dev_exit_fn exit;
 
+        // logs the counters of the driver, may be NULL
+        dev_report_fn report;
+
+        // writes more of a frame the fd took only part of, may be
+        // NULL if the driver writes every frame at once
+        dev_drain_fn drain;
+
+        // data of the driver
+        void *priv;
+
+        // a member of a virtual device gives its received frames to
+        // the receive function of the master, and asks it for more
+        // frames to send by pull when it sent one
+        device_t   *master;
+        output_fn   receive;
+        dev_pull_fn pull;
+
+        // event of the fd
+        event_t *ev;
+
+        // packets waiting for their turn
+        sched_t      sched;
+
+        // bytes sent to the device and not scheduled yet, from any
+        // thread
+        unsigned int backlog;
+
+        // frames waiting for the device, the first tx_inflight ones
+        // are in flight until the driver finishes them, in order.
+        // the driver sets tx_window, the frames it may have in
+        // flight at once, 1 if it does not.
+        queue_t      tx_queue;
+        unsigned int tx_packets;
+        unsigned int tx_bytes;
+        unsigned int tx_high;   // high-water mark of tx_packets
+        unsigned int tx_window;
+        unsigned int tx_inflight;
+        unsigned int tx_inflight_bytes;
+
+        // frames the driver gave up
+        unsigned long tx_failed;
+
+        // the first frame not in flight, with its subframe header
+        // and the frames sent along with it
+        packet_t    *tx_frame;
+
+        // throughput measured on the sent frames, bytes per second
+        uint64_t     tx_start;  // ms, the oldest frame in flight went out
+        unsigned int tx_rate;
+
+        // in the ready set, it can send and has frames
+        queue_t ready;
+
+        // the chain being received
+        packet_t *rx_head;
+        packet_t *rx_tail;
+        uint8_t   rx_id;
+        uint8_t   rx_idx;
+
         queue_t queue;
 };
 
@@ -70,12 +173,29 @@ int device_init();
 int device_exit();
 
 // for other module
+int device_report();
 int device_send(packet_t *pkg);
+int device_broadcast(packet_t *pkg);
+unsigned int device_backlog(device_t *dev);
+unsigned int device_tx_size(device_t *dev);
+unsigned int device_flow_backlog(uint32_t flow);
+int device_flow_marked(uint32_t flow);
 device_t *device_find_by_name(char *name);
+device_t *device_find_by_fd(int fd);
 
 // for devices
 int device_add(device_t *device);
+int device_enqueue(device_t *dev, packet_t *pkg);
+int device_schedule(device_t *dev);
 int device_input_finish(packet_t *pkg);
 int device_output_finish(packet_t *pkg);
+int device_output_finish_part(packet_t *pkg);
+int device_output_pending(packet_t *pkg);
+int device_output_ready(device_t *dev);
+int device_output_fail(packet_t *pkg);
+int device_hangup(device_t *dev);
+void device_observe(device_t *dev, int len, int ok);
+char *device_config(char *name, char *key);
+int device_open_tty(char *port, char *baud);
 
 #endif // _DEIVCE_H_
@@ -1,34 +1,62 @@
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/time.h>
-#include <sys/select.h>
 #include "event.h"
 #include "config.h"
 #include "log.h"
 #include "queue.h"
+#include "tick.h"
+
+#define EVENT_CONFIG_BACKEND    "event_backend"
+#define EVENT_DEFAULT_BACKEND   "epoll"
+#define EVENT_CONFIG_EDGE       "event_edge_trigger"
+#define EVENT_DEFAULT_EDGE      "on"
 
 #define EVENT_ERROR(s) log_error("EVENT", (s))
 #define EVENT_WARN(s)  log_warn ("EVENT", (s))
 #define EVENT_INFO(s)  log_info ("EVENT", (s))
 #define EVENT_DEBUG(s) log_debug("EVENT", (s))
 
-#define is_event_active(ev)     ((ev)->flag & EVENT_FLAG_ACTIVE)
-#define is_event_read(ev)       ((ev)->flag & EVENT_FLAG_READ)
-#define is_event_write(ev)      ((ev)->flag & EVENT_FLAG_WRITE)
-#define is_event_error(ev)      ((ev)->flag & EVENT_FLAG_ERROR)
-
-#define TICK_PERIOD    (100 * 1e3) // 100 * 1e3 us = 100 ms
-
-static queue_t *ev_list;
-static queue_t *tc_list;
-
-int find_max_fd();
-int handle_event(fd_set *rfd, fd_set *wfd);
-int handle_tick(struct timeval *tv);
+// how many times an edge-triggered callback is called in one round
+// before the event is put on the pending list, so one busy client
+// can not starve the others.
+#define EVENT_EDGE_BUDGET       16
+
+extern event_backend_t epoll_backend;
+extern event_backend_t uring_backend;
+extern event_backend_t select_backend;
+
+// in the order to fall back
+static event_backend_t *backends[] = {
+        &epoll_backend,
+        &uring_backend,
+        &select_backend,
+        NULL,
+};
+
+static __thread event_backend_t *backend;
+static __thread int edge_trigger;
+
+static __thread queue_t *ev_list;
+// registry of events indexed by fd
+static __thread event_t **ev_table;
+static __thread int ev_table_size;
+// edge-triggered events not drained in the last round
+static __thread queue_t *pending_list;
+// deleted events, the backend may still report them in this round
+static __thread queue_t *closed_list;
+
+static int event_backend_init();
+static int event_table_grow(int fd);
+static int event_drain(event_t *ev, ev_cb_fn cb, unsigned int flag);
+static int event_process_pending();
+static int event_free_closed();
 
 int event_init()
 {
+        char *c;
+
         if (!queue_create(ev_list)) {
                 EVENT_ERROR("Can not create event queue.");
                 return -1;
@@ -36,190 +64,406 @@ int event_init()
 
         queue_init(ev_list);
 
-        if (!queue_create(tc_list)) {
+        if (!queue_create(pending_list)) {
                 EVENT_ERROR("Can not create event queue.");
                 return -1;
         }
 
-        queue_init(tc_list);
+        queue_init(pending_list);
+
+        if (!queue_create(closed_list)) {
+                EVENT_ERROR("Can not create event queue.");
+                return -1;
+        }
+
+        queue_init(closed_list);
+
+        if (tick_init() == -1) {
+                return -1;
+        }
+
+        if (event_backend_init() == -1) {
+                return -1;
+        }
+
+        // edge-triggered only make sense for the backend support it
+        c = config_find(EVENT_CONFIG_EDGE);
+        if (!c) {
+                c = EVENT_DEFAULT_EDGE;
+        }
+        edge_trigger = backend->edge && !strcmp(c, "on");
+
+        logf_info("EVENT", "Use %s backend, edge-triggered %s.",
+                backend->name, edge_trigger ? "on" : "off");
 
         EVENT_INFO("Initialize the EVENT SYSTEM successed.");
 
         return 0;
 }
 
+/*
+ * use the backend named in config file, if it can not work here,
+ * fall back to the others in order.
+ */
+static int event_backend_init()
+{
+        char *c;
+        int i;
+
+        c = config_find(EVENT_CONFIG_BACKEND);
+        if (!c) {
+                c = EVENT_DEFAULT_BACKEND;
+        }
+
+        for (i = 0; backends[i]; i++)
+        {
+                if (!strcmp(backends[i]->name, c) && backends[i]->init() == 0) {
+                        backend = backends[i];
+                        return 0;
+                }
+        }
+
+        logf_warn("EVENT", "Can not use %s backend, try the others.", c);
+
+        for (i = 0; backends[i]; i++)
+        {
+                if (backends[i]->init() == 0) {
+                        backend = backends[i];
+                        return 0;
+                }
+        }
+
+        EVENT_ERROR("No event backend available.");
+
+        return -1;
+}
+
 int event_exit()
 {
         event_t *e;
-        tick_t *t;
-        queue_t *q;
+        queue_t *q, *n;
 
-        for (q = ev_list->next; q != ev_list; q = q->next)
+        event_free_closed();
+
+        for (q = ev_list->next; q != ev_list; q = n)
         {
+                n = q->next;
                 e = queue_data(q, event_t, queue);
-                free(e);
+                event_free(e);
         }
 
-        for (q = tc_list->next; q != tc_list; q = q->next)
-        {
-                t = queue_data(q, tick_t, queue);
-                free(t);
-        }
+        tick_exit();
 
-        return 0;
+        free(ev_table);
+        ev_table      = NULL;
+        ev_table_size = 0;
+
+        return backend->exit();
 }
 
 int event_add(event_t *ev)
 {
+        if (ev->fd < 0) {
+                EVENT_ERROR("Can not add an event with invalid fd.");
+                return -1;
+        }
+
+        if (ev->fd >= ev_table_size && event_table_grow(ev->fd) == -1) {
+                return -1;
+        }
+
+        if (ev_table[ev->fd]) {
+                logf_error("EVENT", "There is an event for fd %d already.", ev->fd);
+                return -1;
+        }
+
+        if (!edge_trigger) {
+                ev->flag &= ~EVENT_FLAG_EDGE;
+        }
+
+        ev->ready = 0;
+
+        if (backend->add(ev) == -1) {
+                return -1;
+        }
+
+        ev->flag |= EVENT_FLAG_ADDED;
+
         queue_insert(ev_list, &ev->queue);
+        ev_table[ev->fd] = ev;
 
         EVENT_DEBUG("Successed to add a event.");
 
         return 0;
 }
 
+/*
+ * unregister the event from the backend at once, but the backend
+ * may have reported it already in this round, so free it after
+ * all the ready events are handled.
+ */
 int event_delete(event_t *ev)
 {
+        if (is_event_added(ev)) {
+                backend->del(ev);
+        }
+
+        if (is_event_pending(ev)) {
+                queue_delete(&ev->pending);
+        }
+
+        if (ev_table[ev->fd] == ev) {
+                ev_table[ev->fd] = NULL;
+        }
+
         queue_delete(&ev->queue);
 
-        free(ev);
+        ev->flag = EVENT_FLAG_CLOSED;
+
+        queue_insert(closed_list, &ev->queue);
 
         return 0;
 }
 
-event_t *event_find_by_fd(int fd)
+/*
+ * change the flags of an event, tell the backend when the
+ * interest really changed.
+ */
+int event_set_flag(event_t *ev, unsigned int flag)
 {
-        event_t *ev;
-        queue_t *q;
+        int old = ev->flag;
 
-        for (q = ev_list->next; q != ev_list; q = q->next)
-        {
-                ev = queue_data(q, event_t, queue);
-                if (ev->fd == fd) {
-                        return ev;
-                }
+        if (!edge_trigger) {
+                flag &= ~EVENT_FLAG_EDGE;
         }
 
-        return NULL;
+        ev->flag |= flag;
+
+        if (ev->flag != old && is_event_added(ev)) {
+                return backend->mod(ev);
+        }
+
+        return 0;
 }
 
-int tick_add(tick_t *tc)
+int event_unset_flag(event_t *ev, unsigned int flag)
 {
-        queue_insert(tc_list, &tc->queue);
+        int old = ev->flag;
 
-        EVENT_DEBUG("Successed to add a tick.");
+        ev->flag &= ~flag;
+
+        if (ev->flag != old && is_event_added(ev)) {
+                return backend->mod(ev);
+        }
 
         return 0;
 }
 
-int tick_delete(tick_t *tc)
+/*
+ * fds are small numbers the kernel reuses, a dense table indexed
+ * by fd finds the event and its owner at once.
+ */
+event_t *event_find_by_fd(int fd)
 {
-        queue_delete(&tc->queue);
+        if (fd < 0 || fd >= ev_table_size) {
+                return NULL;
+        }
 
-        free(tc);
+        return ev_table[fd];
+}
 
-        return 0;
+/*
+ * the fd of an event is read and written here, the backend may have
+ * read it already, or write it later, else it is readv and writev.
+ */
+ssize_t event_read(event_t *ev, const struct iovec *iov, int n)
+{
+        if (backend->read && is_event_io(ev)) {
+                return backend->read(ev, iov, n);
+        }
+
+        return readv(ev->fd, iov, n);
 }
 
-int find_max_fd()
+ssize_t event_write(event_t *ev, const struct iovec *iov, int n)
 {
-        event_t *e;
-        queue_t *q;
-        int maxfd = 0;
+        if (backend->write && is_event_io(ev)) {
+                return backend->write(ev, iov, n);
+        }
+
+        return writev(ev->fd, iov, n);
+}
+
+static int event_table_grow(int fd)
+{
+        event_t **t;
+        int size = ev_table_size ? ev_table_size : 64;
 
-        for (q = ev_list->next; q != ev_list; q = q->next)
+        while (size <= fd)
         {
-                e = queue_data(q, event_t, queue);
-                if (e->fd > maxfd) {
-                        maxfd = e->fd;
-                }
+                size *= 2;
+        }
+
+        t = (event_t**) realloc(ev_table, size * sizeof(event_t*));
+        if (!t) {
+                EVENT_ERROR("Can not alloc memory for the event table.");
+                return -1;
         }
 
-        return maxfd;
+        memset(t + ev_table_size, 0, (size - ev_table_size) * sizeof(event_t*));
+
+        ev_table      = t;
+        ev_table_size = size;
+
+        return 0;
 }
 
-int handle_event(fd_set *rfd, fd_set *wfd)
+queue_t *event_list()
 {
-        event_t *ev;
-        queue_t *q;
-        
-        for (q = ev_list->next; q != ev_list; q = q->next)
-        {
-                ev = queue_data(q, event_t, queue);
+        return ev_list;
+}
+
+/*
+ * the backend call this function for every ready event,
+ * ready is made of EVENT_FLAG_READ, EVENT_FLAG_WRITE and
+ * EVENT_FLAG_ERROR. error and hang up go to the input callback,
+ * the read() there will find out what happened.
+ */
+int event_process(event_t *ev, int ready)
+{
+        int left = 0;
+
+        if (is_event_closed(ev)) {
+                return 0;
+        }
+
+        if ((ready & EVENT_FLAG_ERROR) ||
+            ((ready & EVENT_FLAG_READ) && is_event_read(ev))) {
+                if (event_drain(ev, ev->input, EVENT_FLAG_READ)) {
+                        left |= EVENT_FLAG_READ;
+                }
+        }
 
-                if (FD_ISSET(ev->fd, rfd)) {
-                        ev->input(ev);
+        if (is_event_closed(ev)) {
+                return 0;
+        }
+
+        if ((ready & EVENT_FLAG_WRITE) && is_event_write(ev)) {
+                if (event_drain(ev, ev->output, EVENT_FLAG_WRITE)) {
+                        left |= EVENT_FLAG_WRITE;
                 }
+        }
 
-                if (FD_ISSET(ev->fd, wfd)) {
-                        ev->output(ev);
+        if (left && !is_event_closed(ev)) {
+                ev->ready |= left;
+                if (!is_event_pending(ev)) {
+                        ev->flag |= EVENT_FLAG_PENDING;
+                        queue_insert_tail(pending_list, &ev->pending);
                 }
         }
 
         return 0;
 }
 
-#define USEC_TO_MSEC(tc) ((tc) * 1000)
-
-int handle_tick(struct timeval *tv)
+/*
+ * a level-triggered callback is called once, the backend will
+ * report it again if needed. an edge-triggered one will not, so
+ * keep calling it while it returns EVENT_AGAIN.
+ * return 1 if the budget is used up before the fd is drained.
+ */
+static int event_drain(event_t *ev, ev_cb_fn cb, unsigned int flag)
 {
-        tick_t  *tc;
-        queue_t *q;
+        int n;
 
-        for (q = tc_list->next; q != tc_list; q = q->next)
+        for (n = 0; n < EVENT_EDGE_BUDGET; n++)
         {
-                tc->time -= USEC_TO_MSEC(tv->tv_usec);
-                if (tc->time < 0) {
-                        tc->timeout(tc);
-                        tick_delete(tc);
+                if (cb(ev) != EVENT_AGAIN) {
+                        return 0;
+                }
+
+                if (is_event_closed(ev) || !is_event_edge(ev) || !(ev->flag & flag)) {
+                        return 0;
                 }
         }
 
-        return 0;
+        return 1;
 }
 
-int wait_select()
+static int event_process_pending()
 {
-        static struct timeval tv;
-        static fd_set readfd;
-        static fd_set writefd;
+        queue_t  head;
+        queue_t *q;
+        event_t *ev;
+        int ready;
+
+        if (queue_empty(pending_list)) {
+                return 0;
+        }
+
+        // take them all, event_process may put some of them back
+        queue_init(&head);
+        head.next       = pending_list->next;
+        head.prev       = pending_list->prev;
+        head.next->prev = &head;
+        head.prev->next = &head;
+        queue_init(pending_list);
+
+        while (!queue_empty(&head))
+        {
+                q  = queue_first(&head);
+                ev = queue_data(q, event_t, pending);
+
+                queue_delete(q);
+                ev->flag &= ~EVENT_FLAG_PENDING;
 
-        int selected;
+                ready     = ev->ready;
+                ev->ready = 0;
 
+                event_process(ev, ready);
+        }
+
+        return 0;
+}
+
+static int event_free_closed()
+{
         event_t *ev;
         queue_t *q;
 
-        FD_ZERO(&readfd);
-        FD_ZERO(&writefd);
-
-        for (q = ev_list->next; q != ev_list; q = q->next)
+        while (!queue_empty(closed_list))
         {
+                q  = queue_first(closed_list);
                 ev = queue_data(q, event_t, queue);
-                if (is_event_active(ev) && is_event_read(ev)) {
-                        FD_SET(ev->fd, &readfd);
-                }
-                if (is_event_active(ev) && is_event_write(ev)) {
-                        FD_SET(ev->fd, &writefd);
-                }
+                queue_delete(q);
+                event_free(ev);
         }
 
-        if (tv.tv_usec <= 0) {
-                tv.tv_sec  = 0;
-                tv.tv_usec = TICK_PERIOD;
-        }
+        return 0;
+}
+
+/*
+ * one round of the event loop, sleep until some io is ready or
+ * the nearest timer expire, then handle them all.
+ */
+int event_wait()
+{
+        int timeout;
 
-        // selected = select(find_max_fd()+1, &readfd, &writefd, NULL, &tv);
-        selected = select(find_max_fd()+1, &readfd, &writefd, NULL, NULL);
+        // events not drained last round go first
+        event_process_pending();
 
-        if (selected == -1) {           // error
-                EVENT_ERROR(strerror(errno));
-        } else if (selected == 0) {     // tick
-                handle_tick(&tv);
-        } else {                        // IO evnet
-                handle_event(&readfd, &writefd);
-                handle_tick(&tv);
+        // still something left, just poll the others
+        if (!queue_empty(pending_list)) {
+                timeout = 0;
+        } else {
+                timeout = tick_timeout();
         }
 
+        backend->wait(timeout);
+
+        tick_process();
+
+        event_free_closed();
+
         return 0;
 }
-
@@ -2,25 +2,54 @@
 #define _EVENT_H_
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "queue.h"
+#include "pool.h"
 
-#define event_create(ev)        ((ev) = (event_t*) malloc(sizeof(event_t)))
-#define tick_create(tc)         ((tc) = (tick_t*) malloc(sizeof(tick_t)))
+#define event_create(ev)        ((ev) = (event_t*) pool_alloc(POOL_EVENT))
+#define event_free(ev)          pool_free(POOL_EVENT, (ev))
 
 #define EVENT_FLAG_ACTIVE       0x01U
 #define EVENT_FLAG_READ         0x02U
 #define EVENT_FLAG_WRITE        0x04U
 #define EVENT_FLAG_ERROR        0x08U
-
-#define set_event_active(ev)    ((ev)->flag |= EVENT_FLAG_ACTIVE)
-#define set_event_read(ev)      ((ev)->flag |= EVENT_FLAG_READ)
-#define set_event_write(ev)     ((ev)->flag |= EVENT_FLAG_WRITE)
-#define set_event_error(ev)     ((ev)->flag |= EVENT_FLAG_ERROR)
-
-#define unset_event_active(ev)  ((ev)->flag &= ~EVENT_FLAG_ACTIVE)
-#define unset_event_read(ev)    ((ev)->flag &= ~EVENT_FLAG_READ)
-#define unset_event_write(ev)   ((ev)->flag &= ~EVENT_FLAG_WRITE)
-#define unset_event_error(ev)   ((ev)->flag &= ~EVENT_FLAG_ERROR)
+// the callbacks drain the fd until EAGAIN, edge-triggered is fine
+#define EVENT_FLAG_EDGE         0x10U
+// set by the event module only
+#define EVENT_FLAG_ADDED        0x20U
+#define EVENT_FLAG_CLOSED       0x40U
+#define EVENT_FLAG_PENDING      0x80U
+// the callbacks read and write the fd by event_read and event_write,
+// a backend able to do the io itself does it for them
+#define EVENT_FLAG_IO           0x100U
+
+#define set_event_active(ev)    event_set_flag((ev), EVENT_FLAG_ACTIVE)
+#define set_event_read(ev)      event_set_flag((ev), EVENT_FLAG_READ)
+#define set_event_write(ev)     event_set_flag((ev), EVENT_FLAG_WRITE)
+#define set_event_error(ev)     event_set_flag((ev), EVENT_FLAG_ERROR)
+#define set_event_edge(ev)      event_set_flag((ev), EVENT_FLAG_EDGE)
+#define set_event_io(ev)        event_set_flag((ev), EVENT_FLAG_IO)
+
+#define unset_event_active(ev)  event_unset_flag((ev), EVENT_FLAG_ACTIVE)
+#define unset_event_read(ev)    event_unset_flag((ev), EVENT_FLAG_READ)
+#define unset_event_write(ev)   event_unset_flag((ev), EVENT_FLAG_WRITE)
+#define unset_event_error(ev)   event_unset_flag((ev), EVENT_FLAG_ERROR)
+#define unset_event_edge(ev)    event_unset_flag((ev), EVENT_FLAG_EDGE)
+
+#define is_event_active(ev)     ((ev)->flag & EVENT_FLAG_ACTIVE)
+#define is_event_read(ev)       ((ev)->flag & EVENT_FLAG_READ)
+#define is_event_write(ev)      ((ev)->flag & EVENT_FLAG_WRITE)
+#define is_event_error(ev)      ((ev)->flag & EVENT_FLAG_ERROR)
+#define is_event_edge(ev)       ((ev)->flag & EVENT_FLAG_EDGE)
+#define is_event_added(ev)      ((ev)->flag & EVENT_FLAG_ADDED)
+#define is_event_closed(ev)     ((ev)->flag & EVENT_FLAG_CLOSED)
+#define is_event_pending(ev)    ((ev)->flag & EVENT_FLAG_PENDING)
+#define is_event_io(ev)         ((ev)->flag & EVENT_FLAG_IO)
+
+// an edge-triggered callback returns this while the fd may still
+// have data to read or room to write, the event module calls it again.
+#define EVENT_AGAIN             1
 
 typedef int dev_id_t;
 typedef struct event_s event_t;
@@ -37,36 +66,57 @@ struct event_s {
         ev_cb_fn input;
         ev_cb_fn output;
 
+        // owner of the event, an app_t or a device_t
+        void *data;
+
+        // readiness left over for the next round (edge-triggered)
+        int ready;
+
         queue_t queue;
+        queue_t pending;
 };
 
-typedef uint8_t ptc_id_t;
-typedef struct tick_s tick_t;
+typedef struct event_backend_s event_backend_t;
+struct event_backend_s {
+        char *name;
 
-// tick callback function
-typedef int (*tc_cb_fn)(tick_t *tc);
+        // support edge-triggered notification
+        int edge;
 
-struct tick_s {
-        ptc_id_t ptc;
+        int (*init)();
+        int (*exit)();
 
-        int time;       // ms
+        // register, unregister and update the interest of an event
+        int (*add)(event_t *ev);
+        int (*del)(event_t *ev);
+        int (*mod)(event_t *ev);
 
-        tc_cb_fn timeout;
+        // wait for io and process the ready events, timeout in ms,
+        // -1 means wait forever.
+        int (*wait)(int timeout);
 
-        queue_t queue;
+        // read and write an io event like readv and writev, from and
+        // to the io the backend did, NULL if it does none
+        ssize_t (*read)(event_t *ev, const struct iovec *iov, int n);
+        ssize_t (*write)(event_t *ev, const struct iovec *iov, int n);
 };
 
 // for core
 int event_init();
 int event_exit();
-int wait_select();
+int event_wait();
 
 // for other module
 int event_add(event_t *ev);
 int event_delete(event_t *ev);
-int tick_add(tick_t *tc);
-int tick_add(tick_t *tc);
+int event_set_flag(event_t *ev, unsigned int flag);
+int event_unset_flag(event_t *ev, unsigned int flag);
 event_t *event_find_by_fd(int fd);
+ssize_t event_read(event_t *ev, const struct iovec *iov, int n);
+ssize_t event_write(event_t *ev, const struct iovec *iov, int n);
 
-#endif // _EVENT_H_
+// for event backends
+queue_t *event_list();
+int event_process(event_t *ev, int ready);
 
+#endif // _EVENT_H_
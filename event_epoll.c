@@ -0,0 +1,156 @@
+/*
+ * event_epoll.c
+ *
+ * The epoll backend of the event module. Every change of interest
+ * is an epoll_ctl() call, the event pointer is kept in the epoll data,
+ * so a ready event goes to its callbacks without any search.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "event.h"
+#include "log.h"
+
+#define EVENT_ERROR(s) log_error("EVENT", (s))
+#define EVENT_WARN(s)  log_warn ("EVENT", (s))
+#define EVENT_INFO(s)  log_info ("EVENT", (s))
+#define EVENT_DEBUG(s) log_debug("EVENT", (s))
+
+#define EPOLL_MAX_EVENTS        256
+
+static int ev_epoll_init();
+static int ev_epoll_exit();
+static int ev_epoll_add(event_t *ev);
+static int ev_epoll_del(event_t *ev);
+static int ev_epoll_mod(event_t *ev);
+static int ev_epoll_wait(int timeout);
+
+event_backend_t epoll_backend = {
+        .name = "epoll",
+        .edge = 1,
+        .init = ev_epoll_init,
+        .exit = ev_epoll_exit,
+        .add  = ev_epoll_add,
+        .del  = ev_epoll_del,
+        .mod  = ev_epoll_mod,
+        .wait = ev_epoll_wait,
+};
+
+static __thread int epfd = -1;
+static __thread struct epoll_event ep_events[EPOLL_MAX_EVENTS];
+
+static int ev_epoll_init()
+{
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1) {
+                EVENT_ERROR(strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static int ev_epoll_exit()
+{
+        if (epfd != -1) {
+                close(epfd);
+                epfd = -1;
+        }
+
+        return 0;
+}
+
+static uint32_t ev_epoll_mask(event_t *ev)
+{
+        uint32_t mask = 0;
+
+        if (is_event_active(ev)) {
+                if (is_event_read(ev)) {
+                        mask |= EPOLLIN;
+                }
+                if (is_event_write(ev)) {
+                        mask |= EPOLLOUT;
+                }
+        }
+
+        if (is_event_edge(ev)) {
+                mask |= EPOLLET;
+        }
+
+        return mask;
+}
+
+static int ev_epoll_ctl(int op, event_t *ev)
+{
+        struct epoll_event ee;
+
+        ee.events   = ev_epoll_mask(ev);
+        ee.data.ptr = ev;
+
+        if (epoll_ctl(epfd, op, ev->fd, &ee) == -1) {
+                EVENT_ERROR(strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static int ev_epoll_add(event_t *ev)
+{
+        return ev_epoll_ctl(EPOLL_CTL_ADD, ev);
+}
+
+static int ev_epoll_del(event_t *ev)
+{
+        // the fd may be closed already, epoll removed it by itself
+        if (epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, NULL) == -1 &&
+            errno != EBADF && errno != ENOENT) {
+                EVENT_ERROR(strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static int ev_epoll_mod(event_t *ev)
+{
+        return ev_epoll_ctl(EPOLL_CTL_MOD, ev);
+}
+
+static int ev_epoll_wait(int timeout)
+{
+        uint32_t e;
+        int n, i, ready;
+
+        n = epoll_wait(epfd, ep_events, EPOLL_MAX_EVENTS, timeout);
+        if (n == -1) {
+                if (errno != EINTR) {
+                        EVENT_ERROR(strerror(errno));
+                        return -1;
+                }
+                return 0;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+                e     = ep_events[i].events;
+                ready = 0;
+
+                if (e & EPOLLIN) {
+                        ready |= EVENT_FLAG_READ;
+                }
+                if (e & EPOLLOUT) {
+                        ready |= EVENT_FLAG_WRITE;
+                }
+                if (e & (EPOLLERR | EPOLLHUP)) {
+                        ready |= EVENT_FLAG_ERROR;
+                }
+
+                event_process((event_t*) ep_events[i].data.ptr, ready);
+        }
+
+        return n;
+}
@@ -0,0 +1,187 @@
+/*
+ * event_select.c
+ *
+ * The select() backend of the event module, used when epoll is not
+ * available. It rebuilds the fd sets from the event list every round
+ * and can not watch any fd not less than FD_SETSIZE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include "event.h"
+#include "log.h"
+#include "queue.h"
+
+#define EVENT_ERROR(s) log_error("EVENT", (s))
+#define EVENT_WARN(s)  log_warn ("EVENT", (s))
+#define EVENT_INFO(s)  log_info ("EVENT", (s))
+#define EVENT_DEBUG(s) log_debug("EVENT", (s))
+
+typedef struct select_ready_s select_ready_t;
+struct select_ready_s {
+        event_t *ev;
+        int      ready;
+};
+
+static int ev_select_init();
+static int ev_select_exit();
+static int ev_select_add(event_t *ev);
+static int ev_select_del(event_t *ev);
+static int ev_select_mod(event_t *ev);
+static int ev_select_wait(int timeout);
+
+event_backend_t select_backend = {
+        .name = "select",
+        .edge = 0,
+        .init = ev_select_init,
+        .exit = ev_select_exit,
+        .add  = ev_select_add,
+        .del  = ev_select_del,
+        .mod  = ev_select_mod,
+        .wait = ev_select_wait,
+};
+
+// ready events of this round, the callbacks may add or delete
+// events, so do not call them while walking the event list.
+static __thread select_ready_t *ready_list;
+static __thread int ready_size;
+
+static int ev_select_init()
+{
+        return 0;
+}
+
+static int ev_select_exit()
+{
+        free(ready_list);
+
+        ready_list = NULL;
+        ready_size = 0;
+
+        return 0;
+}
+
+static int ev_select_add(event_t *ev)
+{
+        if (ev->fd < 0 || ev->fd >= FD_SETSIZE) {
+                logf_error("EVENT", "Can not select fd %d, FD_SETSIZE is %d.",
+                        ev->fd, FD_SETSIZE);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int ev_select_del(event_t *ev)
+{
+        return 0;
+}
+
+// the fd sets are built every round, nothing to do
+static int ev_select_mod(event_t *ev)
+{
+        return 0;
+}
+
+static int ev_select_ready(int n, event_t *ev, int ready)
+{
+        select_ready_t *r;
+        int size;
+
+        if (n == ready_size) {
+                size = ready_size ? ready_size * 2 : 64;
+                r = (select_ready_t*) realloc(ready_list, size * sizeof(select_ready_t));
+                if (!r) {
+                        EVENT_ERROR("Can not alloc memory for ready events.");
+                        return -1;
+                }
+                ready_list = r;
+                ready_size = size;
+        }
+
+        ready_list[n].ev    = ev;
+        ready_list[n].ready = ready;
+
+        return 0;
+}
+
+static int ev_select_wait(int timeout)
+{
+        static __thread fd_set readfd;
+        static __thread fd_set writefd;
+
+        struct timeval tv, *tvp = NULL;
+        int selected, maxfd = -1, ready, n, i;
+
+        event_t *ev;
+        queue_t *q, *h = event_list();
+
+        FD_ZERO(&readfd);
+        FD_ZERO(&writefd);
+
+        for (q = h->next; q != h; q = q->next)
+        {
+                ev = queue_data(q, event_t, queue);
+                if (!is_event_active(ev)) {
+                        continue;
+                }
+                if (is_event_read(ev)) {
+                        FD_SET(ev->fd, &readfd);
+                }
+                if (is_event_write(ev)) {
+                        FD_SET(ev->fd, &writefd);
+                }
+                if ((is_event_read(ev) || is_event_write(ev)) && ev->fd > maxfd) {
+                        maxfd = ev->fd;
+                }
+        }
+
+        if (timeout >= 0) {
+                tv.tv_sec  = timeout / 1000;
+                tv.tv_usec = (timeout % 1000) * 1000;
+                tvp = &tv;
+        }
+
+        selected = select(maxfd+1, &readfd, &writefd, NULL, tvp);
+
+        if (selected == -1) {           // error
+                if (errno != EINTR) {
+                        EVENT_ERROR(strerror(errno));
+                        return -1;
+                }
+                return 0;
+        } else if (selected == 0) {     // timeout
+                return 0;
+        }
+
+        n = 0;
+        for (q = h->next; q != h && n < selected; q = q->next)
+        {
+                ev = queue_data(q, event_t, queue);
+
+                ready = 0;
+                if (FD_ISSET(ev->fd, &readfd)) {
+                        ready |= EVENT_FLAG_READ;
+                }
+                if (FD_ISSET(ev->fd, &writefd)) {
+                        ready |= EVENT_FLAG_WRITE;
+                }
+
+                if (ready) {
+                        if (ev_select_ready(n, ev, ready) == -1) {
+                                break;
+                        }
+                        n++;
+                }
+        }
+
+        for (i = 0; i < n; i++)
+        {
+                event_process(ready_list[i].ev, ready_list[i].ready);
+        }
+
+        return n;
+}
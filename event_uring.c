@@ -0,0 +1,1315 @@
+/*
+ * event_uring.c
+ *
+ * The io_uring backend of the event module. Every event has a poll
+ * request posted in the ring, changes of interest only queue
+ * submissions, and all of them go to the kernel together with the
+ * wait for completions, one io_uring_enter() per round.
+ *
+ * Edge-triggered events keep a multishot poll, which posts a
+ * completion on every wakeup of the fd. Level-triggered events use a
+ * oneshot poll armed again after it completes, so the callbacks that
+ * read only once still see what is left in the fd.
+ *
+ * An io event, a client socket or a modem port, has no poll. A
+ * multishot recv stays posted on a socket, a read on any other fd is
+ * posted again once it completes, both into buffers the ring takes
+ * from a provided buffer ring. What they got waits for event_read.
+ * event_write copies into a staging buffer of the event, the write
+ * goes to the kernel with the next round's submissions, one more is
+ * posted when it completes. The event is ready to read while it has
+ * data, and to write while its staging buffer has room.
+ *
+ * Every byte is copied once more than with readv and writev. That is
+ * what event_read and event_write promise: the caller's buffers are
+ * its own only for the call, a client hands its packets on as soon as
+ * they are read and drops what a write took. A read posted into them
+ * would pin a packet chain in the ring for every idle connection, the
+ * provided buffers are 1 MB shared by all of them. bench/event_bench
+ * moves a stream through each backend, memcpy takes the same bytes
+ * 20 to 30 times faster, the copy is some 5% of a byte's cost.
+ *
+ * The kernel may not have io_uring, or forbid it, init fails then and
+ * the event module falls back to the other backends. Without provided
+ * buffer rings, kernel 5.19, io events are polled like the others.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "event.h"
+#include "log.h"
+#include "queue.h"
+
+#define EVENT_ERROR(s) log_error("EVENT", (s))
+#define EVENT_WARN(s)  log_warn ("EVENT", (s))
+#define EVENT_INFO(s)  log_info ("EVENT", (s))
+#define EVENT_DEBUG(s) log_debug("EVENT", (s))
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES           256
+#define URING_MAX_CQES          256
+
+// the provided buffers the reads of io events go to
+#define URING_BUFFERS           256             // a power of 2
+#define URING_BUFFER_SIZE       4096
+#define URING_BUFFER_GROUP      0
+
+// staging buffer of the writes of an io event, a socket takes more
+// at once than a tty, whose output buffer is about a page
+#define URING_SOCK_STAGE        16384
+#define URING_FILE_STAGE        4096
+
+// the low 2 bits of the user data tell the request, a poll carries
+// the fd and its generation, an io request its uring_io_t
+#define URING_DATA_POLL         0
+#define URING_DATA_READ         1
+#define URING_DATA_WRITE        2
+#define URING_DATA_KIND(d)      ((d) & 3)
+
+// user data of the requests nobody waits for
+#define URING_DATA_IGNORE       UINT64_MAX
+
+#define URING_DATA(fd, gen)     (((uint64_t) (gen) << 32) | ((uint32_t) (fd) << 2))
+#define URING_DATA_FD(d)        ((int) (((d) & 0xFFFFFFFFU) >> 2))
+#define URING_DATA_GEN(d)       ((uint32_t) ((d) >> 32))
+
+#define URING_DATA_IO(io, kind) ((uint64_t) (uintptr_t) (io) | (kind))
+#define URING_IO(d)             ((uring_io_t*) (uintptr_t) ((d) & ~(uint64_t) 3))
+
+typedef struct uring_io_s uring_io_t;
+
+/*
+ * the poll request of a fd, a completion with an old generation
+ * belongs to a request removed already. an io event has its io
+ * instead.
+ */
+typedef struct uring_slot_s uring_slot_t;
+struct uring_slot_s {
+        event_t *ev;
+        uint32_t gen;
+        uint32_t mask;          // mask of the poll posted, 0 if none
+        int      multi;
+
+        uring_io_t *io;
+};
+
+/*
+ * the reads and writes of an io event. when the event is deleted the
+ * io stays until its requests in the ring complete, with a dup of the
+ * fd if it still has bytes to write.
+ */
+struct uring_io_s {
+        event_t *ev;            // NULL once the event is deleted
+        int      fd;
+        int      sock;
+        int      dup;
+
+        // buffers read and not taken yet, in order, linked by
+        // buf_next, rx_off bytes of the first one taken already
+        int      rx_head;
+        int      rx_tail;
+        int      rx_off;
+        int      rx_posted;     // a read is in the ring
+        int      rx_cancel;     // and it is being cancelled
+        int      rx_eof;
+        int      rx_err;
+
+        // bytes woff to wlen of wbuf are not written yet, wsent of
+        // them are in the ring
+        char    *wbuf;
+        int      wsize;
+        int      woff;
+        int      wlen;
+        int      wsent;
+        int      werr;
+
+        int      busy;          // its callbacks are running
+
+        // to be reported next round
+        int      on_ready;
+        queue_t  ready;
+
+        // its read ran out of buffers, posted again when one is back
+        int      starved;
+        queue_t  starve;
+
+        queue_t  queue;
+};
+
+typedef struct uring_s uring_t;
+struct uring_s {
+        int fd;
+
+        // submission queue
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        unsigned  sq_entries;
+        unsigned  to_submit;
+
+        // completion queue
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void   *sq_ring;
+        size_t  sq_ring_size;
+        void   *cq_ring;
+        size_t  cq_ring_size;
+        size_t  sqes_size;
+};
+
+typedef struct uring_cqe_s uring_cqe_t;
+struct uring_cqe_s {
+        uint64_t data;
+        int32_t  res;
+        uint32_t flags;
+};
+
+static int ev_uring_init();
+static int ev_uring_exit();
+static int ev_uring_add(event_t *ev);
+static int ev_uring_del(event_t *ev);
+static int ev_uring_mod(event_t *ev);
+static int ev_uring_wait(int timeout);
+static ssize_t ev_uring_read(event_t *ev, const struct iovec *iov, int n);
+static ssize_t ev_uring_write(event_t *ev, const struct iovec *iov, int n);
+static int uring_buf_init();
+static void uring_buf_put(int bid);
+static void uring_io_want(uring_io_t *io);
+static void uring_io_release(uring_io_t *io);
+
+event_backend_t uring_backend = {
+        .name  = "io_uring",
+        .edge  = 1,
+        .init  = ev_uring_init,
+        .exit  = ev_uring_exit,
+        .add   = ev_uring_add,
+        .del   = ev_uring_del,
+        .mod   = ev_uring_mod,
+        .wait  = ev_uring_wait,
+        .read  = ev_uring_read,
+        .write = ev_uring_write,
+};
+
+static __thread uring_t ring = { .fd = -1 };
+
+// poll requests indexed by fd
+static __thread uring_slot_t *slots;
+static __thread int slots_size;
+
+// oneshot polls completed, post them again before the next wait
+static __thread int *rearm;
+static __thread int rearm_len;
+static __thread int rearm_size;
+
+static __thread uring_cqe_t cqes[URING_MAX_CQES];
+
+// the provided buffer ring, 0 if the kernel has none and io events
+// are polled
+static __thread int io_enabled;
+static __thread struct io_uring_buf_ring *buf_ring;
+static __thread char *buf_mem;
+static __thread uint16_t buf_tail;
+static __thread int buf_next[URING_BUFFERS];
+static __thread int buf_len[URING_BUFFERS];
+
+// a kernel before 6.0 has no multishot recv
+static __thread int recv_multi;
+
+// all the ios, the ones to report next round, and the ones whose
+// read ran out of buffers
+static __thread queue_t io_list;
+static __thread queue_t io_ready;
+static __thread queue_t io_starved;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete,
+                       unsigned flags, void *arg, size_t argsz)
+{
+        return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                       flags, arg, argsz);
+}
+
+static int uring_submit()
+{
+        int n;
+
+        while (ring.to_submit)
+        {
+                n = uring_enter(ring.to_submit, 0, 0, NULL, 0);
+                if (n == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        EVENT_ERROR(strerror(errno));
+                        return -1;
+                }
+                ring.to_submit -= n;
+        }
+
+        return 0;
+}
+
+/*
+ * get a free submission entry, if the queue is full, hand what
+ * is queued to the kernel first.
+ */
+static struct io_uring_sqe *uring_get_sqe()
+{
+        struct io_uring_sqe *sqe;
+        unsigned head, tail;
+
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        tail = *ring.sq_tail;
+
+        if (tail - head >= ring.sq_entries) {
+                if (uring_submit() == -1) {
+                        return NULL;
+                }
+                head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+                if (tail - head >= ring.sq_entries) {
+                        return NULL;
+                }
+        }
+
+        sqe = &ring.sqes[tail & *ring.sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+
+        ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+        __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring.to_submit++;
+
+        return sqe;
+}
+
+static int ev_uring_init()
+{
+        struct io_uring_params p;
+        void *sq, *cq, *sqes;
+
+        memset(&p, 0, sizeof(p));
+
+        ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        if (ring.fd == -1) {
+                logf_warn("EVENT", "Can not setup io_uring: %s.", strerror(errno));
+                return -1;
+        }
+
+        // the wait with timeout needs it, kernel 5.11
+        if (!(p.features & IORING_FEAT_EXT_ARG)) {
+                EVENT_WARN("The io_uring of this kernel is too old.");
+                close(ring.fd);
+                ring.fd = -1;
+                return -1;
+        }
+
+        ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        ring.sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring.cq_ring_size > ring.sq_ring_size) {
+                        ring.sq_ring_size = ring.cq_ring_size;
+                }
+                ring.cq_ring_size = ring.sq_ring_size;
+        }
+
+        sq = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) {
+                goto error;
+        }
+        ring.sq_ring = sq;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                cq = sq;
+        } else {
+                cq = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+                if (cq == MAP_FAILED) {
+                        goto error;
+                }
+        }
+        ring.cq_ring = cq;
+
+        sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+                goto error;
+        }
+
+        ring.sq_head    = (unsigned*) ((char*) sq + p.sq_off.head);
+        ring.sq_tail    = (unsigned*) ((char*) sq + p.sq_off.tail);
+        ring.sq_mask    = (unsigned*) ((char*) sq + p.sq_off.ring_mask);
+        ring.sq_array   = (unsigned*) ((char*) sq + p.sq_off.array);
+        ring.sqes       = (struct io_uring_sqe*) sqes;
+        ring.sq_entries = p.sq_entries;
+        ring.to_submit  = 0;
+
+        ring.cq_head    = (unsigned*) ((char*) cq + p.cq_off.head);
+        ring.cq_tail    = (unsigned*) ((char*) cq + p.cq_off.tail);
+        ring.cq_mask    = (unsigned*) ((char*) cq + p.cq_off.ring_mask);
+        ring.cqes       = (struct io_uring_cqe*) ((char*) cq + p.cq_off.cqes);
+
+        queue_init(&io_list);
+        queue_init(&io_ready);
+        queue_init(&io_starved);
+
+        io_enabled = uring_buf_init() == 0;
+        recv_multi = 1;
+
+        return 0;
+
+error:
+        logf_warn("EVENT", "Can not map io_uring: %s.", strerror(errno));
+        ev_uring_exit();
+
+        return -1;
+}
+
+/*
+ * the buffers the reads take, in a ring shared with the kernel.
+ */
+static int uring_buf_init()
+{
+        struct io_uring_buf_reg reg;
+        int i;
+
+        buf_ring = (struct io_uring_buf_ring*) mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+                                                    PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_ring == MAP_FAILED) {
+                buf_ring = NULL;
+                return -1;
+        }
+
+        buf_mem = (char*) malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+        if (!buf_mem) {
+                goto error;
+        }
+
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr    = (uint64_t) (uintptr_t) buf_ring;
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid         = URING_BUFFER_GROUP;
+
+        if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+                logf_info("EVENT", "No provided buffers in io_uring, %s, poll io events.", strerror(errno));
+                goto error;
+        }
+
+        buf_tail = 0;
+        for (i = 0; i < URING_BUFFERS; i++)
+        {
+                uring_buf_put(i);
+        }
+
+        return 0;
+
+error:
+        free(buf_mem);
+        buf_mem = NULL;
+        munmap(buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+        buf_ring = NULL;
+
+        return -1;
+}
+
+/*
+ * give a buffer back to the kernel, a read that ran out of them
+ * may go on.
+ */
+static void uring_buf_put(int bid)
+{
+        struct io_uring_buf *b = &buf_ring->bufs[buf_tail & (URING_BUFFERS - 1)];
+        uring_io_t *io;
+
+        b->addr = (uint64_t) (uintptr_t) (buf_mem + bid * URING_BUFFER_SIZE);
+        b->len  = URING_BUFFER_SIZE;
+        b->bid  = bid;
+
+        __atomic_store_n(&buf_ring->tail, ++buf_tail, __ATOMIC_RELEASE);
+
+        while (!queue_empty(&io_starved))
+        {
+                io = queue_data(queue_first(&io_starved), uring_io_t, starve);
+                queue_delete(&io->starve);
+                io->starved = 0;
+                uring_io_want(io);
+        }
+}
+
+static int ev_uring_exit()
+{
+        uring_io_t *io;
+
+        // the requests in the ring go with it
+        if (io_list.next) {
+                while (!queue_empty(&io_list))
+                {
+                        io = queue_data(queue_first(&io_list), uring_io_t, queue);
+                        queue_delete(&io->queue);
+                        if (io->dup) {
+                                close(io->fd);
+                        }
+                        free(io->wbuf);
+                        free(io);
+                }
+        }
+
+        if (ring.sqes) {
+                munmap(ring.sqes, ring.sqes_size);
+        }
+        if (ring.cq_ring && ring.cq_ring != ring.sq_ring) {
+                munmap(ring.cq_ring, ring.cq_ring_size);
+        }
+        if (ring.sq_ring) {
+                munmap(ring.sq_ring, ring.sq_ring_size);
+        }
+        if (ring.fd != -1) {
+                close(ring.fd);
+        }
+
+        memset(&ring, 0, sizeof(ring));
+        ring.fd = -1;
+
+        free(slots);
+        slots      = NULL;
+        slots_size = 0;
+
+        free(rearm);
+        rearm      = NULL;
+        rearm_len  = 0;
+        rearm_size = 0;
+
+        if (buf_ring) {
+                munmap(buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+                buf_ring = NULL;
+        }
+        free(buf_mem);
+        buf_mem    = NULL;
+        io_enabled = 0;
+
+        return 0;
+}
+
+static uint32_t ev_uring_mask(event_t *ev)
+{
+        uint32_t mask = 0;
+
+        if (is_event_active(ev)) {
+                if (is_event_read(ev)) {
+                        mask |= POLLIN;
+                }
+                if (is_event_write(ev)) {
+                        mask |= POLLOUT;
+                }
+        }
+
+        return mask;
+}
+
+static int ev_uring_post(int fd)
+{
+        struct io_uring_sqe *sqe;
+        uring_slot_t *s = &slots[fd];
+        uint32_t mask = ev_uring_mask(s->ev);
+
+        if (!mask) {
+                s->mask = 0;
+                return 0;
+        }
+
+        sqe = uring_get_sqe();
+        if (!sqe) {
+                EVENT_ERROR("Can not get an io_uring submission entry.");
+                return -1;
+        }
+
+        s->gen++;
+        s->mask  = mask;
+        s->multi = is_event_edge(s->ev) ? 1 : 0;
+
+        sqe->opcode        = IORING_OP_POLL_ADD;
+        sqe->fd            = fd;
+        sqe->poll32_events = mask;
+        sqe->len           = s->multi ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data     = URING_DATA(fd, s->gen);
+
+        return 0;
+}
+
+static int ev_uring_cancel(int fd)
+{
+        struct io_uring_sqe *sqe;
+        uring_slot_t *s = &slots[fd];
+
+        if (!s->mask) {
+                return 0;
+        }
+
+        sqe = uring_get_sqe();
+        if (!sqe) {
+                EVENT_ERROR("Can not get an io_uring submission entry.");
+                return -1;
+        }
+
+        sqe->opcode    = IORING_OP_POLL_REMOVE;
+        sqe->fd        = -1;
+        sqe->addr      = URING_DATA(fd, s->gen);
+        sqe->user_data = URING_DATA_IGNORE;
+
+        // the completions of the old request are stale from now on
+        s->gen++;
+        s->mask = 0;
+
+        return 0;
+}
+
+/*
+ * the io of an event, NULL if it is polled.
+ */
+static uring_io_t *uring_io_find(event_t *ev)
+{
+        if (ev->fd >= slots_size || slots[ev->fd].ev != ev) {
+                return NULL;
+        }
+
+        return slots[ev->fd].io;
+}
+
+static int uring_io_readable(uring_io_t *io)
+{
+        return is_event_active(io->ev) && is_event_read(io->ev) &&
+               (io->rx_head != -1 || io->rx_eof || io->rx_err);
+}
+
+// a write in the ring pins the bytes from woff on, else they move
+// to the front
+static int uring_io_room(uring_io_t *io)
+{
+        return io->wsize - (io->wsent ? io->wlen : io->wlen - io->woff);
+}
+
+static int uring_io_writable(uring_io_t *io)
+{
+        return is_event_active(io->ev) && is_event_write(io->ev) &&
+               (uring_io_room(io) > 0 || io->werr);
+}
+
+/*
+ * report the io next round.
+ */
+static void uring_io_ready(uring_io_t *io)
+{
+        if (io->ev && !io->on_ready) {
+                io->on_ready = 1;
+                queue_insert_tail(&io_ready, &io->ready);
+        }
+}
+
+static int uring_io_post_read(uring_io_t *io)
+{
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe();
+        if (!sqe) {
+                EVENT_ERROR("Can not get an io_uring submission entry.");
+                return -1;
+        }
+
+        // a recv goes on posting buffers, a read of a tty is one
+        if (io->sock) {
+                sqe->opcode = IORING_OP_RECV;
+                sqe->ioprio = recv_multi ? IORING_RECV_MULTISHOT : 0;
+        } else {
+                sqe->opcode = IORING_OP_READ;
+                sqe->off    = (uint64_t) -1;
+        }
+
+        sqe->fd        = io->fd;
+        sqe->len       = URING_BUFFER_SIZE;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = URING_DATA_IO(io, URING_DATA_READ);
+
+        io->rx_posted = 1;
+
+        return 0;
+}
+
+static int uring_io_post_write(uring_io_t *io)
+{
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe();
+        if (!sqe) {
+                EVENT_ERROR("Can not get an io_uring submission entry.");
+                return -1;
+        }
+
+        if (io->sock) {
+                sqe->opcode    = IORING_OP_SEND;
+                sqe->msg_flags = MSG_NOSIGNAL;
+        } else {
+                sqe->opcode    = IORING_OP_WRITE;
+                sqe->off       = (uint64_t) -1;
+        }
+
+        sqe->fd        = io->fd;
+        sqe->addr      = (uint64_t) (uintptr_t) (io->wbuf + io->woff);
+        sqe->len       = io->wlen - io->woff;
+        sqe->user_data = URING_DATA_IO(io, URING_DATA_WRITE);
+
+        io->wsent = io->wlen - io->woff;
+
+        return 0;
+}
+
+static int uring_io_cancel_read(uring_io_t *io)
+{
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe();
+        if (!sqe) {
+                EVENT_ERROR("Can not get an io_uring submission entry.");
+                return -1;
+        }
+
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->fd        = -1;
+        sqe->addr      = URING_DATA_IO(io, URING_DATA_READ);
+        sqe->user_data = URING_DATA_IGNORE;
+
+        io->rx_cancel = 1;
+
+        return 0;
+}
+
+/*
+ * a read is in the ring while the event wants to read and the fd
+ * has not reached its end, so a paused client is left to TCP.
+ */
+static void uring_io_want(uring_io_t *io)
+{
+        int want = io->ev && is_event_active(io->ev) && is_event_read(io->ev) &&
+                   !io->rx_eof && !io->rx_err;
+
+        if (want && !io->rx_posted && !io->starved) {
+                uring_io_post_read(io);
+        } else if (!want && io->rx_posted && !io->rx_cancel) {
+                uring_io_cancel_read(io);
+        }
+}
+
+static uring_io_t *uring_io_create(event_t *ev)
+{
+        struct stat st;
+        uring_io_t *io;
+
+        io = (uring_io_t*) calloc(1, sizeof(uring_io_t));
+        if (!io) {
+                EVENT_ERROR("Can not alloc memory for an io_uring io.");
+                return NULL;
+        }
+
+        io->ev      = ev;
+        io->fd      = ev->fd;
+        io->sock    = fstat(ev->fd, &st) == 0 && S_ISSOCK(st.st_mode);
+        io->wsize   = io->sock ? URING_SOCK_STAGE : URING_FILE_STAGE;
+        io->rx_head = -1;
+        io->rx_tail = -1;
+
+        queue_insert(&io_list, &io->queue);
+
+        return io;
+}
+
+/*
+ * the event is deleted, its buffers read go back, its read is
+ * cancelled, the bytes it still has to write go on with a dup of
+ * the fd, which its owner closes now.
+ */
+static void uring_io_detach(uring_io_t *io)
+{
+        int bid;
+
+        io->ev = NULL;
+
+        if (io->on_ready) {
+                queue_delete(&io->ready);
+                io->on_ready = 0;
+        }
+
+        if (io->starved) {
+                queue_delete(&io->starve);
+                io->starved = 0;
+        }
+
+        while ((bid = io->rx_head) != -1)
+        {
+                io->rx_head = buf_next[bid];
+                uring_buf_put(bid);
+        }
+
+        if (io->rx_posted && !io->rx_cancel) {
+                uring_io_cancel_read(io);
+        }
+
+        if (io->wlen > io->woff && !io->werr) {
+                io->fd = dup(io->fd);
+                if (io->fd == -1) {
+                        io->wlen = io->woff + io->wsent;
+                } else {
+                        io->dup = 1;
+                }
+        }
+
+        uring_io_release(io);
+}
+
+/*
+ * free an io of a deleted event once nothing of it is in the ring.
+ */
+static void uring_io_release(uring_io_t *io)
+{
+        if (io->ev || io->busy || io->rx_posted || io->wsent) {
+                return;
+        }
+
+        if (io->dup) {
+                close(io->fd);
+        }
+
+        queue_delete(&io->queue);
+        free(io->wbuf);
+        free(io);
+}
+
+/*
+ * a read completed, its buffer waits for event_read. the end of the
+ * fd or an error waits behind the data read before.
+ */
+static void uring_io_read_done(uring_io_t *io, int res, uint32_t flags)
+{
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (!(flags & IORING_CQE_F_MORE)) {
+                io->rx_posted = 0;
+                io->rx_cancel = 0;
+        }
+
+        if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+                if (!io->ev) {
+                        uring_buf_put(bid);
+                } else {
+                        buf_len[bid]  = res;
+                        buf_next[bid] = -1;
+                        if (io->rx_head == -1) {
+                                io->rx_head = bid;
+                                io->rx_off  = 0;
+                        } else {
+                                buf_next[io->rx_tail] = bid;
+                        }
+                        io->rx_tail = bid;
+                }
+        } else if (res == 0) {
+                io->rx_eof = 1;
+        } else if (res == -ENOBUFS) {
+                if (io->ev && !io->starved) {
+                        io->starved = 1;
+                        queue_insert_tail(&io_starved, &io->starve);
+                }
+        } else if (res == -EINVAL && io->sock && recv_multi) {
+                EVENT_INFO("No multishot recv in io_uring, post a recv at a time.");
+                recv_multi = 0;
+        } else if (res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+                io->rx_err = -res;
+        }
+
+        if (!io->ev) {
+                uring_io_release(io);
+                return;
+        }
+
+        if (!io->rx_posted) {
+                uring_io_want(io);
+        }
+
+        uring_io_ready(io);
+}
+
+/*
+ * a write completed, the rest of the staging buffer goes next.
+ */
+static void uring_io_write_done(uring_io_t *io, int res)
+{
+        io->wsent = 0;
+
+        // a signal may stop a blocking write on a tty, that is not
+        // its end, the same bytes go again
+        if (res > 0) {
+                io->woff += res;
+        } else if (res != -EINTR && res != -EAGAIN) {
+                io->werr = res ? -res : EPIPE;
+                io->woff = io->wlen;
+        }
+
+        if (io->woff == io->wlen) {
+                io->woff = 0;
+                io->wlen = 0;
+        } else if (uring_io_post_write(io) == -1) {
+                io->werr = EIO;
+                io->woff = 0;
+                io->wlen = 0;
+        }
+
+        if (!io->ev) {
+                uring_io_release(io);
+                return;
+        }
+
+        uring_io_ready(io);
+}
+
+/*
+ * call back the io events with something to read or room to write,
+ * the ones still ready afterwards go on next round.
+ */
+static int uring_io_process()
+{
+        queue_t     head;
+        uring_io_t *io;
+        int         ready;
+
+        if (queue_empty(&io_ready)) {
+                return 0;
+        }
+
+        // take them all, the callbacks may put some of them back
+        head.next       = io_ready.next;
+        head.prev       = io_ready.prev;
+        head.next->prev = &head;
+        head.prev->next = &head;
+        queue_init(&io_ready);
+
+        while (!queue_empty(&head))
+        {
+                io = queue_data(queue_first(&head), uring_io_t, ready);
+                queue_delete(&io->ready);
+                io->on_ready = 0;
+
+                ready = 0;
+                if (uring_io_readable(io)) {
+                        ready |= EVENT_FLAG_READ;
+                }
+                if (uring_io_writable(io)) {
+                        ready |= EVENT_FLAG_WRITE;
+                }
+                if (!ready) {
+                        continue;
+                }
+
+                io->busy++;
+                event_process(io->ev, ready);
+                io->busy--;
+
+                if (!io->ev) {
+                        uring_io_release(io);
+                } else if (uring_io_readable(io) || uring_io_writable(io)) {
+                        uring_io_ready(io);
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * take what the reads got, buffer by buffer, like readv.
+ */
+static ssize_t ev_uring_read(event_t *ev, const struct iovec *iov, int n)
+{
+        uring_io_t *io = uring_io_find(ev);
+        ssize_t     total = 0;
+        size_t      done, len;
+        int         i, bid;
+
+        if (!io) {
+                return readv(ev->fd, iov, n);
+        }
+
+        if (io->rx_head == -1) {
+                if (io->rx_err) {
+                        errno = io->rx_err;
+                        return -1;
+                } else if (io->rx_eof) {
+                        return 0;
+                }
+                errno = EAGAIN;
+                return -1;
+        }
+
+        for (i = 0; i < n && io->rx_head != -1; i++)
+        {
+                done = 0;
+                while (done < iov[i].iov_len && (bid = io->rx_head) != -1)
+                {
+                        len = buf_len[bid] - io->rx_off;
+                        if (len > iov[i].iov_len - done) {
+                                len = iov[i].iov_len - done;
+                        }
+
+                        memcpy((char*) iov[i].iov_base + done,
+                               buf_mem + bid * URING_BUFFER_SIZE + io->rx_off, len);
+                        done       += len;
+                        io->rx_off += len;
+
+                        if (io->rx_off == buf_len[bid]) {
+                                io->rx_head = buf_next[bid];
+                                io->rx_off  = 0;
+                                uring_buf_put(bid);
+                        }
+                }
+                total += done;
+        }
+
+        return total;
+}
+
+/*
+ * stage what fits, like writev to a socket, it is written with the
+ * next round's submissions.
+ */
+static ssize_t ev_uring_write(event_t *ev, const struct iovec *iov, int n)
+{
+        uring_io_t *io = uring_io_find(ev);
+        ssize_t     total = 0;
+        size_t      len;
+        int         i;
+
+        if (!io) {
+                return writev(ev->fd, iov, n);
+        }
+
+        if (io->werr) {
+                errno = io->werr;
+                return -1;
+        }
+
+        if (!io->wbuf) {
+                io->wbuf = (char*) malloc(io->wsize);
+                if (!io->wbuf) {
+                        EVENT_ERROR("Can not alloc memory for an io_uring staging buffer.");
+                        errno = ENOMEM;
+                        return -1;
+                }
+        }
+
+        if (!io->wsent && io->woff) {
+                memmove(io->wbuf, io->wbuf + io->woff, io->wlen - io->woff);
+                io->wlen -= io->woff;
+                io->woff  = 0;
+        }
+
+        for (i = 0; i < n && io->wlen < io->wsize; i++)
+        {
+                len = iov[i].iov_len;
+                if (len > (size_t) (io->wsize - io->wlen)) {
+                        len = io->wsize - io->wlen;
+                }
+
+                memcpy(io->wbuf + io->wlen, iov[i].iov_base, len);
+                io->wlen += len;
+                total    += len;
+        }
+
+        if (!total) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        if (!io->wsent && uring_io_post_write(io) == -1) {
+                io->wlen -= total;
+                errno = EAGAIN;
+                return -1;
+        }
+
+        return total;
+}
+
+static int ev_uring_add(event_t *ev)
+{
+        uring_slot_t *s;
+        int size;
+
+        if (ev->fd >= slots_size) {
+                size = slots_size ? slots_size : 64;
+                while (size <= ev->fd)
+                {
+                        size *= 2;
+                }
+
+                s = (uring_slot_t*) realloc(slots, size * sizeof(uring_slot_t));
+                if (!s) {
+                        EVENT_ERROR("Can not alloc memory for io_uring slots.");
+                        return -1;
+                }
+
+                memset(s + slots_size, 0, (size - slots_size) * sizeof(uring_slot_t));
+                slots      = s;
+                slots_size = size;
+        }
+
+        slots[ev->fd].ev   = ev;
+        slots[ev->fd].mask = 0;
+        slots[ev->fd].io   = NULL;
+
+        if (!is_event_io(ev) || !io_enabled) {
+                return ev_uring_post(ev->fd);
+        }
+
+        s = &slots[ev->fd];
+
+        s->io = uring_io_create(ev);
+        if (!s->io) {
+                s->ev = NULL;
+                return -1;
+        }
+
+        uring_io_want(s->io);
+        if (uring_io_writable(s->io)) {
+                uring_io_ready(s->io);
+        }
+
+        return 0;
+}
+
+static int ev_uring_del(event_t *ev)
+{
+        uring_slot_t *s;
+
+        if (ev->fd >= slots_size || slots[ev->fd].ev != ev) {
+                return 0;
+        }
+
+        s = &slots[ev->fd];
+
+        if (s->io) {
+                uring_io_detach(s->io);
+                s->io = NULL;
+        } else {
+                ev_uring_cancel(ev->fd);
+        }
+
+        s->ev = NULL;
+
+        return 0;
+}
+
+static int ev_uring_mod(event_t *ev)
+{
+        uring_slot_t *s;
+
+        if (ev->fd >= slots_size || slots[ev->fd].ev != ev) {
+                return 0;
+        }
+
+        s = &slots[ev->fd];
+
+        // an io reads while the event reads, and may be ready at once
+        if (s->io) {
+                uring_io_want(s->io);
+                if (uring_io_readable(s->io) || uring_io_writable(s->io)) {
+                        uring_io_ready(s->io);
+                }
+                return 0;
+        }
+
+        // same request still posted, nothing to do
+        if (s->mask && s->mask == ev_uring_mask(ev) &&
+            s->multi == (is_event_edge(ev) ? 1 : 0)) {
+                return 0;
+        }
+
+        if (ev_uring_cancel(ev->fd) == -1) {
+                return -1;
+        }
+
+        return ev_uring_post(ev->fd);
+}
+
+static int ev_uring_rearm_later(int fd)
+{
+        int *r;
+        int size;
+
+        if (rearm_len == rearm_size) {
+                size = rearm_size ? rearm_size * 2 : 64;
+                r = (int*) realloc(rearm, size * sizeof(int));
+                if (!r) {
+                        EVENT_ERROR("Can not alloc memory for io_uring slots.");
+                        return -1;
+                }
+                rearm      = r;
+                rearm_size = size;
+        }
+
+        rearm[rearm_len++] = fd;
+
+        return 0;
+}
+
+/*
+ * post the polls completed in the last round again, a oneshot poll
+ * checks the fd at once, so what is left unread is reported again.
+ */
+static int ev_uring_rearm()
+{
+        uring_slot_t *s;
+        int i;
+
+        for (i = 0; i < rearm_len; i++)
+        {
+                s = &slots[rearm[i]];
+                if (s->ev && !s->mask && !s->io) {
+                        ev_uring_post(rearm[i]);
+                }
+        }
+
+        rearm_len = 0;
+
+        return 0;
+}
+
+static int ev_uring_wait(int timeout)
+{
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        uring_slot_t *s;
+        unsigned head, tail;
+        int n, i, fd, ready;
+
+        ev_uring_rearm();
+
+        // io events left ready last round, just look for more
+        if (!queue_empty(&io_ready)) {
+                timeout = 0;
+        }
+
+        memset(&arg, 0, sizeof(arg));
+        if (timeout >= 0) {
+                ts.tv_sec  = timeout / 1000;
+                ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+                arg.ts     = (uint64_t) (uintptr_t) &ts;
+        }
+
+        // submit all the changes of this round and wait
+        n = uring_enter(ring.to_submit, timeout ? 1 : 0,
+                        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                        &arg, sizeof(arg));
+        if (n == -1) {
+                if (errno != EINTR && errno != ETIME) {
+                        EVENT_ERROR(strerror(errno));
+                        return -1;
+                }
+        } else {
+                ring.to_submit -= n;
+        }
+
+        // copy the completions out, the callbacks may queue more
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (n = 0; head != tail && n < URING_MAX_CQES; head++, n++)
+        {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+                cqes[n].data  = cqe->user_data;
+                cqes[n].res   = cqe->res;
+                cqes[n].flags = cqe->flags;
+        }
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        for (i = 0; i < n; i++)
+        {
+                if (cqes[i].data == URING_DATA_IGNORE) {
+                        continue;
+                } else if (URING_DATA_KIND(cqes[i].data) == URING_DATA_READ) {
+                        uring_io_read_done(URING_IO(cqes[i].data), cqes[i].res, cqes[i].flags);
+                        continue;
+                } else if (URING_DATA_KIND(cqes[i].data) == URING_DATA_WRITE) {
+                        uring_io_write_done(URING_IO(cqes[i].data), cqes[i].res);
+                        continue;
+                }
+
+                fd = URING_DATA_FD(cqes[i].data);
+                if (fd >= slots_size) {
+                        continue;
+                }
+
+                s = &slots[fd];
+                if (!s->ev || s->gen != URING_DATA_GEN(cqes[i].data)) {
+                        continue;
+                }
+
+                // the request is over, post it again next round
+                if (!(cqes[i].flags & IORING_CQE_F_MORE)) {
+                        s->mask = 0;
+                        ev_uring_rearm_later(fd);
+                }
+
+                if (cqes[i].res == -ECANCELED) {
+                        continue;
+                }
+
+                ready = 0;
+                if (cqes[i].res < 0) {
+                        ready |= EVENT_FLAG_ERROR;
+                } else {
+                        if (cqes[i].res & POLLIN) {
+                                ready |= EVENT_FLAG_READ;
+                        }
+                        if (cqes[i].res & POLLOUT) {
+                                ready |= EVENT_FLAG_WRITE;
+                        }
+                        if (cqes[i].res & (POLLERR | POLLHUP)) {
+                                ready |= EVENT_FLAG_ERROR;
+                        }
+                }
+
+                event_process(s->ev, ready);
+        }
+
+        uring_io_process();
+
+        return n;
+}
+
+#else
+
+static int ev_uring_init()
+{
+        EVENT_WARN("Built without io_uring support.");
+        return -1;
+}
+
+event_backend_t uring_backend = {
+        .name = "io_uring",
+        .edge = 0,
+        .init = ev_uring_init,
+};
+
+#endif
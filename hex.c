@@ -0,0 +1,347 @@
+/*
+ * hex.c
+ *
+ * The hex digits of the modem sentences, every byte of a frame goes
+ * through them twice. A kernel encodes, or checks and decodes in one
+ * pass, 16 bytes at a time with SSE2 or 32 with AVX2, the rest of a
+ * frame byte by byte. The best kernel the CPU has is chosen once, or
+ * the one in hex_kernel.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "hex.h"
+#include "config.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_X86
+#endif
+
+#define HEX_CONFIG_KERNEL       "hex_kernel"
+#define HEX_DEFAULT_KERNEL      "auto"
+
+#define HEX_ERROR(s) log_error("HEX", (s))
+#define HEX_WARN(s)  log_warn ("HEX", (s))
+#define HEX_INFO(s)  log_info ("HEX", (s))
+#define HEX_DEBUG(s) log_debug("HEX", (s))
+
+typedef void (*hex_encode_fn)(char *hex, const unsigned char *src, size_t size);
+typedef int (*hex_decode_fn)(unsigned char *dst, const char *hex, size_t size);
+
+typedef struct hex_kernel_s hex_kernel_t;
+struct hex_kernel_s {
+        const char    *name;
+        hex_encode_fn  encode;
+        hex_decode_fn  decode;
+        int          (*supported)();
+};
+
+static void hex_encode_scalar(char *hex, const unsigned char *src, size_t size);
+static int hex_decode_scalar(unsigned char *dst, const char *hex, size_t size);
+static int hex_scalar_supported();
+
+#ifdef HEX_X86
+static void hex_encode_sse2(char *hex, const unsigned char *src, size_t size);
+static int hex_decode_sse2(unsigned char *dst, const char *hex, size_t size);
+static int hex_sse2_supported();
+static void hex_encode_avx2(char *hex, const unsigned char *src, size_t size);
+static int hex_decode_avx2(unsigned char *dst, const char *hex, size_t size);
+static int hex_avx2_supported();
+#endif
+
+// best first
+static const hex_kernel_t hex_kernels[] = {
+#ifdef HEX_X86
+        { "avx2",   hex_encode_avx2,   hex_decode_avx2,   hex_avx2_supported   },
+        { "sse2",   hex_encode_sse2,   hex_decode_sse2,   hex_sse2_supported   },
+#endif
+        { "scalar", hex_encode_scalar, hex_decode_scalar, hex_scalar_supported },
+};
+
+#define HEX_KERNELS     (sizeof(hex_kernels) / sizeof(hex_kernels[0]))
+
+static const hex_kernel_t *kernel = &hex_kernels[HEX_KERNELS - 1];
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+// value of a hex digit, -1 for any other character
+static const int8_t hex_values[256] = {
+        [0 ... 255] = -1,
+        ['0'] = 0,  ['1'] = 1,  ['2'] = 2,  ['3'] = 3,  ['4'] = 4,
+        ['5'] = 5,  ['6'] = 6,  ['7'] = 7,  ['8'] = 8,  ['9'] = 9,
+        ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+        ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+};
+
+/*
+ * the first supported kernel, or the one named in hex_kernel.
+ */
+int hex_init()
+{
+        char  *c;
+        size_t i;
+
+        c = config_find(HEX_CONFIG_KERNEL);
+        if (!c) {
+                c = HEX_DEFAULT_KERNEL;
+        }
+
+        for (i = 0; i < HEX_KERNELS; i++)
+        {
+                if (!hex_kernels[i].supported()) {
+                        continue;
+                }
+
+                if (!strcmp(c, "auto") || !strcmp(c, hex_kernels[i].name)) {
+                        break;
+                }
+        }
+
+        if (i == HEX_KERNELS) {
+                logf_warn("HEX", "Hex kernel %s is not supported, use the best one.", c);
+                for (i = 0; !hex_kernels[i].supported(); i++)
+                        ;
+        }
+
+        kernel = &hex_kernels[i];
+
+        logf_info("HEX", "Initialize the HEX MODULE with %s kernel successed.", kernel->name);
+
+        return 0;
+}
+
+void hex_encode(char *hex, const unsigned char *src, size_t size)
+{
+        kernel->encode(hex, src, size);
+}
+
+int hex_decode(unsigned char *dst, const char *hex, size_t size)
+{
+        if (size & 1) {
+                return -1;
+        }
+
+        return kernel->decode(dst, hex, size);
+}
+
+static int hex_scalar_supported()
+{
+        return 1;
+}
+
+static void hex_encode_scalar(char *hex, const unsigned char *src, size_t size)
+{
+        size_t i;
+
+        for (i = 0; i < size; i++)
+        {
+                hex[i*2]   = hex_digits[src[i] >> 4];
+                hex[i*2+1] = hex_digits[src[i] & 0x0f];
+        }
+}
+
+/*
+ * an invalid digit is -1, its sign bit stays in bad.
+ */
+static int hex_decode_scalar(unsigned char *dst, const char *hex, size_t size)
+{
+        int8_t hi, lo, bad = 0;
+        size_t i;
+
+        for (i = 0; i < size; i += 2)
+        {
+                hi = hex_values[(unsigned char) hex[i]];
+                lo = hex_values[(unsigned char) hex[i+1]];
+
+                bad |= hi | lo;
+                dst[i/2] = (unsigned char) (hi << 4 | lo);
+        }
+
+        return bad < 0 ? -1 : 0;
+}
+
+#ifdef HEX_X86
+
+static int hex_sse2_supported()
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+}
+
+static int hex_avx2_supported()
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * nibbles to digits, '0' + n, and 7 more from 'A' on.
+ */
+__attribute__((target("sse2")))
+static inline __m128i hex_digit_sse2(__m128i n)
+{
+        __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+        return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+                            _mm_and_si128(letter, _mm_set1_epi8('A' - '0' - 10)));
+}
+
+__attribute__((target("sse2")))
+static void hex_encode_sse2(char *hex, const unsigned char *src, size_t size)
+{
+        __m128i mask = _mm_set1_epi8(0x0f);
+        __m128i x, hi, lo;
+        size_t  i;
+
+        for (i = 0; i + 16 <= size; i += 16)
+        {
+                x  = _mm_loadu_si128((const __m128i*) (src + i));
+                hi = hex_digit_sse2(_mm_and_si128(_mm_srli_epi16(x, 4), mask));
+                lo = hex_digit_sse2(_mm_and_si128(x, mask));
+
+                _mm_storeu_si128((__m128i*) (hex + i*2),      _mm_unpacklo_epi8(hi, lo));
+                _mm_storeu_si128((__m128i*) (hex + i*2 + 16), _mm_unpackhi_epi8(hi, lo));
+        }
+
+        hex_encode_scalar(hex + i*2, src + i, size - i);
+}
+
+/*
+ * 16 digits to their nibbles, all ones in bad for a character not a
+ * digit. the characters above 0x7f are below everything signed.
+ */
+__attribute__((target("sse2")))
+static inline __m128i hex_value_sse2(__m128i c, __m128i *bad)
+{
+        __m128i l     = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), l));
+
+        *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(digit, alpha), _mm_set1_epi8(-1)));
+
+        return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                            _mm_and_si128(alpha, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+}
+
+/*
+ * the high nibble is the low byte of a word, the low nibble its high
+ * byte, the byte is (w << 4 | w >> 8) & 0xff.
+ */
+__attribute__((target("sse2")))
+static inline __m128i hex_pair_sse2(__m128i v)
+{
+        return _mm_and_si128(_mm_or_si128(_mm_slli_epi16(v, 4), _mm_srli_epi16(v, 8)),
+                             _mm_set1_epi16(0x00ff));
+}
+
+__attribute__((target("sse2")))
+static int hex_decode_sse2(unsigned char *dst, const char *hex, size_t size)
+{
+        __m128i bad = _mm_setzero_si128();
+        __m128i a, b;
+        size_t  i;
+
+        for (i = 0; i + 32 <= size; i += 32)
+        {
+                a = hex_value_sse2(_mm_loadu_si128((const __m128i*) (hex + i)), &bad);
+                b = hex_value_sse2(_mm_loadu_si128((const __m128i*) (hex + i + 16)), &bad);
+
+                _mm_storeu_si128((__m128i*) (dst + i/2),
+                                 _mm_packus_epi16(hex_pair_sse2(a), hex_pair_sse2(b)));
+        }
+
+        if (_mm_movemask_epi8(bad)) {
+                return -1;
+        }
+
+        return hex_decode_scalar(dst + i/2, hex + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hex_digit_avx2(__m256i n)
+{
+        __m256i letter = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+
+        return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')),
+                               _mm256_and_si256(letter, _mm256_set1_epi8('A' - '0' - 10)));
+}
+
+/*
+ * unpack works in each 128 bits lane, the lanes are put back in
+ * order when stored.
+ */
+__attribute__((target("avx2")))
+static void hex_encode_avx2(char *hex, const unsigned char *src, size_t size)
+{
+        __m256i mask = _mm256_set1_epi8(0x0f);
+        __m256i x, hi, lo, a, b;
+        size_t  i;
+
+        for (i = 0; i + 32 <= size; i += 32)
+        {
+                x  = _mm256_loadu_si256((const __m256i*) (src + i));
+                hi = hex_digit_avx2(_mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+                lo = hex_digit_avx2(_mm256_and_si256(x, mask));
+                a  = _mm256_unpacklo_epi8(hi, lo);
+                b  = _mm256_unpackhi_epi8(hi, lo);
+
+                _mm256_storeu_si256((__m256i*) (hex + i*2),      _mm256_permute2x128_si256(a, b, 0x20));
+                _mm256_storeu_si256((__m256i*) (hex + i*2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+        }
+
+        hex_encode_sse2(hex + i*2, src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hex_value_avx2(__m256i c, __m256i *bad)
+{
+        __m256i l     = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), l));
+
+        *bad = _mm256_or_si256(*bad, _mm256_andnot_si256(_mm256_or_si256(digit, alpha), _mm256_set1_epi8(-1)));
+
+        return _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+                               _mm256_and_si256(alpha, _mm256_sub_epi8(l, _mm256_set1_epi8('a' - 10))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hex_pair_avx2(__m256i v)
+{
+        return _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(v, 4), _mm256_srli_epi16(v, 8)),
+                                _mm256_set1_epi16(0x00ff));
+}
+
+/*
+ * pack works in each lane too, the quarters come out 0 2 1 3.
+ */
+__attribute__((target("avx2")))
+static int hex_decode_avx2(unsigned char *dst, const char *hex, size_t size)
+{
+        __m256i bad = _mm256_setzero_si256();
+        __m256i a, b;
+        size_t  i;
+
+        for (i = 0; i + 64 <= size; i += 64)
+        {
+                a = hex_value_avx2(_mm256_loadu_si256((const __m256i*) (hex + i)), &bad);
+                b = hex_value_avx2(_mm256_loadu_si256((const __m256i*) (hex + i + 32)), &bad);
+
+                _mm256_storeu_si256((__m256i*) (dst + i/2),
+                                    _mm256_permute4x64_epi64(_mm256_packus_epi16(hex_pair_avx2(a), hex_pair_avx2(b)), 0xd8));
+        }
+
+        if (_mm256_movemask_epi8(bad)) {
+                return -1;
+        }
+
+        return hex_decode_sse2(dst + i/2, hex + i, size - i);
+}
+
+#endif // HEX_X86
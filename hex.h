@@ -0,0 +1,16 @@
+#ifndef _HEX_H_
+#define _HEX_H_
+
+#include <stddef.h>
+
+// for modem drivers
+int hex_init();
+
+// size bytes of src to 2 * size upper case hex digits
+void hex_encode(char *hex, const unsigned char *src, size_t size);
+
+// size hex digits of either case to size / 2 bytes, -1 if size is
+// odd or a digit is not hex, dst is not whole then
+int hex_decode(unsigned char *dst, const char *hex, size_t size);
+
+#endif // _HEX_H_
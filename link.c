@@ -0,0 +1,150 @@
+/*
+ * link.c
+ *
+ * The frame size of a device, chosen from the quality of its channel.
+ * A frame of L bytes gets through with probability exp(-hazard * L),
+ * and every transmission costs link_overhead bytes of air time more,
+ * the preamble and the headers, so the goodput of the frame size is
+ *
+ *      L / (L + H) * exp(-hazard * L)
+ *
+ * largest at L = (sqrt(H^2 + 4 H / hazard) - H) / 2. The hazard comes
+ * from the frames seen lately, received whole or damaged, or failed
+ * by the modem, each one counting less by every frame seen after it.
+ * A calm channel sends whole MTUs, a noisy one shorter frames.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "link.h"
+#include "config.h"
+#include "log.h"
+
+#define LINK_CONFIG_ADAPT       "link_adapt"
+#define LINK_DEFAULT_ADAPT      "on"
+#define LINK_CONFIG_OVERHEAD    "link_overhead"
+#define LINK_DEFAULT_OVERHEAD   64              // bytes
+#define LINK_CONFIG_MEMORY      "link_memory"
+#define LINK_DEFAULT_MEMORY     32              // frames
+#define LINK_CONFIG_MIN_SIZE    "link_min_size"
+#define LINK_DEFAULT_MIN_SIZE   128             // bytes
+
+// at most this many frames are taken as failed
+#define LINK_MAX_LOSS           0.99
+
+// room for the headers of the device and of a bond
+#define LINK_FLOOR_SIZE         16
+
+#define LINK_ERROR(s) log_error("LINK", (s))
+#define LINK_WARN(s)  log_warn ("LINK", (s))
+#define LINK_INFO(s)  log_info ("LINK", (s))
+#define LINK_DEBUG(s) log_debug("LINK", (s))
+
+static int    adapt;
+static int    overhead;
+static double decay;
+static int    min_size;
+
+static void link_choose(link_t *l);
+
+int link_init()
+{
+        char *c;
+        int   memory;
+
+        c = config_find(LINK_CONFIG_ADAPT);
+        adapt = !strcmp(c ? c : LINK_DEFAULT_ADAPT, "on");
+
+        c = config_find(LINK_CONFIG_OVERHEAD);
+        overhead = c ? atoi(c) : LINK_DEFAULT_OVERHEAD;
+        if (overhead <= 0) {
+                overhead = LINK_DEFAULT_OVERHEAD;
+        }
+
+        c = config_find(LINK_CONFIG_MEMORY);
+        memory = c ? atoi(c) : LINK_DEFAULT_MEMORY;
+        if (memory <= 1) {
+                memory = LINK_DEFAULT_MEMORY;
+        }
+        decay = 1.0 - 1.0 / memory;
+
+        c = config_find(LINK_CONFIG_MIN_SIZE);
+        min_size = c ? atoi(c) : LINK_DEFAULT_MIN_SIZE;
+        if (min_size < LINK_FLOOR_SIZE) {
+                min_size = LINK_FLOOR_SIZE;
+        }
+
+        if (adapt) {
+                logf_info("LINK", "Initialize the LINK MODULE with overhead %d, memory %d frames, frames of %d bytes at least successed.",
+                        overhead, memory, min_size);
+        } else {
+                LINK_INFO("Initialize the LINK MODULE with fixed frame size successed.");
+        }
+
+        return 0;
+}
+
+void link_create(link_t *l, unsigned int mtu)
+{
+        memset(l, 0, sizeof(link_t));
+
+        l->mtu  = mtu;
+        l->size = mtu;
+}
+
+/*
+ * a frame of len bytes got through, or not.
+ */
+void link_observe(link_t *l, int len, int ok)
+{
+        if (len <= 0) {
+                return;
+        }
+
+        l->frames = l->frames * decay + 1;
+        l->failed = l->failed * decay + !ok;
+        l->bytes  = l->bytes  * decay + len;
+
+        l->seen++;
+        if (!ok) {
+                l->errors++;
+        }
+
+        link_choose(l);
+}
+
+/*
+ * the frame size of the best goodput, between min_size and the mtu.
+ */
+static void link_choose(link_t *l)
+{
+        double loss = l->failed / l->frames;
+        double h    = overhead;
+        double best;
+
+        if (loss > LINK_MAX_LOSS) {
+                loss = LINK_MAX_LOSS;
+        }
+
+        l->hazard = loss > 0 ? -log(1 - loss) / (l->bytes / l->frames) : 0;
+
+        if (!adapt) {
+                return;
+        }
+
+        if (l->hazard <= 0) {
+                l->size = l->mtu;
+                return;
+        }
+
+        best = (sqrt(h * h + 4 * h / l->hazard) - h) / 2;
+
+        if (best >= l->mtu) {
+                l->size = l->mtu;
+        } else if (best <= min_size) {
+                l->size = (unsigned int) min_size < l->mtu ? (unsigned int) min_size : l->mtu;
+        } else {
+                l->size = (unsigned int) best;
+        }
+}
@@ -0,0 +1,34 @@
+#ifndef _LINK_H_
+#define _LINK_H_
+
+/*
+ * the quality of the channel of a device, from the frames seen sent
+ * and received, and the frame size it is best sent in.
+ */
+typedef struct link_s link_t;
+struct link_s {
+        unsigned int mtu;
+        unsigned int size;      // the frame size chosen
+
+        // the frames seen, the failed ones, and their bytes, older
+        // ones count less
+        double frames;
+        double failed;
+        double bytes;
+
+        // probability a byte breaks its frame
+        double hazard;
+
+        // all the frames seen and failed
+        unsigned long seen;
+        unsigned long errors;
+};
+
+// for device module
+int link_init();
+
+// for devices
+void link_create(link_t *l, unsigned int mtu);
+void link_observe(link_t *l, int len, int ok);
+
+#endif // _LINK_H_
@@ -48,9 +48,9 @@ int log_exit()
 
 int log_msg(char *type, char *module, char *msg)
 {
-        static char buf[LOG_BUFFER_SIZE];
-        static char tm[30];
-        static time_t t;
+        static __thread char buf[LOG_BUFFER_SIZE];
+        static __thread char tm[30];
+        static __thread time_t t;
         FILE *file_fd = log.file_fd;
         
         if (!file_fd) {
@@ -77,7 +77,7 @@ int log_error(char *module, char *msg)
 
 int logf_error(char *module, const char *format, ...)
 {
-        static char buf[LOG_BUFFER_SIZE];
+        static __thread char buf[LOG_BUFFER_SIZE];
 
         va_list args;    
         va_start(args, format);
@@ -101,7 +101,7 @@ int log_warn(char *module, char *msg)
 
 int logf_warn(char *module, const char *format, ...)
 {
-        static char buf[LOG_BUFFER_SIZE];
+        static __thread char buf[LOG_BUFFER_SIZE];
 
         va_list args;    
         va_start(args, format);
@@ -125,7 +125,7 @@ int log_info(char *module, char *msg)
 
 int logf_info(char *module, const char *format, ...)
 {
-        static char buf[LOG_BUFFER_SIZE];
+        static __thread char buf[LOG_BUFFER_SIZE];
 
         va_list args;    
         va_start(args, format);
@@ -149,7 +149,7 @@ int log_debug(char *module, char *msg)
 
 int logf_debug(char *module, const char *format, ...)
 {
-        static char buf[LOG_BUFFER_SIZE];
+        static __thread char buf[LOG_BUFFER_SIZE];
 
         va_list args;    
         va_start(args, format);
@@ -0,0 +1,285 @@
+/*
+ * loop.c
+ *
+ * Multi-reactor support. With worker_threads set in config file, the
+ * main loop keeps the devices only, and every worker thread runs its
+ * own event loop with its own listen socket (SO_REUSEPORT) and its own
+ * share of the client connections. Packets from a worker to a device
+ * are posted to the main loop, packets from a device to a connection
+ * are posted to the worker owning it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include "loop.h"
+#include "config.h"
+#include "log.h"
+#include "event.h"
+#include "device.h"
+#include "app.h"
+#include "packet.h"
+
+#define LOOP_CONFIG_WORKERS     "worker_threads"
+#define LOOP_DEFAULT_WORKERS    0
+
+#define LOOP_ERROR(s) log_error("LOOP", (s))
+#define LOOP_WARN(s)  log_warn ("LOOP", (s))
+#define LOOP_INFO(s)  log_info ("LOOP", (s))
+#define LOOP_DEBUG(s) log_debug("LOOP", (s))
+
+static int loop_doorbell_init(loop_t *loop);
+static int loop_doorbell(event_t *ev);
+static void *loop_worker(void *arg);
+
+static loop_t loops[LOOP_MAX];
+static int workers;
+
+static sem_t started;
+static int start_error;
+
+static __thread loop_t *current;
+
+/*
+ * the main loop is the caller, its event module must be ready.
+ */
+int loop_init()
+{
+        char *c;
+
+        c = config_find(LOOP_CONFIG_WORKERS);
+        workers = c ? atoi(c) : LOOP_DEFAULT_WORKERS;
+
+        if (workers < 0 || workers > LOOP_MAX - 1) {
+                logf_error("LOOP", "Worker threads must be in 0 to %d.", LOOP_MAX - 1);
+                return -1;
+        }
+
+        loops[0].id      = 0;
+        loops[0].tid     = pthread_self();
+        loops[0].handler = device_send;
+
+        current = &loops[0];
+
+        if (loop_doorbell_init(&loops[0]) == -1) {
+                return -1;
+        }
+
+        LOOP_INFO("Initialize the LOOP MODULE successed.");
+
+        return 0;
+}
+
+/*
+ * without workers the main loop runs the app module too,
+ * else start the workers and wait until all of them listen.
+ */
+int loop_start()
+{
+        sigset_t set, old;
+        int i;
+
+        if (!workers) {
+                return app_init();
+        }
+
+        if (sem_init(&started, 0, 0) == -1) {
+                LOOP_ERROR(strerror(errno));
+                return -1;
+        }
+
+        // signals always go to the main loop
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+
+        for (i = 1; i <= workers; i++)
+        {
+                loops[i].id      = i;
+                loops[i].handler = app_send;
+
+                if (pthread_create(&loops[i].tid, NULL, loop_worker, &loops[i]) != 0) {
+                        LOOP_ERROR("Can not create worker thread.");
+                        pthread_sigmask(SIG_SETMASK, &old, NULL);
+                        return -1;
+                }
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        for (i = 1; i <= workers; i++)
+        {
+                sem_wait(&started);
+        }
+
+        if (start_error) {
+                return -1;
+        }
+
+        logf_info("LOOP", "Start %d worker loops.", workers);
+
+        return 0;
+}
+
+int loop_exit()
+{
+        int i;
+
+        for (i = 0; i <= workers; i++)
+        {
+                if (loops[i].efd > 0) {
+                        close(loops[i].efd);
+                }
+        }
+
+        return 0;
+}
+
+static void *loop_worker(void *arg)
+{
+        loop_t *loop = (loop_t*) arg;
+
+        current = loop;
+
+        if (event_init() == -1 || loop_doorbell_init(loop) == -1 || app_init() == -1) {
+                logf_error("LOOP", "Can not start worker loop %d.", loop->id);
+                __atomic_store_n(&start_error, 1, __ATOMIC_RELEASE);
+                sem_post(&started);
+                return NULL;
+        }
+
+        sem_post(&started);
+
+        for (;;)
+        {
+                event_wait();
+        }
+
+        return NULL;
+}
+
+/*
+ * every loop has an eventfd in its own event module,
+ * producers ring it after posting to the inbox.
+ */
+static int loop_doorbell_init(loop_t *loop)
+{
+        event_t *ev;
+
+        mpsc_init(&loop->inbox);
+        loop->notified = 0;
+
+        loop->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->efd == -1) {
+                LOOP_ERROR(strerror(errno));
+                return -1;
+        }
+
+        if (!event_create(ev)) {
+                LOOP_ERROR("Can not alloc memory for an event.");
+                close(loop->efd);
+                return -1;
+        }
+
+        ev->fd     = loop->efd;
+        ev->input  = loop_doorbell;
+        ev->output = NULL;
+        ev->data   = loop;
+        ev->flag   = 0;
+
+        set_event_active(ev);
+        set_event_read(ev);
+
+        if (event_add(ev) == -1) {
+                event_free(ev);
+                close(loop->efd);
+                return -1;
+        }
+
+        loop->ev = ev;
+
+        return 0;
+}
+
+/*
+ * the doorbell rang, handle all the packets in the inbox.
+ */
+static int loop_doorbell(event_t *ev)
+{
+        loop_t      *loop = (loop_t*) ev->data;
+        mpsc_node_t *n;
+        packet_t    *pkg;
+        uint64_t     count;
+
+        if (read(loop->efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                LOOP_ERROR(strerror(errno));
+        }
+
+        // from now on a new post rings again
+        __atomic_store_n(&loop->notified, 0, __ATOMIC_SEQ_CST);
+
+        while ((n = mpsc_pop(&loop->inbox)))
+        {
+                pkg = mpsc_data(n, packet_t, post);
+                loop->handler(pkg);
+        }
+
+        return 0;
+}
+
+int loop_post(loop_t *loop, packet_t *pkg)
+{
+        uint64_t one = 1;
+
+        mpsc_push(&loop->inbox, &pkg->post);
+
+        // ring once until the loop takes the packets
+        if (!__atomic_exchange_n(&loop->notified, 1, __ATOMIC_SEQ_CST)) {
+                if (write(loop->efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                        LOOP_ERROR(strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+loop_t *loop_current()
+{
+        return current;
+}
+
+loop_t *loop_main()
+{
+        return &loops[0];
+}
+
+loop_t *loop_get(int id)
+{
+        if (id < 0 || id > workers) {
+                return NULL;
+        }
+
+        return &loops[id];
+}
+
+/*
+ * the loop owning something identified by key, the main loop
+ * if there is no worker.
+ */
+loop_t *loop_pick(unsigned int key)
+{
+        if (!workers) {
+                return &loops[0];
+        }
+
+        return &loops[key % workers + 1];
+}
+
+int loop_workers()
+{
+        return workers;
+}
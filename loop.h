@@ -0,0 +1,52 @@
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include <pthread.h>
+#include "queue.h"
+
+// the main loop and up to 31 workers, a loop id fits in 5 bits
+#define LOOP_MAX                32
+
+typedef struct packet_s packet_t;
+typedef struct event_s event_t;
+typedef struct loop_s loop_t;
+
+// handle a packet posted from other loop
+typedef int (*loop_handler_fn)(packet_t *pkg);
+
+/*
+ * an event loop running on its own thread. loop 0 is the main
+ * loop owning the devices, the workers own the client connections.
+ * packets cross between loops through the inbox, never through
+ * shared lists.
+ */
+struct loop_s {
+        int id;
+
+        pthread_t tid;
+
+        // packets posted to this loop
+        mpsc_t inbox;
+
+        // doorbell, an eventfd rung after posting
+        int efd;
+        int notified;
+        event_t *ev;
+
+        loop_handler_fn handler;
+};
+
+// for core
+int loop_init();
+int loop_start();
+int loop_exit();
+
+// for other module
+loop_t *loop_current();
+loop_t *loop_main();
+loop_t *loop_get(int id);
+loop_t *loop_pick(unsigned int key);
+int loop_workers();
+int loop_post(loop_t *loop, packet_t *pkg);
+
+#endif // _LOOP_H_
@@ -47,8 +47,7 @@ int mac_input(packet_t *pkg)
                 return -1;
         }
 
-        pkg->pdu += MAC_HEADER_LENGTH;
-        pkg->len -= MAC_HEADER_LENGTH;
+        packet_pull(pkg, MAC_HEADER_LENGTH);
 
         return 0;
 }
@@ -60,13 +59,16 @@ int mac_checksum(char *data, size_t len, crc32_t crc)
 
 int mac_output(packet_t *pkg)
 {
-        static mac_hdr_t hdr;
-        
-        hdr.src = 1;
-        hdr.dst = MAC_BROCAST_ADDRESS;
-        hdr.up  = pkg->up;
+        // the header goes in the head room, in front of the data
+        mac_hdr_t *hdr = (mac_hdr_t*) packet_push(pkg, MAC_HEADER_LENGTH);
+        if (!hdr) {
+                return -1;
+        }
 
-        memcpy(pkg->pdu + MAC_HEADER_LENGTH, &hdr, MAC_HEADER_LENGTH);
+        hdr->src = 1;
+        hdr->dst = MAC_BROCAST_ADDRESS;
+        hdr->up  = pkg->up;
+        hdr->crc = 0;
 
         pkg->up   = MAC_PROTOCOL_ID;
         pkg->down = 0;
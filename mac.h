@@ -17,6 +17,6 @@ struct mac_hdr_s {
         mac_addr_t dst;
         ptc_id_t   up;
         crc32_t    crc;
-};
+} __attribute__((packed));
 
 #endif
@@ -0,0 +1,288 @@
+/*
+ * packet.c
+ *
+ * Packets and their buffers come from the pools, a packet is
+ * given back with its buffer. All the buffers have the same size,
+ * the MTU with the head and tail room.
+ *
+ * A packet is freed when its last holder puts it. To put the same
+ * data on several write queues, each queue gets a clone, a packet
+ * of its own sharing the buffer of the original.
+ *
+ * Data larger than a buffer is a chain of segments linked by next,
+ * it goes through the stack as one packet, the first segment.
+ */
+
+#include <stdlib.h>
+#include "packet.h"
+#include "pool.h"
+#include "config.h"
+#include "log.h"
+
+#define PACKET_CONFIG_MTU       "packet_mtu"
+#define PACKET_DEFAULT_MTU      1024
+
+#define PACKET_ERROR(s) log_error("PACKET", (s))
+#define PACKET_WARN(s)  log_warn ("PACKET", (s))
+#define PACKET_INFO(s)  log_info ("PACKET", (s))
+#define PACKET_DEBUG(s) log_debug("PACKET", (s))
+
+static int mtu;
+
+/*
+ * a buffer for every packet in the packet pool.
+ */
+int packet_init()
+{
+        char *c;
+
+        c = config_find(PACKET_CONFIG_MTU);
+        mtu = c ? atoi(c) : PACKET_DEFAULT_MTU;
+        if (mtu <= 0) {
+                PACKET_ERROR("Packet MTU must be positive.");
+                return -1;
+        }
+
+        if (pool_create(POOL_BUFFER, "buffer", PACKET_BUFFER_SIZE(mtu), pool_count(POOL_PACKET)) == -1) {
+                return -1;
+        }
+
+        logf_info("PACKET", "Initialize the PACKET MODULE with MTU %d successed.", mtu);
+
+        return 0;
+}
+
+int packet_mtu()
+{
+        return mtu;
+}
+
+/*
+ * a packet with an empty buffer, pdu after the head room.
+ */
+packet_t *packet_alloc()
+{
+        packet_t *pkg;
+        char     *buf;
+
+        pkg = (packet_t*) pool_alloc(POOL_PACKET);
+        if (!pkg) {
+                return NULL;
+        }
+
+        buf = (char*) pool_alloc(POOL_BUFFER);
+        if (!buf) {
+                pool_free(POOL_PACKET, pkg);
+                return NULL;
+        }
+
+        pkg->buf     = buf;
+        pkg->pdu     = buf + PACKET_HEADROOM;
+        pkg->len     = 0;
+        pkg->tot_len = PACKET_BUFFER_SIZE(mtu);
+        pkg->ref     = 1;
+        pkg->orig    = NULL;
+        pkg->next    = NULL;
+        pkg->dev     = NULL;
+        pkg->app     = NULL;
+        pkg->flow    = 0;
+        pkg->urgent  = 0;
+        pkg->stamp   = 0;
+        pkg->marked  = 0;
+        pkg->up      = 0;
+        pkg->down    = 0;
+
+        return pkg;
+}
+
+/*
+ * one more holder, any thread may get and put.
+ */
+packet_t *packet_get(packet_t *pkg)
+{
+        __atomic_add_fetch(&pkg->ref, 1, __ATOMIC_RELAXED);
+
+        return pkg;
+}
+
+/*
+ * the holder is done with it, a clone gives back its hold
+ * on the original, the original gives back the buffer.
+ * the first segment of a chain puts the others.
+ */
+void packet_put(packet_t *pkg)
+{
+        packet_t *next;
+
+        while (pkg && __atomic_sub_fetch(&pkg->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+                next = pkg->next;
+
+                if (pkg->orig) {
+                        packet_put(pkg->orig);
+                } else {
+                        pool_free(POOL_BUFFER, pkg->buf);
+                }
+
+                pool_free(POOL_PACKET, pkg);
+
+                pkg = next;
+        }
+}
+
+/*
+ * a new packet with the same data and headers, it can be queued
+ * and put alone. the buffer is shared, so neither may push more
+ * headers into it.
+ */
+packet_t *packet_clone(packet_t *pkg)
+{
+        packet_t *orig = pkg->orig ? pkg->orig : pkg;
+        packet_t *c;
+
+        c = (packet_t*) pool_alloc(POOL_PACKET);
+        if (!c) {
+                return NULL;
+        }
+
+        *c = *pkg;
+
+        c->ref  = 1;
+        c->orig = packet_get(orig);
+        c->next = NULL;
+
+        // every segment of a chain
+        if (pkg->next) {
+                c->next = packet_clone(pkg->next);
+                if (!c->next) {
+                        packet_put(c);
+                        return NULL;
+                }
+        }
+
+        return c;
+}
+
+/*
+ * the packet or its buffer has other holders, the original counts
+ * one hold for itself and one for every clone.
+ */
+int packet_shared(packet_t *pkg)
+{
+        packet_t *orig = pkg->orig ? pkg->orig : pkg;
+
+        return __atomic_load_n(&pkg->ref, __ATOMIC_ACQUIRE) > 1 ||
+               __atomic_load_n(&orig->ref, __ATOMIC_ACQUIRE) > 1;
+}
+
+/*
+ * n empty segments linked in a chain.
+ */
+packet_t *packet_alloc_chain(int n)
+{
+        packet_t *head = NULL, *tail = NULL, *pkg;
+
+        while (n-- > 0)
+        {
+                pkg = packet_alloc();
+                if (!pkg) {
+                        packet_put(head);
+                        return NULL;
+                }
+
+                if (tail) {
+                        tail->next = pkg;
+                } else {
+                        head = pkg;
+                }
+                tail = pkg;
+        }
+
+        return head;
+}
+
+/*
+ * bytes in all the segments.
+ */
+int packet_chain_len(packet_t *pkg)
+{
+        int len = 0;
+
+        for (; pkg; pkg = pkg->next)
+        {
+                len += pkg->len;
+        }
+
+        return len;
+}
+
+/*
+ * keep the first segment only.
+ */
+void packet_trim_chain(packet_t *pkg)
+{
+        packet_put(pkg->next);
+        pkg->next = NULL;
+}
+
+/*
+ * add a header of len bytes in front of the pdu,
+ * return where to write it.
+ */
+char *packet_push(packet_t *pkg, int len)
+{
+        if (packet_shared(pkg)) {
+                PACKET_ERROR("Can not push a header into a shared buffer.");
+                return NULL;
+        }
+
+        if (len > packet_headroom(pkg)) {
+                PACKET_ERROR("No head room for the header.");
+                return NULL;
+        }
+
+        pkg->pdu -= len;
+        pkg->len += len;
+
+        return pkg->pdu;
+}
+
+/*
+ * strip a header of len bytes, return the header.
+ */
+char *packet_pull(packet_t *pkg, int len)
+{
+        char *hdr = pkg->pdu;
+
+        if (len > pkg->len) {
+                return NULL;
+        }
+
+        pkg->pdu += len;
+        pkg->len -= len;
+
+        return hdr;
+}
+
+/*
+ * add len bytes after the data, for a trailer like checksum,
+ * return where to write it.
+ */
+char *packet_append(packet_t *pkg, int len)
+{
+        char *tail = packet_tail(pkg);
+
+        if (packet_shared(pkg)) {
+                PACKET_ERROR("Can not put a trailer into a shared buffer.");
+                return NULL;
+        }
+
+        if (len > packet_tailroom(pkg)) {
+                PACKET_ERROR("No tail room for the trailer.");
+                return NULL;
+        }
+
+        pkg->len += len;
+
+        return tail;
+}
@@ -7,14 +7,37 @@
 #include "app.h"
 #include "protocol.h"
 
+/*
+ * every buffer keeps room in front of the payload for the headers of
+ * all the layers (application, MAC, network and transport later), and
+ * room behind it for a checksum. a layer adds or strips its header
+ * by moving pdu only, the payload is never copied.
+ */
+#define PACKET_HEADROOM         64
+#define PACKET_TAILROOM         8
+#define PACKET_BUFFER_SIZE(mtu) (PACKET_HEADROOM + (mtu) + PACKET_TAILROOM)
+
+#define packet_headroom(pkg)    ((int) ((pkg)->pdu - (pkg)->buf))
+#define packet_tailroom(pkg)    ((pkg)->tot_len - packet_headroom(pkg) - (pkg)->len)
+#define packet_tail(pkg)        ((pkg)->pdu + (pkg)->len)
+
 typedef struct packet_s packet_t;
 struct packet_s {
         char *pdu;
         char *buf;
         int   len;
         int   tot_len;
+
+        // holders of this packet, the last put frees it
         int   ref;
 
+        // a clone shares the buffer of this packet
+        packet_t *orig;
+
+        // next segment, a chain is one packet larger than a buffer,
+        // the first segment holds the others
+        packet_t *next;
+
         // device
         device_t *dev;
 
@@ -27,10 +50,42 @@ struct packet_s {
         // application
         app_t    *app;
 
+        // the connection for the scheduler of the device, and a
+        // control packet sent before data of other connections
+        uint32_t flow;
+        uint8_t  urgent;
+
+        // ms the packet was sent to the device, and marked by the
+        // scheduler when it waited too long
+        uint64_t stamp;
+        uint8_t  marked;
+
         ptc_id_t up;
         ptc_id_t down;
 
         queue_t queue;
+
+        // posted to other loop
+        mpsc_node_t post;
 };
 
+// for core
+int packet_init();
+
+// for other module
+packet_t *packet_alloc();
+packet_t *packet_get(packet_t *pkg);
+void packet_put(packet_t *pkg);
+packet_t *packet_clone(packet_t *pkg);
+int packet_shared(packet_t *pkg);
+int packet_mtu();
+
+packet_t *packet_alloc_chain(int n);
+int packet_chain_len(packet_t *pkg);
+void packet_trim_chain(packet_t *pkg);
+
+char *packet_push(packet_t *pkg, int len);
+char *packet_pull(packet_t *pkg, int len);
+char *packet_append(packet_t *pkg, int len);
+
 #endif // _UNS_PACKET_H_
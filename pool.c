@@ -0,0 +1,285 @@
+/*
+ * pool.c
+ *
+ * Fixed-size object pools. All the packets, buffers, events, clients
+ * and timers come from here, the number of each is read from config
+ * file at startup, so forwarding never calls malloc or free.
+ *
+ * Every thread keeps a cache of each pool. Alloc and free use it
+ * alone, the lock of the shared list is taken once a batch, when the
+ * cache is empty or full. A packet a loop allocs and the device
+ * thread frees goes back in batches the same way.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+#include "config.h"
+#include "log.h"
+#include "packet.h"
+#include "event.h"
+#include "tick.h"
+#include "app.h"
+
+#define POOL_CONFIG_CONNECTIONS         "max_connections"
+#define POOL_DEFAULT_CONNECTIONS        4096
+#define POOL_CONFIG_PACKETS             "max_packets"
+#define POOL_DEFAULT_PACKETS            8192
+
+// events and timers not for connections, listeners, doorbells, devices
+#define POOL_RESERVE            128
+
+// the objects a thread keeps of a pool, and moves at once
+#define POOL_CACHE_SIZE         64
+#define POOL_CACHE_BATCH        32
+
+#define POOL_ALIGN              16
+#define pool_align(s)           (((s) + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1))
+
+#define POOL_ERROR(s) log_error("POOL", (s))
+#define POOL_WARN(s)  log_warn ("POOL", (s))
+#define POOL_INFO(s)  log_info ("POOL", (s))
+#define POOL_DEBUG(s) log_debug("POOL", (s))
+
+static pool_t pools[POOL_MAX];
+
+static __thread pool_cache_t caches[POOL_MAX];
+
+static unsigned int pool_refill(pool_t *p, pool_cache_t *c);
+static void pool_flush(pool_t *p, pool_cache_t *c, unsigned int count);
+
+static int pool_config(char *key, int def)
+{
+        char *c = config_find(key);
+        int   n = c ? atoi(c) : def;
+
+        return n > 0 ? n : def;
+}
+
+int pool_init()
+{
+        int conns, pkgs;
+
+        conns = pool_config(POOL_CONFIG_CONNECTIONS, POOL_DEFAULT_CONNECTIONS);
+        pkgs  = pool_config(POOL_CONFIG_PACKETS, POOL_DEFAULT_PACKETS);
+
+        // the buffer pool depends on the MTU, the packet module makes it
+        if (pool_create(POOL_PACKET, "packet", sizeof(packet_t), pkgs) == -1 ||
+            pool_create(POOL_EVENT, "event", sizeof(event_t), conns + POOL_RESERVE) == -1 ||
+            pool_create(POOL_APP, "app", sizeof(app_t), conns) == -1 ||
+            pool_create(POOL_TICK, "tick", sizeof(tick_t), conns + POOL_RESERVE) == -1) {
+                return -1;
+        }
+
+        logf_info("POOL", "Initialize the POOL MODULE with %d connections and %d packets successed.",
+                conns, pkgs);
+
+        return 0;
+}
+
+/*
+ * other threads may still hold objects, the memory goes with
+ * the process, just report the counters.
+ */
+int pool_exit()
+{
+        return pool_report();
+}
+
+int pool_create(int type, char *name, size_t size, unsigned int count)
+{
+        pool_t      *p = &pools[type];
+        pool_node_t *n;
+        unsigned int i;
+
+        size = pool_align(size);
+
+        p->mem = (char*) malloc(size * count);
+        if (!p->mem) {
+                logf_error("POOL", "Can not alloc memory for %u %s objects.", count, name);
+                return -1;
+        }
+
+        p->name  = name;
+        p->size  = size;
+        p->count = count;
+        p->used  = 0;
+        p->high  = 0;
+        p->fail  = 0;
+
+        // the first object on the top
+        p->free_list = NULL;
+        for (i = count; i > 0; i--)
+        {
+                n = (pool_node_t*) (p->mem + (i - 1) * size);
+                n->next = p->free_list;
+                p->free_list = n;
+        }
+
+        pthread_mutex_init(&p->lock, NULL);
+
+        return 0;
+}
+
+unsigned int pool_count(int type)
+{
+        return pools[type].count;
+}
+
+void *pool_alloc(int type)
+{
+        pool_cache_t *c = &caches[type];
+        pool_node_t  *n;
+
+        if (!c->list && !pool_refill(&pools[type], c)) {
+                logf_warn("POOL", "The %s pool is empty.", pools[type].name);
+                return NULL;
+        }
+
+        n       = c->list;
+        c->list = n->next;
+        c->len--;
+
+        return n;
+}
+
+void pool_free(int type, void *obj)
+{
+        pool_cache_t *c = &caches[type];
+        pool_node_t  *n = (pool_node_t*) obj;
+
+        if (!obj) {
+                return;
+        }
+
+        n->next = c->list;
+        c->list = n;
+
+        if (++c->len > POOL_CACHE_SIZE) {
+                pool_flush(&pools[type], c, POOL_CACHE_BATCH);
+        }
+}
+
+/*
+ * take a batch from the shared list into the empty cache of this
+ * thread, return how many.
+ */
+static unsigned int pool_refill(pool_t *p, pool_cache_t *c)
+{
+        pool_node_t *n;
+        unsigned int i;
+
+        pthread_mutex_lock(&p->lock);
+
+        for (i = 0; i < POOL_CACHE_BATCH && p->free_list; i++)
+        {
+                n            = p->free_list;
+                p->free_list = n->next;
+                n->next      = c->list;
+                c->list      = n;
+        }
+
+        c->len += i;
+
+        if (!i) {
+                p->fail++;
+        } else if ((p->used += i) > p->high) {
+                p->high = p->used;
+        }
+
+        pthread_mutex_unlock(&p->lock);
+
+        return i;
+}
+
+/*
+ * give count objects of the cache back to the shared list, they are
+ * cut off the cache first, the lock covers one splice.
+ */
+static void pool_flush(pool_t *p, pool_cache_t *c, unsigned int count)
+{
+        pool_node_t *head, *tail;
+        unsigned int i;
+
+        if (!count || count > c->len) {
+                return;
+        }
+
+        head = c->list;
+        tail = head;
+        for (i = 1; i < count; i++)
+        {
+                tail = tail->next;
+        }
+
+        c->list = tail->next;
+        c->len -= count;
+
+        pthread_mutex_lock(&p->lock);
+
+        tail->next   = p->free_list;
+        p->free_list = head;
+        p->used     -= count;
+
+        pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * a thread leaving gives its caches back, the worker loops never
+ * leave, what they keep counts as used until exit.
+ */
+void pool_thread_exit()
+{
+        int i;
+
+        for (i = 0; i < POOL_MAX; i++)
+        {
+                if (pools[i].mem) {
+                        pool_flush(&pools[i], &caches[i], caches[i].len);
+                }
+        }
+}
+
+int pool_stat(int type, pool_stat_t *st)
+{
+        pool_t *p;
+
+        if (type < 0 || type >= POOL_MAX) {
+                return -1;
+        }
+
+        p = &pools[type];
+
+        pthread_mutex_lock(&p->lock);
+
+        st->name  = p->name;
+        st->count = p->count;
+        st->used  = p->used;
+        st->high  = p->high;
+        st->fail  = p->fail;
+
+        pthread_mutex_unlock(&p->lock);
+
+        return 0;
+}
+
+/*
+ * log the counters of every pool.
+ */
+int pool_report()
+{
+        pool_stat_t st;
+        int i;
+
+        for (i = 0; i < POOL_MAX; i++)
+        {
+                if (!pools[i].mem || pool_stat(i, &st) == -1) {
+                        continue;
+                }
+
+                logf_info("POOL", "%-6s count %u, used %u, high-water %u, failed %lu.",
+                        st.name, st.count, st.used, st.high, st.fail);
+        }
+
+        return 0;
+}
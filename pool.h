@@ -0,0 +1,79 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+// kinds of object with a pool
+enum pool_type {
+        POOL_PACKET,
+        POOL_BUFFER,
+        POOL_EVENT,
+        POOL_APP,
+        POOL_TICK,
+        POOL_MAX,
+};
+
+typedef struct pool_node_s pool_node_t;
+struct pool_node_s {
+        pool_node_t *next;
+};
+
+/*
+ * the objects of a pool a thread keeps for itself, it alloc and free
+ * them without the lock, and moves them to and from the shared list
+ * a batch at a time.
+ */
+typedef struct pool_cache_s pool_cache_t;
+struct pool_cache_s {
+        pool_node_t *list;
+        unsigned int len;
+};
+
+/*
+ * a fixed number of objects of one size, allocated at startup.
+ * any thread may alloc and free, objects cross between loops.
+ * used counts the objects out of the shared list, in the caches of
+ * the threads too.
+ */
+typedef struct pool_s pool_t;
+struct pool_s {
+        char *name;
+
+        size_t       size;
+        unsigned int count;
+
+        char        *mem;
+        pool_node_t *free_list;
+
+        pthread_mutex_t lock;
+
+        // counters
+        unsigned int used;
+        unsigned int high;      // high-water mark of used
+        unsigned long fail;     // alloc on an empty pool
+};
+
+typedef struct pool_stat_s pool_stat_t;
+struct pool_stat_s {
+        char *name;
+        unsigned int count;
+        unsigned int used;
+        unsigned int high;
+        unsigned long fail;
+};
+
+// for core
+int pool_init();
+int pool_exit();
+
+// for other module
+int pool_create(int type, char *name, size_t size, unsigned int count);
+unsigned int pool_count(int type);
+void *pool_alloc(int type);
+void pool_free(int type, void *obj);
+void pool_thread_exit();
+int pool_stat(int type, pool_stat_t *st);
+int pool_report();
+
+#endif // _POOL_H_
@@ -72,4 +72,147 @@ struct queue_s {
              _q = _q->next,                                             \
              (q) = queue_data(_q, TYPE, MEMBER))
 
+/*
+ * intrusive multi-producer single-consumer queue, lock free.
+ * any thread may push, only the owner thread pops. a pop may miss
+ * a node being pushed at the same time, the producer rings the
+ * consumer after the push, so it is found in the next round.
+ */
+typedef struct mpsc_node_s mpsc_node_t;
+struct mpsc_node_s {
+        mpsc_node_t *next;
+};
+
+typedef struct mpsc_s mpsc_t;
+struct mpsc_s {
+        mpsc_node_t *head;      // producers push here
+        mpsc_node_t *tail;      // consumer pops here
+        mpsc_node_t  stub;
+};
+
+#define mpsc_data(n, TYPE, MEMBER)                                      \
+        container(n, TYPE, MEMBER)
+
+static inline void mpsc_init(mpsc_t *q)
+{
+        q->stub.next = NULL;
+        q->head      = &q->stub;
+        q->tail      = &q->stub;
+}
+
+static inline void mpsc_push(mpsc_t *q, mpsc_node_t *n)
+{
+        mpsc_node_t *prev;
+
+        __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+        prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+static inline mpsc_node_t *mpsc_pop(mpsc_t *q)
+{
+        mpsc_node_t *tail = q->tail;
+        mpsc_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+        if (tail == &q->stub) {
+                if (!next) {
+                        return NULL;
+                }
+                q->tail = next;
+                tail    = next;
+                next    = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        }
+
+        if (next) {
+                q->tail = next;
+                return tail;
+        }
+
+        // a producer is between exchange and link
+        if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+                return NULL;
+        }
+
+        mpsc_push(q, &q->stub);
+
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (next) {
+                q->tail = next;
+                return tail;
+        }
+
+        return NULL;
+}
+
+/*
+ * bounded single-producer single-consumer ring of pointers,
+ * the size is a power of 2. head and tail only grow, each is
+ * written by one side, on its own cache line.
+ */
+typedef struct spsc_s spsc_t;
+struct spsc_s {
+        unsigned int size;
+        void       **slot;
+
+        unsigned int tail __attribute__((aligned(64)));  // producer
+        unsigned int head __attribute__((aligned(64)));  // consumer
+};
+
+static inline int spsc_init(spsc_t *r, unsigned int size)
+{
+        unsigned int n = 1;
+
+        while (n < size)
+        {
+                n <<= 1;
+        }
+
+        r->slot = (void**) malloc(n * sizeof(void*));
+        if (!r->slot) {
+                return -1;
+        }
+
+        r->size = n;
+        r->head = 0;
+        r->tail = 0;
+
+        return 0;
+}
+
+static inline void spsc_free(spsc_t *r)
+{
+        free(r->slot);
+        r->slot = NULL;
+}
+
+// -1 if the ring is full
+static inline int spsc_push(spsc_t *r, void *p)
+{
+        unsigned int tail = r->tail;
+
+        if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->size) {
+                return -1;
+        }
+
+        r->slot[tail & (r->size - 1)] = p;
+        __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+static inline void *spsc_pop(spsc_t *r)
+{
+        unsigned int head = r->head;
+        void *p;
+
+        if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+                return NULL;
+        }
+
+        p = r->slot[head & (r->size - 1)];
+        __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+        return p;
+}
+
 #endif // _QUEUE_H_
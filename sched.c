@@ -0,0 +1,284 @@
+/*
+ * sched.c
+ *
+ * The scheduler in front of a device. Packets of a connection go
+ * into the bucket of its flow, the buckets with packets take turns,
+ * each sending up to sched_quantum bytes a round (deficit round-
+ * robin), so a bulk transfer does not hold the others behind it.
+ *
+ * Control packets, and packets not longer than sched_small bytes,
+ * go in the priority class and leave before any bucket, unless their
+ * flow still has packets in its bucket: packets of a connection are
+ * never reordered.
+ *
+ * Every bucket runs codel on the time its packets waited. Dropping
+ * data would break the byte stream of a connection, so a packet that
+ * codel would drop is marked instead, and the connection stops
+ * reading its client for a while, like a TCP sender halving its
+ * window.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sched.h"
+#include "config.h"
+#include "log.h"
+#include "packet.h"
+#include "tick.h"
+
+#define SCHED_CONFIG_QUANTUM    "sched_quantum"
+#define SCHED_DEFAULT_QUANTUM   512
+#define SCHED_CONFIG_PRIORITY   "sched_priority"
+#define SCHED_DEFAULT_PRIORITY  "on"
+#define SCHED_CONFIG_SMALL      "sched_small"
+#define SCHED_DEFAULT_SMALL     128
+#define SCHED_CONFIG_CODEL      "codel"
+#define SCHED_DEFAULT_CODEL     "on"
+#define SCHED_CONFIG_TARGET     "codel_target"
+#define SCHED_DEFAULT_TARGET    500             // ms
+#define SCHED_CONFIG_INTERVAL   "codel_interval"
+#define SCHED_DEFAULT_INTERVAL  5000            // ms
+
+#define SCHED_ERROR(s) log_error("SCHED", (s))
+#define SCHED_WARN(s)  log_warn ("SCHED", (s))
+#define SCHED_INFO(s)  log_info ("SCHED", (s))
+#define SCHED_DEBUG(s) log_debug("SCHED", (s))
+
+#define sched_hash(flow)        (((uint32_t) (flow) * 2654435761U) >> (32 - SCHED_FLOW_BITS))
+
+static int quantum;
+static int priority;
+static int small;
+
+static int codel;
+static int target;
+static int interval;
+
+static void sched_codel(sched_t *s, sched_flow_t *f, packet_t *pkg, uint64_t now);
+static int sched_above(sched_t *s, sched_flow_t *f, unsigned int delay, uint64_t now);
+
+int sched_init()
+{
+        char *c;
+
+        c = config_find(SCHED_CONFIG_QUANTUM);
+        quantum = c ? atoi(c) : SCHED_DEFAULT_QUANTUM;
+        if (quantum <= 0) {
+                quantum = SCHED_DEFAULT_QUANTUM;
+        }
+
+        c = config_find(SCHED_CONFIG_PRIORITY);
+        priority = !strcmp(c ? c : SCHED_DEFAULT_PRIORITY, "on");
+
+        c = config_find(SCHED_CONFIG_SMALL);
+        small = c ? atoi(c) : SCHED_DEFAULT_SMALL;
+
+        c = config_find(SCHED_CONFIG_CODEL);
+        codel = !strcmp(c ? c : SCHED_DEFAULT_CODEL, "on");
+
+        c = config_find(SCHED_CONFIG_TARGET);
+        target = c ? atoi(c) : SCHED_DEFAULT_TARGET;
+        if (target <= 0) {
+                target = SCHED_DEFAULT_TARGET;
+        }
+
+        c = config_find(SCHED_CONFIG_INTERVAL);
+        interval = c ? atoi(c) : SCHED_DEFAULT_INTERVAL;
+        if (interval <= 0) {
+                interval = SCHED_DEFAULT_INTERVAL;
+        }
+
+        logf_info("SCHED", "Initialize the SCHED MODULE with quantum %d, priority %s, small %d successed.",
+                quantum, priority ? "on" : "off", small);
+
+        if (codel) {
+                logf_info("SCHED", "Mark packets waiting more than %d ms for %d ms.", target, interval);
+        }
+
+        return 0;
+}
+
+void sched_create(sched_t *s)
+{
+        int i;
+
+        queue_init(&s->priority);
+        queue_init(&s->active);
+
+        memset(s->flows, 0, sizeof(s->flows));
+
+        for (i = 0; i < SCHED_FLOWS; i++)
+        {
+                queue_init(&s->flows[i].packets);
+        }
+
+        s->packets = 0;
+        s->bytes   = 0;
+
+        s->delay_count = 0;
+        s->delay_sum   = 0;
+        s->delay_max   = 0;
+        s->marks       = 0;
+}
+
+/*
+ * give up all the packets waiting.
+ */
+void sched_purge(sched_t *s)
+{
+        packet_t *pkg;
+
+        while ((pkg = sched_dequeue(s)))
+        {
+                packet_put(pkg);
+        }
+}
+
+void sched_enqueue(sched_t *s, packet_t *pkg)
+{
+        sched_flow_t *f   = &s->flows[sched_hash(pkg->flow)];
+        int           len = packet_chain_len(pkg);
+
+        s->packets++;
+        s->bytes += len;
+
+        if (priority && (pkg->urgent || len <= small) && queue_empty(&f->packets)) {
+                queue_insert_tail(&s->priority, &pkg->queue);
+                return;
+        }
+
+        // a new flow starts with a full quantum, a flow coming back
+        // soon after a packet larger than its turn still owes it
+        if (queue_empty(&f->packets)) {
+                if (f->deficit >= 0) {
+                        f->deficit = quantum;
+                }
+                queue_insert_tail(&s->active, &f->active);
+        }
+
+        queue_insert_tail(&f->packets, &pkg->queue);
+}
+
+/*
+ * the next packet to send. the flow at the front of the round sends
+ * while it has deficit left, then goes to the back with one more
+ * quantum.
+ */
+packet_t *sched_dequeue(sched_t *s)
+{
+        sched_flow_t *f;
+        packet_t     *pkg;
+        uint64_t      now = tick_now();
+
+        if (!queue_empty(&s->priority)) {
+                pkg = queue_data(queue_first(&s->priority), packet_t, queue);
+                queue_delete(&pkg->queue);
+                sched_codel(s, NULL, pkg, now);
+                goto out;
+        }
+
+        if (queue_empty(&s->active)) {
+                return NULL;
+        }
+
+        for (;;)
+        {
+                f = queue_data(queue_first(&s->active), sched_flow_t, active);
+                if (f->deficit > 0) {
+                        break;
+                }
+
+                f->deficit += quantum;
+                queue_delete(&f->active);
+                queue_insert_tail(&s->active, &f->active);
+        }
+
+        pkg = queue_data(queue_first(&f->packets), packet_t, queue);
+        queue_delete(&pkg->queue);
+
+        f->deficit -= packet_chain_len(pkg);
+
+        if (queue_empty(&f->packets)) {
+                queue_delete(&f->active);
+        }
+
+        sched_codel(s, f, pkg, now);
+
+out:
+        s->packets--;
+        s->bytes -= packet_chain_len(pkg);
+
+        return pkg;
+}
+
+/*
+ * count the time the packet waited, and mark it when codel of its
+ * bucket would drop it. the priority class is never marked.
+ */
+static void sched_codel(sched_t *s, sched_flow_t *f, packet_t *pkg, uint64_t now)
+{
+        unsigned int delay = pkg->stamp && now > pkg->stamp ? now - pkg->stamp : 0;
+        unsigned int delta;
+        int          above;
+
+        s->delay_count++;
+        s->delay_sum += delay;
+        if (delay > s->delay_max) {
+                s->delay_max = delay;
+        }
+
+        if (!codel || !f) {
+                return;
+        }
+
+        above = sched_above(s, f, delay, now);
+
+        if (f->dropping) {
+                if (!above) {
+                        f->dropping = 0;
+                } else if (now >= f->mark_next) {
+                        f->count++;
+                        f->mark_next += interval / sqrt(f->count);
+                        pkg->marked = 1;
+                }
+        } else if (above) {
+                f->dropping = 1;
+
+                // marking again soon after, go on from the last rate.
+                // signed, it may come back before the old mark_next
+                delta = f->count - f->lastcount;
+                if (delta > 1 && (int64_t) (now - f->mark_next) < 16 * (int64_t) interval) {
+                        f->count = delta;
+                } else {
+                        f->count = 1;
+                }
+
+                f->lastcount = f->count;
+                f->mark_next = now + interval / sqrt(f->count);
+                pkg->marked  = 1;
+        }
+
+        if (pkg->marked) {
+                s->marks++;
+        }
+}
+
+/*
+ * the delay stayed above target for an interval, nothing more
+ * waiting in the scheduler does not count.
+ */
+static int sched_above(sched_t *s, sched_flow_t *f, unsigned int delay, uint64_t now)
+{
+        if (delay < (unsigned int) target || s->packets <= 1) {
+                f->first_above = 0;
+                return 0;
+        }
+
+        if (!f->first_above) {
+                f->first_above = now + interval;
+                return 0;
+        }
+
+        return now >= f->first_above;
+}
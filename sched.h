@@ -0,0 +1,65 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+#include "queue.h"
+
+// flows of a device, connections sharing a bucket share its turn
+#define SCHED_FLOW_BITS         6
+#define SCHED_FLOWS             (1U << SCHED_FLOW_BITS)
+
+typedef struct packet_s packet_t;
+
+typedef struct sched_flow_s sched_flow_t;
+struct sched_flow_s {
+        queue_t packets;
+
+        // bytes it may still send in this round, below zero it
+        // waits for the next one
+        int deficit;
+
+        // codel, ms. the delay has been above target since
+        // first_above minus interval, marking when dropping, the
+        // next mark at mark_next
+        uint64_t     first_above;
+        uint64_t     mark_next;
+        unsigned int count;
+        unsigned int lastcount;
+        int          dropping;
+
+        // in the active list, it has packets
+        queue_t active;
+};
+
+/*
+ * the packets waiting for a device, deficit round-robin between the
+ * flows, and a priority class sent before all of them.
+ */
+typedef struct sched_s sched_t;
+struct sched_s {
+        queue_t      priority;
+        queue_t      active;
+        sched_flow_t flows[SCHED_FLOWS];
+
+        unsigned int packets;
+        unsigned int bytes;
+
+        // time the packets waited, ms
+        unsigned long delay_count;
+        uint64_t      delay_sum;
+        unsigned int  delay_max;
+        unsigned long marks;
+};
+
+#define sched_empty(s)          (!(s)->packets)
+
+// for device module
+int sched_init();
+
+// for devices
+void sched_create(sched_t *s);
+void sched_purge(sched_t *s);
+void sched_enqueue(sched_t *s, packet_t *pkg);
+packet_t *sched_dequeue(sched_t *s);
+
+#endif // _SCHED_H_
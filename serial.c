@@ -0,0 +1,650 @@
+/*
+ * serial.c
+ *
+ * A driver for serial lines that pass any byte, a transparent radio
+ * or a cable on the bench, next to the modems of aquasent.c that take
+ * frames in hex. A frame goes on the line as it is, with a CRC-16 of
+ * it behind, framed by COBS or by SLIP, about half the bytes of the
+ * $HHTXD of the same frame. Nothing on the line acknowledges a frame,
+ * it is sent once the port took all of it.
+ *
+ * serial_devices names the lines, a key of one line is the key with
+ * its name at the end like a key of a modem, serial_port_SA, the key
+ * without a name is for all of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include "config.h"
+#include "device.h"
+#include "event.h"
+#include "log.h"
+#include "packet.h"
+#include "tick.h"
+
+#define SERIAL_CONFIG_DEVICES   "serial_devices"
+#define SERIAL_CONFIG_PORT      "serial_port"
+#define SERIAL_DEFAULT_PORT     "/dev/ttyS0"
+#define SERIAL_CONFIG_BAUD      "serial_baud"
+#define SERIAL_DEFAULT_BAUD     "115200"
+#define SERIAL_CONFIG_MTU       "serial_mtu"
+#define SERIAL_DEFAULT_MTU      1024
+#define SERIAL_CONFIG_FRAMING   "serial_framing"
+#define SERIAL_DEFAULT_FRAMING  "cobs"
+#define SERIAL_CONFIG_TIMEOUT   "serial_write_timeout"
+#define SERIAL_DEFAULT_TIMEOUT  2000            // ms
+
+#define SERIAL_ERROR(s) log_error("SERIAL", (s))
+#define SERIAL_WARN(s)  log_warn ("SERIAL", (s))
+#define SERIAL_INFO(s)  log_info ("SERIAL", (s))
+#define SERIAL_DEBUG(s) log_debug("SERIAL", (s))
+
+#define SERIAL_NAME_LENGTH      2
+#define SERIAL_CRC_LENGTH       2
+
+// a frame and its crc on the line, every byte escaped by slip at
+// worst, between two delimiters
+#define SERIAL_FRAME_SIZE(mtu)  (((mtu) + SERIAL_CRC_LENGTH) * 2 + 2)
+
+#define SLIP_END                0xC0
+#define SLIP_ESC                0xDB
+#define SLIP_ESC_END            0xDC
+#define SLIP_ESC_ESC            0xDD
+
+typedef struct device_serial_s device_serial_t;
+typedef struct serial_framing_s serial_framing_t;
+
+/*
+ * a framing puts the frame and its crc into dst without delimiters,
+ * and takes them out of src, at most max bytes, -1 if src is not
+ * framed right.
+ */
+struct serial_framing_s {
+        char   *name;
+        uint8_t delim;          // the byte between frames
+
+        int (*encode)(uint8_t *dst, const uint8_t *src, int len, uint16_t crc);
+        int (*decode)(uint8_t *dst, int max, const uint8_t *src, int len);
+};
+
+/*
+ * a line, the private data of its device.
+ */
+struct device_serial_s {
+        const serial_framing_t *framing;
+
+        // bytes read and not framed yet. a frame too long for rbuf is
+        // skipped up to the next delimiter
+        uint8_t *rbuf;
+        int      rlen;
+        int      rsize;
+        int      skip;
+
+        // the frame being written, wpos bytes of wlen are out
+        uint8_t  *wbuf;
+        int       wlen;
+        int       wpos;
+        packet_t *wpkg;
+
+        // the port must take more of the frame in timeout ms
+        tick_t *timer;
+        int     timeout;
+
+        // frames read, dropped for a bad crc or framing, written in
+        // parts, and given up when the port took no more in time
+        unsigned long rx_frames;
+        unsigned long rx_bad;
+        unsigned long tx_partial;
+        unsigned long tx_stalled;
+};
+
+int serial_init();
+int serial_create(char *name);
+int serial_exit(device_t *d);
+int serial_report(device_t *d);
+int serial_input(device_t *d);
+int serial_output(packet_t *pkg);
+static int serial_frame(device_t *d, const uint8_t *src, int len);
+static int serial_write(device_t *d);
+static int serial_write_fail(device_t *d);
+static int serial_timeout(tick_t *tc);
+static uint16_t serial_crc(const uint8_t *data, int len);
+static int serial_cobs_encode(uint8_t *dst, const uint8_t *src, int len, uint16_t crc);
+static int serial_cobs_decode(uint8_t *dst, int max, const uint8_t *src, int len);
+static int serial_slip_encode(uint8_t *dst, const uint8_t *src, int len, uint16_t crc);
+static int serial_slip_decode(uint8_t *dst, int max, const uint8_t *src, int len);
+
+static const serial_framing_t serial_framings[] = {
+        { "cobs", 0x00,     serial_cobs_encode, serial_cobs_decode },
+        { "slip", SLIP_END, serial_slip_encode, serial_slip_decode },
+};
+
+#define SERIAL_FRAMINGS (sizeof(serial_framings) / sizeof(serial_framings[0]))
+
+// crc-16/ccitt, polynomial 0x1021
+static uint16_t crc_table[256];
+
+/*
+ * open every line in serial_devices, a list of names separated by
+ * commas. without the list there is none.
+ */
+int serial_init()
+{
+        char     buf[128];
+        char    *c, *name, *save;
+        uint16_t crc;
+        int      i, j;
+
+        for (i = 0; i < 256; i++)
+        {
+                crc = (uint16_t) (i << 8);
+                for (j = 0; j < 8; j++)
+                {
+                        crc = crc & 0x8000 ? (uint16_t) (crc << 1 ^ 0x1021) : (uint16_t) (crc << 1);
+                }
+                crc_table[i] = crc;
+        }
+
+        c = config_find(SERIAL_CONFIG_DEVICES);
+        if (!c) {
+                return 0;
+        }
+
+        strncpy(buf, c, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+
+        for (name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save))
+        {
+                if (serial_create(name) == -1) {
+                        return -1;
+                }
+        }
+
+        SERIAL_INFO("Initialize the SERIAL MODULE successed.");
+
+        return 0;
+}
+
+int serial_create(char *name)
+{
+        const serial_framing_t *f = NULL;
+        device_serial_t        *s;
+        device_t               *d;
+        char                   *c, *port, *baud;
+        size_t                  i;
+        int                     fd;
+
+        if (strlen(name) != SERIAL_NAME_LENGTH) {
+                logf_error("SERIAL", "Serial name %s is not 2 characters.", name);
+                return -1;
+        }
+
+        c = device_config(name, SERIAL_CONFIG_FRAMING);
+        c = c ? c : SERIAL_DEFAULT_FRAMING;
+        for (i = 0; i < SERIAL_FRAMINGS; i++)
+        {
+                if (!strcmp(c, serial_framings[i].name)) {
+                        f = &serial_framings[i];
+                }
+        }
+        if (!f) {
+                logf_error("SERIAL", "Serial framing %s is not cobs or slip.", c);
+                return -1;
+        }
+
+        d = (device_t*) calloc(1, sizeof(device_t));
+        s = (device_serial_t*) calloc(1, sizeof(device_serial_t));
+        if (!d || !s) {
+                SERIAL_ERROR("Can not alloc memory for the serial device.");
+                goto error;
+        }
+
+        s->framing = f;
+
+        d->name[0] = name[0];
+        d->name[1] = name[1];
+
+        c = device_config(name, SERIAL_CONFIG_MTU);
+        d->mtu = c ? atoi(c) : SERIAL_DEFAULT_MTU;
+
+        // a frame must fit in a packet buffer
+        if (d->mtu <= 0 || d->mtu > packet_mtu()) {
+                logf_error("SERIAL", "Serial MTU %d is larger than packet MTU %d.",
+                        d->mtu, packet_mtu());
+                goto error;
+        }
+
+        c = device_config(name, SERIAL_CONFIG_TIMEOUT);
+        s->timeout = c ? atoi(c) : SERIAL_DEFAULT_TIMEOUT;
+        if (s->timeout <= 0) {
+                s->timeout = SERIAL_DEFAULT_TIMEOUT;
+        }
+
+        // a frame being read, and room for the next read
+        s->rsize = SERIAL_FRAME_SIZE(d->mtu) * 2;
+        s->rbuf  = (uint8_t*) malloc(s->rsize);
+        s->wbuf  = (uint8_t*) malloc(SERIAL_FRAME_SIZE(d->mtu));
+        if (!s->rbuf || !s->wbuf) {
+                SERIAL_ERROR("Can not alloc memory for serial buffers.");
+                goto error;
+        }
+
+        if (!tick_create(s->timer)) {
+                SERIAL_ERROR("Can not alloc memory for a timer.");
+                goto error;
+        }
+        tick_init_timer(s->timer, serial_timeout, d);
+
+        c    = device_config(name, SERIAL_CONFIG_PORT);
+        port = c ? c : SERIAL_DEFAULT_PORT;
+        c    = device_config(name, SERIAL_CONFIG_BAUD);
+        baud = c ? c : SERIAL_DEFAULT_BAUD;
+
+        // raw, and does not block
+        if ((fd = device_open_tty(port, baud)) == -1) {
+                logf_error("SERIAL", "Can not open serial %s with port %s and baud rate %s.",
+                        name, port, baud);
+                goto error;
+        }
+        tcflush(fd, TCIOFLUSH);
+
+        d->fd     = fd;
+        d->input  = serial_input;
+        d->output = serial_output;
+        d->exit   = serial_exit;
+        d->report = serial_report;
+        d->drain  = serial_write;
+        d->priv   = s;
+
+        set_dev_read_available(d);
+        set_dev_write_available(d);
+
+        if (device_add(d) == -1) {
+                close(fd);
+                goto error;
+        }
+
+        logf_info("SERIAL", "Open serial %s with port %s, baud rate %s, %s framing successed.",
+                name, port, baud, f->name);
+
+        return 0;
+
+error:
+        if (s) {
+                if (s->timer) {
+                        tick_free(s->timer);
+                }
+                free(s->rbuf);
+                free(s->wbuf);
+        }
+        free(s);
+        free(d);
+        return -1;
+}
+
+int serial_exit(device_t *d)
+{
+        device_serial_t *s = (device_serial_t*) d->priv;
+
+        close(d->fd);
+
+        tick_delete(s->timer);
+        tick_free(s->timer);
+
+        free(s->rbuf);
+        free(s->wbuf);
+        free(s);
+
+        return 0;
+}
+
+int serial_report(device_t *d)
+{
+        device_serial_t *s = (device_serial_t*) d->priv;
+
+        logf_info("SERIAL", "%.2s %s framing, read %lu frames, dropped %lu bad.",
+                d->name, s->framing->name, s->rx_frames, s->rx_bad);
+
+        logf_info("SERIAL", "%.2s wrote %lu frames in parts, gave up %lu the port did not take.",
+                d->name, s->tx_partial, s->tx_stalled);
+
+        return 0;
+}
+
+/*
+ * read what the line has, every frame whole up to its delimiter is
+ * taken out of rbuf, the rest waits for the next read.
+ */
+int serial_input(device_t *d)
+{
+        device_serial_t *s     = (device_serial_t*) d->priv;
+        uint8_t          delim = s->framing->delim;
+        uint8_t         *p;
+        struct iovec     iov;
+        int              start = 0, pos, end, n;
+
+        iov.iov_base = s->rbuf + s->rlen;
+        iov.iov_len  = s->rsize - s->rlen;
+
+        n = event_read(d->ev, &iov, 1);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return 0;
+        } else if (n <= 0) {
+                logf_error("SERIAL", "%.2s can not read from the port: %s.",
+                        d->name, n ? strerror(errno) : "closed");
+                device_hangup(d);
+                return -1;
+        }
+
+        end = s->rlen + n;
+
+        for (pos = s->rlen; (p = memchr(s->rbuf + pos, delim, end - pos)); pos = start)
+        {
+                if (s->skip) {
+                        s->skip = 0;
+                } else if (p - s->rbuf > start) {
+                        serial_frame(d, s->rbuf + start, p - s->rbuf - start);
+                }
+
+                start = p - s->rbuf + 1;
+        }
+
+        // keep the frame not whole yet, unless it fills the buffer
+        if (s->skip) {
+                s->rlen = 0;
+        } else if (start == 0 && end == s->rsize) {
+                SERIAL_WARN("Drop a too long frame.");
+                s->rx_bad++;
+                s->skip = 1;
+                s->rlen = 0;
+        } else {
+                memmove(s->rbuf, s->rbuf + start, end - start);
+                s->rlen = end - start;
+        }
+
+        return 0;
+}
+
+/*
+ * len bytes between two delimiters, taken out straight into a packet
+ * from the pool. a damaged frame is a loss on the channel for the
+ * link estimator.
+ */
+static int serial_frame(device_t *d, const uint8_t *src, int len)
+{
+        device_serial_t *s = (device_serial_t*) d->priv;
+        packet_t        *pkg;
+        uint8_t         *data;
+        int              n;
+
+        pkg = packet_alloc();
+        if (!pkg) {
+                SERIAL_ERROR("Can not alloc memory for the packet.");
+                return -1;
+        }
+
+        data = (uint8_t*) pkg->pdu;
+        n    = s->framing->decode(data, packet_mtu() + SERIAL_CRC_LENGTH, src, len);
+
+        if (n < SERIAL_CRC_LENGTH ||
+            serial_crc(data, n - SERIAL_CRC_LENGTH) != (data[n - 2] << 8 | data[n - 1])) {
+                SERIAL_WARN("Drop a damaged frame.");
+                s->rx_bad++;
+                device_observe(d, n > 0 ? n : len, 0);
+                packet_put(pkg);
+                return -1;
+        }
+
+        pkg->len = n - SERIAL_CRC_LENGTH;
+        pkg->dev = d;
+        pkg->up  = 1;
+
+        s->rx_frames++;
+
+        return device_input_finish(pkg);
+}
+
+/*
+ * the frame goes out as fast as the port takes it while the event
+ * loop goes on. a delimiter in front ends whatever noise came before.
+ */
+int serial_output(packet_t *pkg)
+{
+        device_t        *d = pkg->dev;
+        device_serial_t *s = (device_serial_t*) d->priv;
+        uint8_t          delim = s->framing->delim;
+        int              n;
+
+        if (s->wpkg) {
+                return -1;
+        }
+
+        n = s->framing->encode(s->wbuf + 1, (uint8_t*) pkg->pdu, pkg->len,
+                serial_crc((uint8_t*) pkg->pdu, pkg->len));
+
+        s->wbuf[0]     = delim;
+        s->wbuf[n + 1] = delim;
+        s->wlen        = n + 2;
+        s->wpos        = 0;
+        s->wpkg        = pkg;
+
+        serial_write(d);
+
+        if (s->wpkg == pkg) {
+                s->tx_partial++;
+        }
+
+        return 0;
+}
+
+/*
+ * write what the port takes of the frame, on every write event
+ * until it is all out.
+ */
+static int serial_write(device_t *d)
+{
+        device_serial_t *s   = (device_serial_t*) d->priv;
+        packet_t        *pkg = s->wpkg;
+        struct iovec     iov;
+        int              n, wrote = 0;
+
+        if (!pkg) {
+                return 0;
+        }
+
+        while (s->wpos < s->wlen)
+        {
+                iov.iov_base = s->wbuf + s->wpos;
+                iov.iov_len  = s->wlen - s->wpos;
+
+                n = event_write(d->ev, &iov, 1);
+
+                if (n == -1 && errno == EINTR) {
+                        continue;
+                } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        if (wrote || !is_tick_armed(s->timer)) {
+                                tick_add(s->timer, s->timeout);
+                        }
+                        return device_output_pending(pkg);
+                } else if (n <= 0) {
+                        logf_error("SERIAL", "%.2s can not write to the port: %s.",
+                                d->name, n ? strerror(errno) : "closed");
+                        return serial_write_fail(d);
+                }
+
+                s->wpos += n;
+                wrote   += n;
+        }
+
+        tick_delete(s->timer);
+        s->wpkg = NULL;
+
+        device_output_finish(pkg);
+
+        return device_output_ready(d);
+}
+
+/*
+ * give up the frame being written, the other side drops the part it
+ * got at the next delimiter.
+ */
+static int serial_write_fail(device_t *d)
+{
+        device_serial_t *s   = (device_serial_t*) d->priv;
+        packet_t        *pkg = s->wpkg;
+
+        tick_delete(s->timer);
+        s->wpkg = NULL;
+
+        if (pkg) {
+                device_output_fail(pkg);
+        }
+
+        return device_output_ready(d);
+}
+
+static int serial_timeout(tick_t *tc)
+{
+        device_t        *d = (device_t*) tc->data;
+        device_serial_t *s = (device_serial_t*) d->priv;
+
+        if (!s->wpkg) {
+                return 0;
+        }
+
+        s->tx_stalled++;
+        logf_warn("SERIAL", "%.2s port took %d of %d bytes of the frame and no more in time, give it up.",
+                d->name, s->wpos, s->wlen);
+
+        tcflush(d->fd, TCOFLUSH);
+
+        return serial_write_fail(d);
+}
+
+static uint16_t serial_crc(const uint8_t *data, int len)
+{
+        uint16_t crc = 0xFFFF;
+        int      i;
+
+        for (i = 0; i < len; i++)
+        {
+                crc = (uint16_t) (crc << 8 ^ crc_table[(crc >> 8 ^ data[i]) & 0xFF]);
+        }
+
+        return crc;
+}
+
+/*
+ * cobs, the frame without its zeros. every run of at most 254 bytes
+ * has a code byte in front, one more than its length, and a zero
+ * followed it unless the code is 0xFF.
+ */
+static int serial_cobs_encode(uint8_t *dst, const uint8_t *src, int len, uint16_t crc)
+{
+        uint8_t tail[SERIAL_CRC_LENGTH] = { (uint8_t) (crc >> 8), (uint8_t) crc };
+        uint8_t b;
+        int     code = 0, out = 1, i;
+
+        for (i = 0; i < len + SERIAL_CRC_LENGTH; i++)
+        {
+                b = i < len ? src[i] : tail[i - len];
+
+                if (b) {
+                        dst[out++] = b;
+                        if (out - code < 0xFF) {
+                                continue;
+                        }
+                }
+
+                dst[code] = (uint8_t) (out - code);
+                code = out++;
+        }
+
+        dst[code] = (uint8_t) (out - code);
+
+        return out;
+}
+
+static int serial_cobs_decode(uint8_t *dst, int max, const uint8_t *src, int len)
+{
+        int code, i = 0, out = 0;
+
+        while (i < len)
+        {
+                code = src[i++];
+                if (!code || i + code - 1 > len || out + code - 1 > max) {
+                        return -1;
+                }
+
+                memcpy(dst + out, src + i, code - 1);
+                out += code - 1;
+                i   += code - 1;
+
+                if (code < 0xFF && i < len) {
+                        if (out == max) {
+                                return -1;
+                        }
+                        dst[out++] = 0;
+                }
+        }
+
+        return out;
+}
+
+/*
+ * slip, END and ESC in the frame are escaped by ESC.
+ */
+static int serial_slip_encode(uint8_t *dst, const uint8_t *src, int len, uint16_t crc)
+{
+        uint8_t tail[SERIAL_CRC_LENGTH] = { (uint8_t) (crc >> 8), (uint8_t) crc };
+        uint8_t b;
+        int     out = 0, i;
+
+        for (i = 0; i < len + SERIAL_CRC_LENGTH; i++)
+        {
+                b = i < len ? src[i] : tail[i - len];
+
+                if (b == SLIP_END) {
+                        dst[out++] = SLIP_ESC;
+                        dst[out++] = SLIP_ESC_END;
+                } else if (b == SLIP_ESC) {
+                        dst[out++] = SLIP_ESC;
+                        dst[out++] = SLIP_ESC_ESC;
+                } else {
+                        dst[out++] = b;
+                }
+        }
+
+        return out;
+}
+
+static int serial_slip_decode(uint8_t *dst, int max, const uint8_t *src, int len)
+{
+        int i, out = 0;
+
+        for (i = 0; i < len; i++)
+        {
+                if (out == max) {
+                        return -1;
+                }
+
+                if (src[i] != SLIP_ESC) {
+                        dst[out++] = src[i];
+                } else if (i + 1 < len && src[i + 1] == SLIP_ESC_END) {
+                        dst[out++] = SLIP_END;
+                        i++;
+                } else if (i + 1 < len && src[i + 1] == SLIP_ESC_ESC) {
+                        dst[out++] = SLIP_ESC;
+                        i++;
+                } else {
+                        return -1;
+                }
+        }
+
+        return out;
+}
@@ -0,0 +1,600 @@
+/*
+ * sim.c
+ *
+ * A simulated Aquasent modem, for running the stack without the
+ * hardware. The driver gets one end of a socketpair instead of a
+ * serial port, a thread on the other end answers $HHTXD with $MMOKY
+ * and queues the frame. Frames go on the air one after the other,
+ * each takes sim_preamble and the time its bits take at sim_rate,
+ * then the thread answers $MMTDN with its number and sends the frame
+ * to the simulated modem of the other host over UDP. Frames from there are lost with probability
+ * sim_loss, get bit errors at sim_ber, and come out as $MMRXD after
+ * sim_delay ms.
+ *
+ * Two instances on one box talk through it with sim_bind and sim_peer
+ * crossed. With the same sim_seed a run loses and damages the same
+ * frames again. With sim_capture, what the driver reads is written to
+ * that file too, for replaying it into the parser.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "device.h"
+#include "log.h"
+
+#define SIM_CONFIG_BIND         "sim_bind"
+#define SIM_DEFAULT_BIND        "127.0.0.1:45000"
+#define SIM_CONFIG_PEER         "sim_peer"
+#define SIM_DEFAULT_PEER        "127.0.0.1:45001"
+#define SIM_CONFIG_RATE         "sim_rate"
+#define SIM_DEFAULT_RATE        9600            // bits per second
+#define SIM_CONFIG_DELAY        "sim_delay"
+#define SIM_DEFAULT_DELAY       100             // ms
+#define SIM_CONFIG_PREAMBLE     "sim_preamble"
+#define SIM_DEFAULT_PREAMBLE    0               // ms
+#define SIM_CONFIG_LOSS         "sim_loss"
+#define SIM_DEFAULT_LOSS        0.0             // probability of a frame
+#define SIM_CONFIG_BER          "sim_ber"
+#define SIM_DEFAULT_BER         0.0             // probability of a bit
+#define SIM_CONFIG_SEED         "sim_seed"
+#define SIM_DEFAULT_SEED        1
+#define SIM_CONFIG_CAPTURE      "sim_capture"
+
+// a sentence from the driver, and a frame on the medium
+#define SIM_LINE_SIZE           8192
+#define SIM_FRAME_SIZE          (SIM_LINE_SIZE / 2)
+
+// frames the modem holds to send, the one on the air with them
+#define SIM_TX_DEPTH            16
+
+#define SIM_ERROR(s) log_error("SIM", (s))
+#define SIM_WARN(s)  log_warn ("SIM", (s))
+#define SIM_INFO(s)  log_info ("SIM", (s))
+#define SIM_DEBUG(s) log_debug("SIM", (s))
+
+// a frame on its way to the other modem or to the driver
+typedef struct sim_frame_s sim_frame_t;
+struct sim_frame_s {
+        uint64_t     at;        // us, CLOCK_MONOTONIC, done or delivered
+        int          len;
+        sim_frame_t *next;
+        unsigned char data[];
+};
+
+typedef struct sim_s sim_t;
+struct sim_s {
+        char name[3];
+
+        int fd;                 // our end of the socketpair
+        int udp;
+        int cap;                // sim_capture, or -1
+
+        struct sockaddr_in peer;
+
+        // the medium
+        unsigned int rate;
+        unsigned int delay;
+        unsigned int preamble;  // ms, every transmission
+        double       loss;
+        double       ber;
+        unsigned int seed;
+
+        // sentence from the driver
+        char line[SIM_LINE_SIZE];
+        int  line_len;
+
+        // frames to send, the first one on the air
+        sim_frame_t  *tx_head;
+        sim_frame_t  *tx_tail;
+        int           tx_count;
+        unsigned int  tx_pn;
+
+        // frames received, in order of time
+        sim_frame_t *rx_head;
+        sim_frame_t *rx_tail;
+};
+
+int sim_open(char *name);
+static int sim_addr(char *s, struct sockaddr_in *addr);
+static void *sim_thread(void *arg);
+static int sim_input(sim_t *sim);
+static int sim_sentence(sim_t *sim, char *line, int len);
+static int sim_medium(sim_t *sim);
+static int sim_send(sim_t *sim, uint64_t now);
+static int sim_deliver(sim_t *sim);
+static int sim_write(sim_t *sim, char *buf, int len);
+static void sim_damage(sim_t *sim, unsigned char *data, int len);
+
+static const char sim_hex[] = "0123456789ABCDEF";
+
+#define sim_hex_value(c)        ((unsigned char) ((c) >= 'A' ? (c) - 'A' + 10 : (c) - '0') & 0x0f)
+
+static uint64_t sim_now()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double sim_random(sim_t *sim)
+{
+        return (double) rand_r(&sim->seed) / ((double) RAND_MAX + 1);
+}
+
+/*
+ * start the simulated modem named name, return the fd the driver
+ * uses as its serial port.
+ */
+int sim_open(char *name)
+{
+        struct sockaddr_in addr;
+        sigset_t  set, old;
+        pthread_t tid;
+        sim_t    *sim;
+        char     *c;
+        int       sv[2];
+
+        sim = (sim_t*) calloc(1, sizeof(sim_t));
+        if (!sim) {
+                SIM_ERROR("Can not alloc memory for the simulated modem.");
+                return -1;
+        }
+
+        snprintf(sim->name, sizeof(sim->name), "%s", name);
+
+        c = device_config(name, SIM_CONFIG_RATE);
+        sim->rate = c ? atoi(c) : SIM_DEFAULT_RATE;
+        if (!sim->rate) {
+                sim->rate = SIM_DEFAULT_RATE;
+        }
+
+        c = device_config(name, SIM_CONFIG_DELAY);
+        sim->delay = c ? atoi(c) : SIM_DEFAULT_DELAY;
+
+        c = device_config(name, SIM_CONFIG_PREAMBLE);
+        sim->preamble = c ? atoi(c) : SIM_DEFAULT_PREAMBLE;
+
+        c = device_config(name, SIM_CONFIG_LOSS);
+        sim->loss = c ? atof(c) : SIM_DEFAULT_LOSS;
+
+        c = device_config(name, SIM_CONFIG_BER);
+        sim->ber = c ? atof(c) : SIM_DEFAULT_BER;
+
+        c = device_config(name, SIM_CONFIG_SEED);
+        sim->seed = c ? atoi(c) : SIM_DEFAULT_SEED;
+
+        sim->cap = -1;
+        c = device_config(name, SIM_CONFIG_CAPTURE);
+        if (c) {
+                sim->cap = open(c, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (sim->cap == -1) {
+                        logf_error("SIM", "Can not open capture %s: %s.", c, strerror(errno));
+                        goto error;
+                }
+        }
+
+        c = device_config(name, SIM_CONFIG_PEER);
+        if (sim_addr(c ? c : SIM_DEFAULT_PEER, &sim->peer) == -1) {
+                SIM_ERROR("Invalid address of the peer modem.");
+                goto error;
+        }
+
+        c = device_config(name, SIM_CONFIG_BIND);
+        if (sim_addr(c ? c : SIM_DEFAULT_BIND, &addr) == -1) {
+                SIM_ERROR("Invalid address of the simulated modem.");
+                goto error;
+        }
+
+        sim->udp = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (sim->udp == -1) {
+                SIM_ERROR(strerror(errno));
+                goto error;
+        }
+
+        if (bind(sim->udp, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+                SIM_ERROR(strerror(errno));
+                close(sim->udp);
+                goto error;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+                SIM_ERROR(strerror(errno));
+                close(sim->udp);
+                goto error;
+        }
+
+        sim->fd = sv[1];
+
+        // the end of the driver does not block, like the serial port
+        if (fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1) {
+                SIM_ERROR(strerror(errno));
+                close(sv[0]);
+                close(sv[1]);
+                close(sim->udp);
+                goto error;
+        }
+
+        // signals always go to the main loop
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+
+        if (pthread_create(&tid, NULL, sim_thread, sim) != 0) {
+                pthread_sigmask(SIG_SETMASK, &old, NULL);
+                SIM_ERROR("Can not create simulated modem thread.");
+                close(sv[0]);
+                close(sv[1]);
+                close(sim->udp);
+                goto error;
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        pthread_detach(tid);
+
+        logf_info("SIM", "Simulate modem %s at %u bit/s, preamble %u ms, delay %u ms, loss %g, BER %g.",
+                name, sim->rate, sim->preamble, sim->delay, sim->loss, sim->ber);
+
+        return sv[0];
+
+error:
+        if (sim->cap != -1) {
+                close(sim->cap);
+        }
+        free(sim);
+        return -1;
+}
+
+/*
+ * "host:port" to an address.
+ */
+static int sim_addr(char *s, struct sockaddr_in *addr)
+{
+        char  host[64];
+        char *colon = strchr(s, ':');
+
+        if (!colon || colon - s >= (int) sizeof(host)) {
+                return -1;
+        }
+
+        memcpy(host, s, colon - s);
+        host[colon - s] = '\0';
+
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        addr->sin_port   = htons(atoi(colon + 1));
+
+        if (inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static void *sim_thread(void *arg)
+{
+        sim_t   *sim = (sim_t*) arg;
+        struct pollfd fds[2];
+        uint64_t now, next;
+        int      timeout;
+
+        fds[0].fd     = sim->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd     = sim->udp;
+        fds[1].events = POLLIN;
+
+        for (;;)
+        {
+                // wait until the next thing happens on the medium
+                now  = sim_now();
+                next = 0;
+                if (sim->tx_head) {
+                        next = sim->tx_head->at;
+                }
+                if (sim->rx_head && (!next || sim->rx_head->at < next)) {
+                        next = sim->rx_head->at;
+                }
+
+                if (!next) {
+                        timeout = -1;
+                } else if (next <= now) {
+                        timeout = 0;
+                } else {
+                        timeout = (int) ((next - now + 999) / 1000);
+                }
+
+                if (poll(fds, 2, timeout) == -1 && errno != EINTR) {
+                        SIM_ERROR(strerror(errno));
+                        break;
+                }
+
+                if ((fds[0].revents & (POLLIN | POLLHUP)) && sim_input(sim) == -1) {
+                        break;
+                }
+
+                if (fds[1].revents & POLLIN) {
+                        sim_medium(sim);
+                }
+
+                now = sim_now();
+
+                while (sim->tx_head && sim->tx_head->at <= now)
+                {
+                        sim_send(sim, now);
+                }
+
+                while (sim->rx_head && sim->rx_head->at <= now)
+                {
+                        sim_deliver(sim);
+                }
+        }
+
+        logf_warn("SIM", "Simulated modem %s stops.", sim->name);
+
+        return NULL;
+}
+
+/*
+ * sentences from the driver, split at CR LF.
+ */
+static int sim_input(sim_t *sim)
+{
+        char *end;
+        int   n, len;
+
+        n = read(sim->fd, sim->line + sim->line_len, SIM_LINE_SIZE - sim->line_len);
+        if (n == -1) {
+                return errno == EINTR || errno == EAGAIN ? 0 : -1;
+        } else if (n == 0) {
+                return -1;
+        }
+
+        sim->line_len += n;
+
+        while ((end = memchr(sim->line, '\n', sim->line_len)))
+        {
+                len = end - sim->line + 1;
+
+                sim_sentence(sim, sim->line, len);
+
+                sim->line_len -= len;
+                memmove(sim->line, end + 1, sim->line_len);
+        }
+
+        // a sentence longer than any frame
+        if (sim->line_len == SIM_LINE_SIZE) {
+                SIM_WARN("Drop a too long sentence.");
+                sim->line_len = 0;
+        }
+
+        return 0;
+}
+
+/*
+ * $HHTXD,dst,rate,ack,hex is accepted with $MMOKY at once, the
+ * frame takes its bits over the medium after the frames before it.
+ */
+static int sim_sentence(sim_t *sim, char *line, int len)
+{
+        static char okay[] = "$MMOKY,HHTXD\r\n";
+
+        unsigned char buf[SIM_FRAME_SIZE];
+        sim_frame_t  *f;
+        char         *p = line, *end = line + len;
+        uint64_t      start;
+        int           commas = 0, n = 0;
+
+        if (len < 6 || strncmp(line, "$HHTXD", 6)) {
+                return 0;
+        }
+
+        while (p < end && commas < 4)
+        {
+                if (*p++ == ',') {
+                        commas++;
+                }
+        }
+
+        if (sim->tx_count == SIM_TX_DEPTH) {
+                SIM_WARN("Drop a frame sent while the modem queue is full.");
+                return 0;
+        }
+
+        for (; p + 1 < end && p[0] != '\r' && n < SIM_FRAME_SIZE; p += 2)
+        {
+                buf[n++] = sim_hex_value(p[0]) << 4 | sim_hex_value(p[1]);
+        }
+
+        if (!n) {
+                return 0;
+        }
+
+        f = (sim_frame_t*) malloc(sizeof(sim_frame_t) + n);
+        if (!f) {
+                return -1;
+        }
+
+        start = sim_now();
+        if (sim->tx_tail && sim->tx_tail->at > start) {
+                start = sim->tx_tail->at;
+        }
+
+        memcpy(f->data, buf, n);
+        f->len  = n;
+        f->at   = start + (uint64_t) sim->preamble * 1000 +
+                  (uint64_t) n * 8 * 1000000 / sim->rate;
+        f->next = NULL;
+
+        if (sim->tx_tail) {
+                sim->tx_tail->next = f;
+        } else {
+                sim->tx_head = f;
+        }
+        sim->tx_tail = f;
+        sim->tx_count++;
+
+        return sim_write(sim, okay, sizeof(okay) - 1);
+}
+
+/*
+ * the last bit is out, tell the driver and put the frame on the
+ * medium to the other modem.
+ */
+static int sim_send(sim_t *sim, uint64_t now)
+{
+        sim_frame_t *f = sim->tx_head;
+        char         done[32];
+        int          n;
+
+        n = snprintf(done, sizeof(done), "$MMTDN,0,%u\r\n", ++sim->tx_pn);
+
+        if (sendto(sim->udp, f->data, f->len, 0,
+                   (struct sockaddr*) &sim->peer, sizeof(sim->peer)) == -1) {
+                SIM_DEBUG(strerror(errno));
+        }
+
+        sim->tx_head = f->next;
+        if (!sim->tx_head) {
+                sim->tx_tail = NULL;
+        }
+        sim->tx_count--;
+        free(f);
+
+        return sim_write(sim, done, n);
+}
+
+/*
+ * a frame from the other modem, it may be lost or damaged, and
+ * comes out after the propagation delay.
+ */
+static int sim_medium(sim_t *sim)
+{
+        unsigned char buf[SIM_FRAME_SIZE];
+        sim_frame_t  *f;
+        int           n;
+
+        n = recv(sim->udp, buf, sizeof(buf), 0);
+        if (n <= 0) {
+                return -1;
+        }
+
+        if (sim_random(sim) < sim->loss) {
+                return 0;
+        }
+
+        f = (sim_frame_t*) malloc(sizeof(sim_frame_t) + n);
+        if (!f) {
+                return -1;
+        }
+
+        memcpy(f->data, buf, n);
+        f->len  = n;
+        f->at   = sim_now() + (uint64_t) sim->delay * 1000;
+        f->next = NULL;
+
+        sim_damage(sim, f->data, n);
+
+        if (sim->rx_tail) {
+                sim->rx_tail->next = f;
+        } else {
+                sim->rx_head = f;
+        }
+        sim->rx_tail = f;
+
+        return 0;
+}
+
+/*
+ * flip every bit with probability ber, the gap to the next error is
+ * drawn at once instead of a draw for each bit.
+ */
+static void sim_damage(sim_t *sim, unsigned char *data, int len)
+{
+        double bit;
+
+        if (sim->ber <= 0) {
+                return;
+        }
+
+        for (bit = 0;;)
+        {
+                bit += floor(log(1 - sim_random(sim)) / log(1 - sim->ber));
+                if (bit >= (double) len * 8) {
+                        break;
+                }
+
+                data[(int) bit / 8] ^= 1 << ((int) bit % 8);
+                bit++;
+        }
+}
+
+static int sim_deliver(sim_t *sim)
+{
+        static char head[] = "$MMRXD,0,0,";
+
+        char         buf[sizeof(head) + SIM_FRAME_SIZE * 2 + 2];
+        sim_frame_t *f = sim->rx_head;
+        int          i, n;
+
+        sim->rx_head = f->next;
+        if (!sim->rx_head) {
+                sim->rx_tail = NULL;
+        }
+
+        n = sizeof(head) - 1;
+        memcpy(buf, head, n);
+
+        for (i = 0; i < f->len; i++)
+        {
+                buf[n++] = sim_hex[f->data[i] >> 4];
+                buf[n++] = sim_hex[f->data[i] & 0x0f];
+        }
+
+        buf[n++] = '\r';
+        buf[n++] = '\n';
+
+        free(f);
+
+        return sim_write(sim, buf, n);
+}
+
+static int sim_write(sim_t *sim, char *buf, int len)
+{
+        int n;
+
+        // a capture short of some sentences is still one to replay
+        if (sim->cap != -1 && write(sim->cap, buf, len) != len) {
+                SIM_WARN("Can not write the capture, stop it.");
+                close(sim->cap);
+                sim->cap = -1;
+        }
+
+        while (len > 0)
+        {
+                n = write(sim->fd, buf, len);
+                if (n == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        SIM_ERROR(strerror(errno));
+                        return -1;
+                }
+
+                buf += n;
+                len -= n;
+        }
+
+        return 0;
+}
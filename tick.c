@@ -0,0 +1,363 @@
+/*
+ * tick.c
+ *
+ * Timers of the event module, kept in a hierarchical timing wheel.
+ *
+ * Level 0 has one slot per millisecond for the next 64 ms, every
+ * upper level slot covers 64 slots of the level below. A timer is put
+ * in the lowest level its delay fits, and moved down (cascade) when
+ * the wheel reaches the start of its slot, so adding and deleting a
+ * timer are O(1) and expired timers are taken a whole slot at once.
+ * A bitmap of the used slots per level gives the nearest expiry for
+ * the event loop timeout without walking the timers.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include "tick.h"
+#include "log.h"
+#include "queue.h"
+
+#define TICK_ERROR(s) log_error("TICK", (s))
+#define TICK_WARN(s)  log_warn ("TICK", (s))
+#define TICK_INFO(s)  log_info ("TICK", (s))
+#define TICK_DEBUG(s) log_debug("TICK", (s))
+
+#define TICK_WHEEL_BITS         6
+#define TICK_WHEEL_SLOTS        (1 << TICK_WHEEL_BITS)
+#define TICK_WHEEL_MASK         (TICK_WHEEL_SLOTS - 1)
+#define TICK_WHEEL_LEVELS       5
+
+// 2^30 ms, about 12 days, longer timers wait at the top level
+#define TICK_WHEEL_RANGE        (1ULL << (TICK_WHEEL_BITS * TICK_WHEEL_LEVELS))
+
+#define TICK_LEVEL_SHIFT(l)     ((l) * TICK_WHEEL_BITS)
+#define TICK_LEVEL_INDEX(t, l)  (((t) >> TICK_LEVEL_SHIFT(l)) & TICK_WHEEL_MASK)
+
+#define TICK_NONE               UINT64_MAX
+
+typedef struct tick_wheel_s tick_wheel_t;
+struct tick_wheel_s {
+        // every timer expire before now is fired
+        uint64_t now;
+
+        queue_t  slot[TICK_WHEEL_LEVELS][TICK_WHEEL_SLOTS];
+        uint64_t used[TICK_WHEEL_LEVELS];
+
+        unsigned int count;
+};
+
+static __thread tick_wheel_t wheel;
+
+static int tick_place(tick_t *tc);
+static void tick_take(queue_t *to, queue_t *from);
+static int tick_cascade(int level);
+static uint64_t tick_next();
+
+int tick_init()
+{
+        int l, s;
+
+        for (l = 0; l < TICK_WHEEL_LEVELS; l++)
+        {
+                for (s = 0; s < TICK_WHEEL_SLOTS; s++)
+                {
+                        queue_init(&wheel.slot[l][s]);
+                }
+                wheel.used[l] = 0;
+        }
+
+        wheel.now   = tick_now();
+        wheel.count = 0;
+
+        return 0;
+}
+
+/*
+ * the timers belong to other modules, just take them off the wheel.
+ */
+int tick_exit()
+{
+        tick_t  *tc;
+        queue_t *h;
+        int l, s;
+
+        for (l = 0; l < TICK_WHEEL_LEVELS; l++)
+        {
+                for (s = 0; s < TICK_WHEEL_SLOTS; s++)
+                {
+                        h = &wheel.slot[l][s];
+                        while (!queue_empty(h))
+                        {
+                                tc = queue_data(queue_first(h), tick_t, queue);
+                                queue_delete(&tc->queue);
+                                tc->level = -1;
+                        }
+                }
+                wheel.used[l] = 0;
+        }
+
+        wheel.count = 0;
+
+        return 0;
+}
+
+uint64_t tick_now()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * arm the timer to expire after ms, if it is armed already,
+ * move it to the new time.
+ */
+int tick_add(tick_t *tc, int ms)
+{
+        if (!tc || !tc->timeout) {
+                TICK_ERROR("Can not add an invalid tick.");
+                return -1;
+        }
+
+        if (is_tick_armed(tc)) {
+                tick_delete(tc);
+        }
+
+        tc->expire = tick_now() + (ms > 0 ? ms : 0);
+
+        wheel.count++;
+
+        return tick_place(tc);
+}
+
+int tick_delete(tick_t *tc)
+{
+        if (!is_tick_armed(tc)) {
+                return 0;
+        }
+
+        queue_delete(&tc->queue);
+
+        if (queue_empty(&wheel.slot[tc->level][tc->slot])) {
+                wheel.used[tc->level] &= ~(1ULL << tc->slot);
+        }
+
+        tc->level = -1;
+
+        wheel.count--;
+
+        return 0;
+}
+
+/*
+ * put the timer in the lowest level its delay fits.
+ */
+static int tick_place(tick_t *tc)
+{
+        uint64_t expire = tc->expire;
+        uint64_t delta;
+        int level;
+
+        if (expire < wheel.now) {
+                expire = wheel.now;
+        }
+
+        delta = expire - wheel.now;
+        if (delta >= TICK_WHEEL_RANGE) {
+                delta  = TICK_WHEEL_RANGE - 1;
+                expire = wheel.now + delta;
+        }
+
+        for (level = 0; level < TICK_WHEEL_LEVELS - 1; level++)
+        {
+                if (delta < (1ULL << TICK_LEVEL_SHIFT(level + 1))) {
+                        break;
+                }
+        }
+
+        tc->level = level;
+        tc->slot  = TICK_LEVEL_INDEX(expire, level);
+
+        queue_insert_tail(&wheel.slot[level][tc->slot], &tc->queue);
+        wheel.used[level] |= 1ULL << tc->slot;
+
+        return 0;
+}
+
+/*
+ * move all the timers of a slot to another list head.
+ */
+static void tick_take(queue_t *to, queue_t *from)
+{
+        queue_init(to);
+
+        if (queue_empty(from)) {
+                return;
+        }
+
+        to->next       = from->next;
+        to->prev       = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+
+        queue_init(from);
+}
+
+/*
+ * the wheel reached the start of a slot in this level,
+ * move its timers to the lower levels.
+ */
+static int tick_cascade(int level)
+{
+        queue_t  head;
+        tick_t  *tc;
+        int slot = TICK_LEVEL_INDEX(wheel.now, level);
+
+        // a timer out of range may go back to the same slot
+        tick_take(&head, &wheel.slot[level][slot]);
+        wheel.used[level] &= ~(1ULL << slot);
+
+        while (!queue_empty(&head))
+        {
+                tc = queue_data(queue_first(&head), tick_t, queue);
+                queue_delete(&tc->queue);
+                tick_place(tc);
+        }
+
+        return 0;
+}
+
+static inline uint64_t tick_rotate(uint64_t used, int n)
+{
+        return n ? (used >> n) | (used << (TICK_WHEEL_SLOTS - n)) : used;
+}
+
+/*
+ * the nearest time something must be done: a level 0 slot expire,
+ * or an used upper level slot must be cascaded.
+ */
+static uint64_t tick_next()
+{
+        uint64_t next = TICK_NONE;
+        uint64_t used, base, b, t;
+        int level, idx;
+
+        if (!wheel.count) {
+                return TICK_NONE;
+        }
+
+        // level 0 slots hold the timers in [now, now + 64)
+        if (wheel.used[0]) {
+                idx  = TICK_LEVEL_INDEX(wheel.now, 0);
+                used = tick_rotate(wheel.used[0], idx);
+                next = wheel.now + __builtin_ctzll(used);
+        }
+
+        for (level = 1; level < TICK_WHEEL_LEVELS; level++)
+        {
+                if (!wheel.used[level]) {
+                        continue;
+                }
+
+                base = wheel.now >> TICK_LEVEL_SHIFT(level);
+                idx  = base & TICK_WHEEL_MASK;
+                used = tick_rotate(wheel.used[level], idx);
+
+                // the current slot is cascaded already unless the
+                // wheel stands right at its start
+                if ((used & 1) && (base << TICK_LEVEL_SHIFT(level)) < wheel.now) {
+                        used &= ~1ULL;
+                        b = used ? base + __builtin_ctzll(used) : base + TICK_WHEEL_SLOTS;
+                } else {
+                        b = base + __builtin_ctzll(used);
+                }
+
+                t = b << TICK_LEVEL_SHIFT(level);
+                if (t < next) {
+                        next = t;
+                }
+        }
+
+        return next;
+}
+
+/*
+ * how long the event loop can sleep, in ms, -1 means no timer.
+ */
+int tick_timeout()
+{
+        uint64_t next = tick_next();
+        uint64_t now;
+
+        if (next == TICK_NONE) {
+                return -1;
+        }
+
+        now = tick_now();
+        if (next <= now) {
+                return 0;
+        }
+
+        if (next - now > INT_MAX) {
+                return INT_MAX;
+        }
+
+        return next - now;
+}
+
+/*
+ * fire all the expired timers. the wheel jumps over the time
+ * nothing happens, and takes a whole level 0 slot at once.
+ */
+int tick_process()
+{
+        uint64_t cur = tick_now();
+        uint64_t t;
+        queue_t  expired;
+        tick_t  *tc;
+        int level, n = 0;
+
+        while (wheel.now <= cur)
+        {
+                t = tick_next();
+                if (t > cur) {
+                        wheel.now = cur + 1;
+                        break;
+                }
+
+                wheel.now = t;
+
+                // cascade from the lower levels up, like a carry
+                for (level = 1; level < TICK_WHEEL_LEVELS; level++)
+                {
+                        if (t & ((1ULL << TICK_LEVEL_SHIFT(level)) - 1)) {
+                                break;
+                        }
+                        tick_cascade(level);
+                }
+
+                // take the expired slot, callbacks may add timers
+                level = TICK_LEVEL_INDEX(t, 0);
+                tick_take(&expired, &wheel.slot[0][level]);
+                wheel.used[0] &= ~(1ULL << level);
+
+                wheel.now = t + 1;
+
+                while (!queue_empty(&expired))
+                {
+                        tc = queue_data(queue_first(&expired), tick_t, queue);
+                        queue_delete(&tc->queue);
+                        tc->level = -1;
+                        wheel.count--;
+                        n++;
+
+                        tc->timeout(tc);
+                }
+        }
+
+        return n;
+}
@@ -0,0 +1,56 @@
+#ifndef _TICK_H_
+#define _TICK_H_
+
+#include <stdint.h>
+#include "queue.h"
+#include "pool.h"
+
+#define tick_create(tc)         ((tc) = (tick_t*) pool_alloc(POOL_TICK))
+#define tick_free(tc)           pool_free(POOL_TICK, (tc))
+
+typedef uint8_t ptc_id_t;
+typedef struct tick_s tick_t;
+
+// tick callback function
+typedef int (*tc_cb_fn)(tick_t *tc);
+
+/*
+ * a timer, owned by the module that arm it. the wheel never frees
+ * it, the callback may arm it again.
+ */
+struct tick_s {
+        ptc_id_t ptc;
+
+        uint64_t expire;        // ms, CLOCK_MONOTONIC
+
+        // position in the wheel, level is -1 while not armed
+        int level;
+        int slot;
+
+        tc_cb_fn timeout;
+        void    *data;
+
+        queue_t queue;
+};
+
+#define tick_init_timer(tc, fn, d)                                      \
+({                                                                      \
+        (tc)->level   = -1;                                             \
+        (tc)->timeout = (fn);                                           \
+        (tc)->data    = (d);                                            \
+})
+
+#define is_tick_armed(tc)       ((tc)->level != -1)
+
+// for event module
+int tick_init();
+int tick_exit();
+int tick_timeout();
+int tick_process();
+
+// for other module
+uint64_t tick_now();
+int tick_add(tick_t *tc, int ms);
+int tick_delete(tick_t *tc);
+
+#endif // _TICK_H_